@@ -0,0 +1,415 @@
+/**
+ * @brief   Benchmark driver for the storage engine, built and run by `make bench`. Loads N keys into a fresh database,
+ *          then runs a read only phase and a mixed get/set/del phase, calling set and get directly rather than going
+ *          through the command line. For each phase it reports throughput, p50/p99/p999 latency of each operation and
+ *          the bytes read and written per operation, so changes to the storage engine can be measured.
+ *          Keys are "pNNN:id" padded to a random length, where the prefix pNNN is drawn from a Zipf distribution so
+ *          some prefixes hold many more keys than others. Values are random letters of a random length.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "definitions.h"
+#include "index.h"
+#include "set.h"
+#include "get.h"
+#include "lock.h"
+#include "shard.h"
+#include "record.h"
+#include "blob.h"
+#include "cache.h"
+
+// Number of operation types timed separately: get, set and del
+#define BENCH_OPS 3
+
+static const char* opNames[BENCH_OPS] = {"get", "set", "del"};
+
+/**
+ * @brief Options of a benchmark run, set from the command line
+*/
+typedef struct bench_options{
+    long int keys;          // Number of keys loaded before the timed phases
+    long int ops;           // Number of operations in each of the get and mixed phases
+    int keyMin, keyMax;     // Range of key lengths
+    int valueMin, valueMax; // Range of value lengths
+    int prefixes;           // Number of distinct key prefixes
+    double skew;            // Zipf exponent of the prefix distribution, 0 for uniform
+    int mix[BENCH_OPS];     // Percentage of gets, sets and dels in the mixed phase
+    int shards;
+    int locked;             // Whether to go through the locks and group commit, as ./kvdb does
+    uint64_t seed;
+    char* dir;              // Directory the database is created in
+    char* cache;            // Budget of the cache of recently read keys, see cache.c, or NULL for no cache
+} BenchOptions;
+
+/**
+ * @brief I/O done by the process, from /proc/self/io and getrusage
+*/
+typedef struct io_counters{
+    uint64_t readCalls;     // Bytes read by read system calls, including from the page cache
+    uint64_t writeCalls;    // Bytes written by write system calls
+    uint64_t readDisk;      // Bytes read from storage
+    uint64_t writeDisk;     // Bytes written to storage
+    uint64_t faults;        // Page faults, i.e. pages touched through the mappings for the first time
+} IoCounters;
+
+/**
+ * @brief Latencies of each operation type in a phase, in nanoseconds
+*/
+typedef struct phase_stats{
+    uint64_t* latency[BENCH_OPS];
+    size_t count[BENCH_OPS];
+    IoCounters start;
+    double startTime;
+} PhaseStats;
+
+/**
+ * @brief Small xorshift random number generator, so runs are repeatable for a given seed
+*/
+uint64_t nextRandom(uint64_t* state){
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * @brief Small function to get a random integer from min to max inclusive
+*/
+int randomRange(uint64_t* state, int min, int max){
+    return min + (int)(nextRandom(state) % (uint64_t)(max - min + 1));
+}
+
+/**
+ * @brief Small function to get the current time in seconds from a monotonic clock
+*/
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief   Reads the I/O counters of the process. Counters that can't be read are left at 0
+ * @param[out]  io      On return, holds the counters
+*/
+void readCounters(IoCounters* io){
+    memset(io, 0, sizeof(IoCounters));
+    FILE* file = fopen("/proc/self/io", "r");
+    if (file != NULL){
+        char name[32];
+        unsigned long long value;
+        while (fscanf(file, "%31[^:]: %llu\n", name, &value) == 2){
+            if (strcmp(name, "rchar") == 0) io -> readCalls = value;
+            else if (strcmp(name, "wchar") == 0) io -> writeCalls = value;
+            else if (strcmp(name, "read_bytes") == 0) io -> readDisk = value;
+            else if (strcmp(name, "write_bytes") == 0) io -> writeDisk = value;
+        }
+        fclose(file);
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) io -> faults = usage.ru_minflt + usage.ru_majflt;
+}
+
+/**
+ * @brief   Builds the key with the given id. The same id always gives the same key, so keys can be looked up again
+ *          without being stored
+ * @param[in]   options Options of the run
+ * @param[in]   prefixCdf   Cumulative distribution of the prefixes
+ * @param[in]   id      Number of the key
+ * @param[out]  key     Buffer of at least MAX_KEY_SIZE bytes to hold the key
+*/
+void makeKey(BenchOptions* options, double* prefixCdf, long int id, char* key){
+    uint64_t state = (id + 1) * 0x9e3779b97f4a7c15ULL ^ options -> seed;
+    nextRandom(&state);
+    // Pick a prefix by binary searching the cumulative distribution
+    double u = (nextRandom(&state) >> 11) * (1.0 / 9007199254740992.0);
+    int low = 0, high = options -> prefixes - 1;
+    while (low < high){
+        int mid = (low + high) / 2;
+        if (prefixCdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    int length = snprintf(key, MAX_KEY_SIZE, "p%03d:%ld", low, id);
+    int target = randomRange(&state, options -> keyMin, options -> keyMax);
+    while (length < target) key[length++] = 'a' + nextRandom(&state) % 26;
+    key[length] = '\0';
+}
+
+/**
+ * @brief Small function to fill a buffer with a random value of a random length
+*/
+void makeValue(BenchOptions* options, uint64_t* state, char* value){
+    int length = randomRange(state, options -> valueMin, options -> valueMax);
+    for (int i = 0; i < length; i++) value[i] = 'a' + nextRandom(state) % 26;
+    value[length] = '\0';
+}
+
+/**
+ * @brief   Runs one operation against the database, either calling set and get directly or, if options -> locked is
+ *          set, taking the same locks and going through the same group commit as ./kvdb
+ * @param[in]   options Options of the run
+ * @param[in]   db      Open database
+ * @param[in]   op      Operation, 0 for get, 1 for set and 2 for del
+ * @param[in]   key     Key of the operation
+ * @param[in]   value   Value to be set
+ * @param[in]   out     Stream the result of a get is printed to
+*/
+int runOp(BenchOptions* options, Database* db, int op, char* key, char* value, FILE* out){
+    int shard = shardOf(db, key);
+    FILE* data = db -> data[shard];
+    FILE* index = db -> index[shard];
+    if (op == 0){
+        if (!options -> locked) return get(data, index, key, 0, out);
+        if (beginRead(data, index, shard) != 0) return -1;
+        int result = get(data, index, key, 0, out);
+        endRead(shard);
+        return result;
+    }
+    Pair entry;
+    char null[] = "null";
+    memset(&entry, 0, sizeof(entry));
+    if (op == 1 && initPair(&entry, key, value, stderr) != 0) return -1;
+    if (op == 2) value = null;
+    if (options -> locked) return commitWrite(data, index, shard, key, value, &entry, op == 2);
+    return set(data, index, key, value, &entry, op == 2);
+}
+
+/**
+ * @brief Small function to compare latencies for qsort
+*/
+int compareLatency(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Small function to get a percentile of sorted latencies, in microseconds
+*/
+double percentile(uint64_t* latency, size_t count, double p){
+    size_t i = (size_t)(p * count);
+    if (i >= count) i = count - 1;
+    return latency[i] / 1e3;
+}
+
+/**
+ * @brief   Starts timing a phase
+ * @param[out]  stats   Stats of the phase, with room for ops latencies of each operation type
+*/
+int beginPhase(PhaseStats* stats, long int ops){
+    memset(stats, 0, sizeof(PhaseStats));
+    for (int op = 0; op < BENCH_OPS; op++){
+        stats -> latency[op] = malloc(ops * sizeof(uint64_t));
+        if (stats -> latency[op] == NULL) return -1;
+    }
+    readCounters(&stats -> start);
+    stats -> startTime = now();
+    return 0;
+}
+
+/**
+ * @brief   Prints the throughput, latencies and I/O of a phase, then frees its stats
+ * @param[in]   name    Name of the phase
+ * @param[in]   stats   Stats of the phase
+*/
+void endPhase(char* name, PhaseStats* stats){
+    double seconds = now() - stats -> startTime;
+    IoCounters end;
+    readCounters(&end);
+    size_t total = 0;
+    for (int op = 0; op < BENCH_OPS; op++) total += stats -> count[op];
+    if (total == 0) total = 1;
+    printf("%s: %zu ops in %.3f s, %.0f ops/s\n", name, total, seconds, total / seconds);
+    printf("  %-4s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p99 us", "p999 us");
+    for (int op = 0; op < BENCH_OPS; op++){
+        size_t count = stats -> count[op];
+        if (count > 0){
+            qsort(stats -> latency[op], count, sizeof(uint64_t), compareLatency);
+            printf("  %-4s %10zu %10.2f %10.2f %10.2f\n", opNames[op], count,
+                percentile(stats -> latency[op], count, 0.5), percentile(stats -> latency[op], count, 0.99),
+                percentile(stats -> latency[op], count, 0.999));
+        }
+        free(stats -> latency[op]);
+    }
+    printf("  per op: %.1f B read, %.1f B written by syscalls, %.1f B read, %.1f B written to storage, "
+        "%.3f page faults\n",
+        (double)(end.readCalls - stats -> start.readCalls) / total,
+        (double)(end.writeCalls - stats -> start.writeCalls) / total,
+        (double)(end.readDisk - stats -> start.readDisk) / total,
+        (double)(end.writeDisk - stats -> start.writeDisk) / total,
+        (double)(end.faults - stats -> start.faults) / total);
+}
+
+/**
+ * @brief Small function to time one operation and record its latency in the stats of the phase
+*/
+void timeOp(BenchOptions* options, Database* db, PhaseStats* stats, int op, char* key, char* value, FILE* out){
+    double start = now();
+    runOp(options, db, op, key, value, out);
+    stats -> latency[op][stats -> count[op]++] = (uint64_t)((now() - start) * 1e9);
+}
+
+/**
+ * @brief   Creates a fresh, empty database directory and moves into it, removing the files of any earlier run
+ * @param[in]   options Options of the run
+*/
+int createBenchDirectory(BenchOptions* options){
+    char path[PATH_SIZE];
+    if (mkdir(options -> dir, 0755) != 0 && access(options -> dir, F_OK) != 0){
+        perror("Error creating benchmark directory\n");
+        return -1;
+    }
+    if (chdir(options -> dir) != 0){
+        perror("Error entering benchmark directory\n");
+        return -1;
+    }
+    for (int shard = 0; shard < MAX_SHARDS; shard++){
+        unlink(shardPath(path, DATA_PATH, shard));
+        unlink(shardPath(path, INDEX_PATH, shard));
+        unlink(shardPath(path, QUEUE_PATH, shard));
+    }
+    unlink(LOCK_PATH);
+    snprintf(path, PATH_SIZE, "%d", options -> shards);
+    setenv("KVDB_SHARDS", path, 1);
+    return 0;
+}
+
+/**
+ * @brief Prints the command line options of the benchmark
+*/
+void usage(void){
+    printf("Usage: ./kvdb_bench [options]\n");
+    printf("  -n keys\tNumber of keys loaded, 1000 to 1000000 (default 100000)\n");
+    printf("  -o ops\tNumber of operations in the get and mixed phases (default 100000)\n");
+    printf("  -k min:max\tRange of key lengths (default 16:32)\n");
+    printf("  -v min:max\tRange of value lengths (default 16:256)\n");
+    printf("  -p prefixes\tNumber of distinct key prefixes (default 100)\n");
+    printf("  -z skew\tZipf exponent of the prefix distribution, 0 for uniform (default 1.0)\n");
+    printf("  -m g:s:d\tPercentage of gets, sets and dels in the mixed phase (default 80:15:5)\n");
+    printf("  -s shards\tNumber of shards (default %d)\n", DEFAULT_SHARDS);
+    printf("  -l\t\tTake locks and group commit each write, as ./kvdb does, instead of calling set and get directly\n");
+    printf("  -r seed\tSeed of the random number generator (default 1)\n");
+    printf("  -d dir\tDirectory the database is created in, emptied first (default bench.db)\n");
+    printf("  -c size\tCache recently read keys in up to size bytes, e.g. 64MB, as a server does (default none)\n");
+}
+
+/**
+ * @brief   Parses the command line options of the benchmark
+ * @return  Returns 0 if the options are valid, -1 otherwise
+*/
+int parseOptions(int argc, char* argv[], BenchOptions* options){
+    *options = (BenchOptions){100000, 100000, 16, 32, 16, 256, 100, 1.0, {80, 15, 5}, DEFAULT_SHARDS, 0, 1, "bench.db",
+        NULL};
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:k:v:p:z:m:s:lr:d:c:h")) != -1){
+        switch (opt){
+            case 'n': options -> keys = atol(optarg); break;
+            case 'o': options -> ops = atol(optarg); break;
+            case 'k': if (sscanf(optarg, "%d:%d", &options -> keyMin, &options -> keyMax) != 2) return -1; break;
+            case 'v': if (sscanf(optarg, "%d:%d", &options -> valueMin, &options -> valueMax) != 2) return -1; break;
+            case 'p': options -> prefixes = atoi(optarg); break;
+            case 'z': options -> skew = atof(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d", &options -> mix[0], &options -> mix[1], &options -> mix[2]) != 3) return -1;
+                break;
+            case 's': options -> shards = atoi(optarg); break;
+            case 'l': options -> locked = 1; break;
+            case 'r': options -> seed = strtoull(optarg, NULL, 10); break;
+            case 'd': options -> dir = optarg; break;
+            case 'c': options -> cache = optarg; break;
+            default: return -1;
+        }
+    }
+    if (options -> keys < 1000 || options -> keys > 1000000 || options -> ops < 0 ||
+        options -> keyMin < 1 || options -> keyMax < options -> keyMin || options -> keyMax >= MAX_KEY_SIZE ||
+        options -> valueMin < 1 || options -> valueMax < options -> valueMin || options -> valueMax >= MAX_VALUE_SIZE ||
+        options -> prefixes < 1 || options -> prefixes > 1000 || options -> skew < 0 ||
+        options -> mix[0] < 0 || options -> mix[1] < 0 || options -> mix[2] < 0 ||
+        options -> mix[0] + options -> mix[1] + options -> mix[2] != 100 ||
+        options -> shards < 1 || options -> shards > MAX_SHARDS || options -> seed == 0) return -1;
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    BenchOptions options;
+    if (parseOptions(argc, argv, &options) != 0){
+        usage();
+        return -1;
+    }
+    // Cumulative distribution of the prefixes, with prefix i weighted 1/(i+1)^skew
+    double* prefixCdf = malloc(options.prefixes * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < options.prefixes; i++) sum += 1.0 / pow(i + 1, options.skew);
+    for (int i = 0; i < options.prefixes; i++)
+        prefixCdf[i] = (i > 0 ? prefixCdf[i-1] : 0) + 1.0 / pow(i + 1, options.skew) / sum;
+
+    Database db;
+    if (createBenchDirectory(&options) != 0 || openDatabase(&db) != 0 || openLock() != 0 ||
+        openCache(options.cache, 0) != 0){
+        free(prefixCdf);
+        return -1;
+    }
+    // Calling set directly skips the check commitWrite does that the index is loaded
+    for (int shard = 0; shard < db.shards; shard++)
+        if (indexNeedsLoad(db.data[shard], db.index[shard])) loadIndex(db.data[shard], db.index[shard], shard);
+    FILE* out = fopen("/dev/null", "w");
+    char key[MAX_KEY_SIZE];
+    char* value = malloc(options.valueMax + 1);
+    uint64_t state = options.seed;
+    PhaseStats stats;
+    printf("%ld keys of %d-%d bytes, values of %d-%d bytes, %d prefixes with skew %.2f, %d shards, %s\n",
+        options.keys, options.keyMin, options.keyMax, options.valueMin, options.valueMax, options.prefixes,
+        options.skew, options.shards, options.locked ? "locked" : "direct");
+
+    // Load every key
+    if (beginPhase(&stats, options.keys) != 0) return -1;
+    for (long int id = 0; id < options.keys; id++){
+        makeKey(&options, prefixCdf, id, key);
+        makeValue(&options, &state, value);
+        timeOp(&options, &db, &stats, 1, key, value, out);
+    }
+    endPhase("load", &stats);
+
+    // Read random keys
+    if (beginPhase(&stats, options.ops) != 0) return -1;
+    for (long int i = 0; i < options.ops; i++){
+        makeKey(&options, prefixCdf, nextRandom(&state) % options.keys, key);
+        timeOp(&options, &db, &stats, 0, key, value, out);
+    }
+    endPhase("get", &stats);
+
+    // Mixed gets, updates and deletes of random keys
+    if (beginPhase(&stats, options.ops) != 0) return -1;
+    for (long int i = 0; i < options.ops; i++){
+        int roll = nextRandom(&state) % 100;
+        int op = roll < options.mix[0] ? 0 : roll < options.mix[0] + options.mix[1] ? 1 : 2;
+        makeKey(&options, prefixCdf, nextRandom(&state) % options.keys, key);
+        if (op == 1) makeValue(&options, &state, value);
+        timeOp(&options, &db, &stats, op, key, value, out);
+    }
+    endPhase("mixed", &stats);
+
+    // Size of the database, to see how much space the remaining entries take up
+    long int bytes = 0;
+    for (int shard = 0; shard < db.shards; shard++){
+        struct stat st;
+        if (fstat(fileno(db.data[shard]), &st) == 0) bytes += st.st_size;
+        if (fstat(fileno(db.index[shard]), &st) == 0) bytes += st.st_size;
+        bytes += blobSize(shard, blobGeneration(db.data[shard]));
+    }
+    printf("database: %ld bytes\n", bytes);
+    fclose(out);
+    free(prefixCdf);
+    free(value);
+    closeDatabase(&db);
+    return 0;
+}
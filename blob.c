@@ -0,0 +1,230 @@
+/**
+ * @brief   Function definitions for the blob files holding values too long to be stored inline in data.bin, i.e. longer
+ *          than MAX_INLINE_VALUE. Each shard appends such values to its blob file, and the entry in data.bin holds the
+ *          value's offset in its place (see record.c), so compacting or loading a shard rewrites a few bytes for each
+ *          of them rather than the value. Values in a blob file are never modified, only added to the end. Space held
+ *          by dead values is reclaimed by compaction once they make up over half of the file, by copying the live
+ *          values to a new generation of the file, e.g. blob.0.1.bin replacing blob.0.0.bin. The header of the data
+ *          file holds the generation its entries refer to, so renaming the new data file over the old one switches
+ *          both at once.
+ *          Values are sent from a blob file with sendfile and copied between blob files with copy_file_range, so their
+ *          bytes don't pass through user space.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "definitions.h"
+#include "blob.h"
+
+/**
+ * @brief Open blob file of a shard
+*/
+typedef struct blob_file{
+    int opened;             // Whether fd holds an open file
+    int fd;
+    uint32_t generation;
+} BlobFile;
+
+// Blob files kept open between calls, so a long running process only opens each generation once
+static BlobFile blobs[MAX_SHARDS];
+// Sends values in place of sendBlob if set, see setBlobSender
+static BlobSender blobSender = NULL;
+static void* blobSenderArg = NULL;
+
+/**
+ * @brief Small function to format the path of a generation of a shard's blob file into a buffer of PATH_SIZE bytes
+*/
+char* blobPath(char* path, int shard, uint32_t generation){
+    snprintf(path, PATH_SIZE, BLOB_PATH, shard, generation);
+    return path;
+}
+
+/**
+ * @brief   Gets a file descriptor for a generation of a shard's blob file, reusing the one opened by a previous call
+ *          where possible. Any other generation of the shard's file left open is closed.
+ * @param[in]   shard       Number of the shard
+ * @param[in]   generation  Generation of the file, from the header of the shard's data file
+ * @param[in]   create      Whether to create the file if it doesn't exist
+ * @return  Returns the file descriptor, which must not be closed, or -1 on failure or if the file doesn't exist and
+ *          create is 0
+*/
+int openBlob(int shard, uint32_t generation, int create){
+    char path[PATH_SIZE];
+    BlobFile* blob = &blobs[shard];
+    if (blob -> opened && blob -> generation == generation) return blob -> fd;
+    int fd = open(blobPath(path, shard, generation), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd == -1){
+        if (create || errno != ENOENT) perror("Error opening blob file\n");
+        return -1;
+    }
+    if (blob -> opened) close(blob -> fd);
+    blob -> opened = 1;
+    blob -> fd = fd;
+    blob -> generation = generation;
+    return fd;
+}
+
+/**
+ * @brief   Creates a new, empty generation of a shard's blob file, e.g. for compaction to copy the live values to.
+ *          Anything left at the path, e.g. by a compaction that failed part way through, is discarded
+ * @return  Returns a file descriptor for the file, which is not kept open by openBlob and must be closed by the
+ *          caller, or -1 on failure
+*/
+int createBlob(int shard, uint32_t generation){
+    char path[PATH_SIZE];
+    int fd = open(blobPath(path, shard, generation), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) perror("Error creating blob file\n");
+    return fd;
+}
+
+/**
+ * @brief Small function to get the size of a generation of a shard's blob file, 0 if it doesn't exist
+*/
+long int blobSize(int shard, uint32_t generation){
+    struct stat st;
+    int fd = openBlob(shard, generation, 0);
+    if (fd == -1 || fstat(fd, &st) != 0) return 0;
+    return st.st_size;
+}
+
+/**
+ * @brief   Appends a value to the end of a blob file. The shard's LOCK_DATA must be held exclusively, so no one else
+ *          appends to the file at the same time. The file is not synced, see syncLog
+ * @param[in]   fd      File descriptor of the blob file
+ * @param[in]   value   Value, which need not be null terminated
+ * @param[in]   length  Length of the value
+ * @return  Returns the offset the value was written at, or -1 on failure
+*/
+long int appendBlob(int fd, const char* value, size_t length){
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        perror("Error reading blob file size\n");
+        return -1;
+    }
+    for (size_t written = 0; written < length;){
+        ssize_t n = pwrite(fd, value + written, length - written, st.st_size + written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0){
+            perror("ERROR: Failed appending to blob file\n");
+            return -1;
+        }
+        written += n;
+    }
+    return st.st_size;
+}
+
+/**
+ * @brief   Appends a value in one file, e.g. another generation of a shard's blob file, to the end of a blob file. The
+ *          kernel copies the bytes where it can, falling back to copying them through a buffer.
+ * @param[in]   from    File descriptor of the file holding the value
+ * @param[in]   offset  Offset of the value in from
+ * @param[in]   length  Length of the value
+ * @param[in]   to      File descriptor of the blob file the value is appended to
+ * @return  Returns the offset the value was written at in to, or -1 on failure
+*/
+long int copyBlob(int from, uint64_t offset, size_t length, int to){
+    struct stat st;
+    if (fstat(to, &st) != 0){
+        perror("Error reading blob file size\n");
+        return -1;
+    }
+    loff_t in = offset, out = st.st_size;
+    size_t left = length;
+    while (left > 0){
+        ssize_t n = copy_file_range(from, &in, to, &out, left, 0);
+        if (n > 0) left -= n;
+        else if (n == -1 && errno == EINTR) continue;
+        else break;
+    }
+    // Not every filesystem, or pair of filesystems, supports copy_file_range
+    char* buf = left > 0 ? malloc(BLOB_COPY_SIZE) : NULL;
+    while (left > 0){
+        size_t chunk = left < BLOB_COPY_SIZE ? left : BLOB_COPY_SIZE;
+        if (buf == NULL || readBlob(from, in, buf, chunk) != 0 || appendBlob(to, buf, chunk) == -1){
+            fprintf(stderr, "Error copying value between blob files\n");
+            free(buf);
+            return -1;
+        }
+        in += chunk;
+        left -= chunk;
+    }
+    free(buf);
+    return st.st_size;
+}
+
+/**
+ * @brief   Reads bytes of a value from a blob file
+ * @param[in]   fd      File descriptor of the blob file
+ * @param[in]   offset  Offset of the bytes in the file
+ * @param[out]  buf     Buffer of at least length bytes
+ * @param[in]   length  Number of bytes to read
+ * @return  Returns 0 on success, -1 on failure or if the file ends first
+*/
+int readBlob(int fd, uint64_t offset, char* buf, size_t length){
+    for (size_t read = 0; read < length;){
+        ssize_t n = pread(fd, buf + read, length - read, offset + read);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0){
+            fprintf(stderr, "Error reading value from blob file\n");
+            return -1;
+        }
+        read += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Sets a function to send values in place of sendBlob, or clears it
+ * @param[in]   sender  Function called by sendBlob, or NULL to have sendBlob send values itself
+ * @param[in]   arg     Passed to sender
+*/
+void setBlobSender(BlobSender sender, void* arg){
+    blobSender = sender;
+    blobSenderArg = arg;
+}
+
+/**
+ * @brief   Sends a value from a blob file to a stream, after anything already printed to it. If the stream has a file
+ *          descriptor, e.g. stdout or a socket, the value is sent with sendfile without passing through user space.
+ *          Otherwise, e.g. for a memory stream, or if the kernel can't send to the file, it is copied through a buffer.
+ * @param[in]   out     Stream the value is sent to
+ * @param[in]   fd      File descriptor of the blob file
+ * @param[in]   offset  Offset of the value in the file
+ * @param[in]   length  Length of the value
+ * @return  Returns 0 on success, -1 on failure
+*/
+int sendBlob(FILE* out, int fd, uint64_t offset, size_t length){
+    if (fflush(out) != 0) return -1;
+    if (blobSender != NULL) return blobSender(out, fd, offset, length, blobSenderArg);
+    off_t pos = offset;
+    size_t left = length;
+    while (fileno(out) != -1 && left > 0){
+        ssize_t n = sendfile(fileno(out), fd, &pos, left);
+        if (n > 0) left -= n;
+        else if (n == -1 && errno == EINTR) continue;
+        else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) break;
+        else{
+            fprintf(stderr, "Error sending value from blob file\n");
+            return -1;
+        }
+    }
+    char* buf = left > 0 ? malloc(BLOB_COPY_SIZE) : NULL;
+    while (left > 0){
+        size_t chunk = left < BLOB_COPY_SIZE ? left : BLOB_COPY_SIZE;
+        if (buf == NULL || readBlob(fd, pos, buf, chunk) != 0 || fwrite(buf, chunk, 1, out) != 1){
+            free(buf);
+            return -1;
+        }
+        pos += chunk;
+        left -= chunk;
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef BLOB_H_
+#define BLOB_H_
+#include <stdio.h>
+#include <stdint.h>
+
+// Bytes copied at a time when a value can't be sent or copied by the kernel, e.g. to a memory stream
+#define BLOB_COPY_SIZE 65536
+
+/**
+ * @brief   Sends a value from a blob file in place of sendBlob, e.g. so a server can queue it behind the responses
+ *          buffered before it. Must send length bytes of fd from offset, which it may do after returning
+*/
+typedef int (*BlobSender)(FILE* out, int fd, uint64_t offset, size_t length, void* arg);
+
+char* blobPath(char* path, int shard, uint32_t generation);
+int openBlob(int shard, uint32_t generation, int create);
+int createBlob(int shard, uint32_t generation);
+long int blobSize(int shard, uint32_t generation);
+long int appendBlob(int fd, const char* value, size_t length);
+long int copyBlob(int from, uint64_t offset, size_t length, int to);
+int readBlob(int fd, uint64_t offset, char* buf, size_t length);
+void setBlobSender(BlobSender sender, void* arg);
+int sendBlob(FILE* out, int fd, uint64_t offset, size_t length);
+#endif
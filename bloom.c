@@ -0,0 +1,144 @@
+/**
+ * @brief   Function definitions for the Bloom filter kept in index.bin, which answers most lookups of keys that have
+ *          never been set without walking the tree. The filter is a run of pages after the tree, recorded in the index
+ *          header, so it is rebuilt, replaced by compaction and trusted or not along with the rest of the index.
+ *          It is a blocked filter: a key's BLOOM_HASHES bits all fall in one block of BLOOM_BLOCK_SIZE bytes chosen by
+ *          its hash, so checking a key reads one cache line of the mapping, and adding one rewrites one block.
+ *          Keys are never removed, so a deleted key still passes until the filter is next rebuilt. The filter is sized
+ *          for BLOOM_BITS_PER_KEY bits per key, and once the tree holds more keys than it was sized for it is rebuilt
+ *          at twice the size from the keys in the leaves. The pages of the old filter are left unused until the index
+ *          is next rewritten.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "definitions.h"
+#include "index.h"
+#include "bloom.h"
+#include "stats.h"
+
+/**
+ * @brief   Finds a key's block, and the bits set for it within the block. The key's hash is mixed again first, with a
+ *          different mix to shardOf, so the keys of one shard are spread over every block
+ * @param[in]   header  Header of the index
+ * @param[in]   key     Key, which need not be null terminated
+ * @param[in]   length  Length of the key
+ * @param[out]  bits    On return, holds the bit of the block for each hash
+ * @return  Returns the number of the block
+*/
+static uint64_t bloomBits(IndexHeader* header, const char* key, size_t length, uint16_t bits[BLOOM_HASHES]){
+    uint64_t hash = hashBytes(key, length);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    uint64_t probes = hash * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < BLOOM_HASHES; i++){
+        bits[i] = (probes >> (64 - BLOOM_BLOCK_BITS*(i+1))) & (BLOOM_BLOCK_SIZE*8 - 1);
+    }
+    return hash % (header -> bloomPages * BLOOM_BLOCKS_PER_PAGE);
+}
+
+/**
+ * @brief Small function to get the file offset of a block of the filter
+*/
+static long int blockOffset(IndexHeader* header, uint64_t block){
+    return (header -> bloomPage + block / BLOOM_BLOCKS_PER_PAGE)*INDEX_PAGE_SIZE +
+        (block % BLOOM_BLOCKS_PER_PAGE)*BLOOM_BLOCK_SIZE;
+}
+
+/**
+ * @brief   Checks whether a key may be in a mapped index
+ * @param[in]   index   Mapping of index.bin
+ * @param[in]   header  Header of the index
+ * @param[in]   key     Key, which need not be null terminated
+ * @param[in]   length  Length of the key
+ * @return  Returns 0 if the key is certainly not in the index, or 1 if it may be, including if there is no filter
+*/
+int bloomMayContain(MappedFile* index, IndexHeader* header, const char* key, size_t length){
+    uint16_t bits[BLOOM_HASHES];
+    if (header -> bloomPages == 0) return 1;
+    uint64_t block = bloomBits(header, key, length, bits);
+    const unsigned char* page = (const unsigned char*)mappedPage(index, header, header -> bloomPage +
+        block / BLOOM_BLOCKS_PER_PAGE);
+    if (page == NULL) return 1;
+    const unsigned char* pos = page + (block % BLOOM_BLOCKS_PER_PAGE)*BLOOM_BLOCK_SIZE;
+    for (int i = 0; i < BLOOM_HASHES; i++){
+        if ((pos[bits[i] / 8] & (1 << (bits[i] % 8))) == 0) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief   Adds a key to the filter, rebuilding the filter at a larger size if the tree has outgrown it. The key must
+ *          already be in the tree.
+ * @param[in]   index   Pointer to index file
+ * @param[in,out]   header  Header of the index, which is updated but not written
+ * @param[in]   key     Null terminated key
+*/
+int bloomAdd(FILE* index, IndexHeader* header, const char* key){
+    uint16_t bits[BLOOM_HASHES];
+    unsigned char block[BLOOM_BLOCK_SIZE];
+    if (header -> count > header -> bloomCapacity) return buildBloom(index, header);
+    long int offset = blockOffset(header, bloomBits(header, key, strlen(key), bits));
+    fseek(index, offset, SEEK_SET);
+    if (fread(block, BLOOM_BLOCK_SIZE, 1, index) != 1){
+        fprintf(stderr, "Error reading Bloom filter\n");
+        return -1;
+    }
+    for (int i = 0; i < BLOOM_HASHES; i++) block[bits[i] / 8] |= 1 << (bits[i] % 8);
+    fseek(index, offset, SEEK_SET);
+    if (fwrite(block, BLOOM_BLOCK_SIZE, 1, index) != 1){
+        fprintf(stderr, "Error writing Bloom filter\n");
+        return -1;
+    }
+    addStat(STAT_INDEX_BYTES, BLOOM_BLOCK_SIZE);
+    return 0;
+}
+
+/**
+ * @brief   Writes a new filter after the last page of the index, sized for twice the keys in the tree, and adds every
+ *          key in the leaves to it. Used when an index is created or rewritten, and when the tree outgrows its filter.
+ * @param[in]   index   Pointer to index file
+ * @param[in,out]   header  Header of the index, which is updated but not written
+ * @return  Returns 0 on success, -1 on failure
+*/
+int buildBloom(FILE* index, IndexHeader* header){
+    char page[INDEX_PAGE_SIZE];
+    PageHeader pageHeader;
+    IndexCell cell;
+    uint16_t bits[BLOOM_HASHES];
+    uint64_t capacity = header -> count*2 > BLOOM_MIN_KEYS ? header -> count*2 : BLOOM_MIN_KEYS;
+    uint64_t blocks = (capacity*BLOOM_BITS_PER_KEY + BLOOM_BLOCK_SIZE*8 - 1) / (BLOOM_BLOCK_SIZE*8);
+    uint64_t pages = (blocks + BLOOM_BLOCKS_PER_PAGE - 1) / BLOOM_BLOCKS_PER_PAGE;
+    unsigned char* filter = calloc(pages, INDEX_PAGE_SIZE);
+    if (filter == NULL){
+        fprintf(stderr, "Error allocating memory for Bloom filter\n");
+        return -1;
+    }
+    IndexHeader built = *header;
+    built.bloomPage = header -> pageCount;
+    built.bloomPages = pages;
+    built.bloomCapacity = capacity;
+
+    // Walk down the leftmost edge of the tree to the first leaf, then along the leaves
+    uint64_t pageNo = header -> root;
+    int result = 0;
+    for (uint64_t visited = 0; pageNo != 0 && visited < header -> pageCount; visited++){
+        if ((result = readPage(index, pageNo, page)) != 0) break;
+        memcpy(&pageHeader, page, sizeof(PageHeader));
+        for (int i = 0; pageHeader.leaf && i < pageHeader.count && readCell(page, i, &cell) == 0; i++){
+            uint64_t block = bloomBits(&built, cell.key, cell.length, bits);
+            unsigned char* pos = filter + block*BLOOM_BLOCK_SIZE;
+            for (int j = 0; j < BLOOM_HASHES; j++) pos[bits[j] / 8] |= 1 << (bits[j] % 8);
+        }
+        pageNo = pageHeader.link;
+    }
+    for (uint64_t i = 0; i < pages && result == 0; i++)
+        result = writePage(index, built.bloomPage + i, (char*)filter + i*INDEX_PAGE_SIZE);
+    free(filter);
+    if (result != 0) return -1;
+    built.pageCount += pages;
+    *header = built;
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef BLOOM_H_
+#define BLOOM_H_
+#include <stdio.h>
+#include "map.h"
+
+// Blocks of the filter in each page of index.bin, and bits of the hash used to pick one bit of a 512 bit block
+#define BLOOM_BLOCKS_PER_PAGE (INDEX_PAGE_SIZE / BLOOM_BLOCK_SIZE)
+#define BLOOM_BLOCK_BITS 9
+
+int bloomMayContain(MappedFile* index, IndexHeader* header, const char* key, size_t length);
+int bloomAdd(FILE* index, IndexHeader* header, const char* key);
+int buildBloom(FILE* index, IndexHeader* header);
+#endif
@@ -0,0 +1,298 @@
+/**
+ * @brief   Function definitions for a cache of recently read keys, kept in memory by a long running process such as a
+ *          server, so gets of hot keys are answered without probing the index or reading the data file. The cache
+ *          holds up to a budget of bytes, set by the KVDB_CACHE environment variable, and the least recently used
+ *          entries are dropped to stay within it. Only values stored inline are cached; values in blob files are
+ *          already sent straight from the file.
+ *          Writes applied by this process are written through to the cache, see cacheWrite. Other processes may write
+ *          to the database too, so the cache also remembers the state of each data file (its identity, size and time
+ *          last modified) when its entries were last known to be up to date. Data files are only appended to, or
+ *          replaced, so if the file has changed since in any way this process didn't see, everything read from it is
+ *          dropped. Checking this costs an fstat per get, which is made under the same lock as the read, so an entry
+ *          can never be served once its key has been written elsewhere.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "definitions.h"
+#include "index.h"
+#include "map.h"
+#include "cache.h"
+#include "stats.h"
+
+// Entries by key, in a hash table of a power of two buckets, and in a list by last use
+static CacheEntry** buckets = NULL;
+static size_t bucketCount = 0;
+static CacheEntry* newest = NULL;
+static CacheEntry* oldest = NULL;
+static size_t entryCount = 0;
+static size_t used = 0;
+static size_t budget = 0;
+// State of each data file the cache has read from, indexed by file descriptor as in map.c
+static CacheSource sources[MAX_MAPPED_FILES];
+
+/**
+ * @brief   Sets the size of the cache, emptying it. The budget is taken from text, e.g. the value of KVDB_CACHE, as a
+ *          number of bytes optionally followed by KB, MB or GB, or is fallback if text is NULL. A budget of 0 turns the
+ *          cache off, as it is until this is called.
+ * @param[in]   text        Budget of the cache, or NULL
+ * @param[in]   fallback    Budget if text is NULL
+ * @return  Returns 0 on success, -1 if the budget is not valid
+*/
+int openCache(const char* text, size_t fallback){
+    unsigned long long n = fallback;
+    char unit[16] = "";
+    int shift = 0;
+    if (text != NULL){
+        int fields = sscanf(text, "%llu%15s", &n, unit);
+        shift = fields == 1 ? 0 : strcmp(unit, "KB") == 0 ? 10 : strcmp(unit, "MB") == 0 ? 20 :
+            strcmp(unit, "GB") == 0 ? 30 : -1;
+        if (fields < 1 || shift == -1){
+            fprintf(stderr, "KVDB_CACHE must be N, NKB, NMB or NGB\n");
+            return -1;
+        }
+    }
+    closeCache();
+    budget = (size_t)n << shift;
+    return 0;
+}
+
+/**
+ * @brief Small function to remove an entry from the hash table and the list, and free it
+*/
+static void removeEntry(CacheEntry* entry){
+    CacheEntry** link = &buckets[entry -> hash & (bucketCount - 1)];
+    while (*link != entry) link = &(*link) -> next;
+    *link = entry -> next;
+    if (entry -> newer != NULL) entry -> newer -> older = entry -> older;
+    else newest = entry -> older;
+    if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+    else oldest = entry -> newer;
+    used -= entry -> size;
+    entryCount--;
+    free(entry);
+}
+
+/**
+ * @brief Small function to put an entry at the front of the list, as the most recently used
+*/
+static void pushEntry(CacheEntry* entry){
+    entry -> older = newest;
+    entry -> newer = NULL;
+    if (newest != NULL) newest -> newer = entry;
+    else oldest = entry;
+    newest = entry;
+}
+
+/**
+ * @brief   Empties the cache and frees its memory. The budget is kept
+*/
+void closeCache(void){
+    while (oldest != NULL) removeEntry(oldest);
+    free(buckets);
+    buckets = NULL;
+    bucketCount = 0;
+}
+
+/**
+ * @brief   Finds the entry for a key read from a data file
+ * @param[in]   fd      File descriptor of the data file
+ * @param[in]   key     Null terminated key
+ * @param[in]   hash    Hash of the key
+ * @return  Returns the entry, which may be stale, or NULL if there is none
+*/
+static CacheEntry* findEntry(int fd, const char* key, uint64_t hash){
+    if (bucketCount == 0) return NULL;
+    for (CacheEntry* entry = buckets[hash & (bucketCount - 1)]; entry != NULL; entry = entry -> next){
+        if (entry -> hash == hash && entry -> fd == fd && strcmp(entry -> key, key) == 0) return entry;
+    }
+    return NULL;
+}
+
+/**
+ * @brief   Reads the current state of a data file, and compares it with the state its entries were last known to be up
+ *          to date with
+ * @param[in]   fd      File descriptor of the data file, below MAX_MAPPED_FILES
+ * @param[out]  state   On return, holds the state of the file. generation is left as the file's current generation
+ * @return  Returns 1 if the file is unchanged, 0 if it has changed or fstat fails
+*/
+static int sourceState(int fd, CacheSource* state){
+    struct stat st;
+    CacheSource* source = &sources[fd];
+    memset(state, 0, sizeof(CacheSource));
+    state -> generation = source -> generation;
+    if (fstat(fd, &st) != 0) return 0;
+    state -> dev = st.st_dev;
+    state -> ino = st.st_ino;
+    state -> size = st.st_size;
+    state -> mtime = st.st_mtim;
+    return source -> dev == state -> dev && source -> ino == state -> ino && source -> size == state -> size &&
+        source -> mtime.tv_sec == state -> mtime.tv_sec && source -> mtime.tv_nsec == state -> mtime.tv_nsec;
+}
+
+/**
+ * @brief   Looks a key up in the cache. The data file is checked first, so any change made to it by another process
+ *          since it was last read leaves every entry read from it stale. Must be called with a lock held on the
+ *          shard, e.g. by beginRead.
+ * @param[in]   data    Pointer to the data file of the key's shard
+ * @param[in]   key     Null terminated key
+ * @param[out]  kv      On return, holds the sizes and timestamps of the key's latest entry, if cached
+ * @param[out]  value   On return, points to the value, which is null terminated. Only valid until the next call to a
+ *                      function in this file
+ * @return  Returns 1 if the key is cached, 0 if not or if the cache is off
+*/
+int cacheGet(FILE* data, const char* key, Pair* kv, const char** value){
+    CacheSource state;
+    int fd = fileno(data);
+    if (budget == 0 || fd < 0 || fd >= MAX_MAPPED_FILES) return 0;
+    if (sourceState(fd, &state) == 0){
+        // Something changed the file behind the cache's back, so nothing read from it can be trusted
+        state.generation++;
+        sources[fd] = state;
+    }
+    uint64_t hash = hashBytes(key, strlen(key));
+    CacheEntry* entry = findEntry(fd, key, hash);
+    if (entry != NULL && entry -> generation != state.generation){
+        removeEntry(entry);
+        entry = NULL;
+    }
+    if (entry == NULL){
+        addStat(STAT_CACHE_MISSES, 1);
+        return 0;
+    }
+    // Move the entry to the front of the list
+    if (entry != newest){
+        entry -> newer -> older = entry -> older;
+        if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+        else oldest = entry -> newer;
+        pushEntry(entry);
+    }
+    *kv = entry -> kv;
+    *value = entry -> value;
+    addStat(STAT_CACHE_HITS, 1);
+    return 1;
+}
+
+/**
+ * @brief Small function to double the number of buckets in the hash table, moving every entry to its new bucket
+*/
+static int growBuckets(void){
+    size_t count = bucketCount == 0 ? CACHE_MIN_BUCKETS : 2*bucketCount;
+    CacheEntry** grown = calloc(count, sizeof(CacheEntry*));
+    if (grown == NULL) return -1;
+    for (CacheEntry* entry = oldest; entry != NULL; entry = entry -> newer){
+        entry -> next = grown[entry -> hash & (count - 1)];
+        grown[entry -> hash & (count - 1)] = entry;
+    }
+    free(buckets);
+    buckets = grown;
+    bucketCount = count;
+    return 0;
+}
+
+/**
+ * @brief   Adds an entry to the cache as the most recently used, dropping the least recently used entries until the
+ *          cache is back within its budget
+ * @param[in]   fd      File descriptor of the data file the entry belongs to
+ * @param[in]   key     Null terminated key
+ * @param[in]   hash    Hash of the key
+ * @param[in]   kv      Sizes and timestamps of the entry
+ * @param[in]   value   Value of the entry, which need not be null terminated
+ * @param[in]   length  Length of the value
+*/
+static void addEntry(int fd, const char* key, uint64_t hash, Pair* kv, const char* value, size_t length){
+    size_t keySize = strlen(key) + 1;
+    size_t size = sizeof(CacheEntry) + keySize + length + 1;
+    if (size > budget || (entryCount >= bucketCount && growBuckets() != 0)) return;
+    CacheEntry* entry = malloc(size);
+    if (entry == NULL) return;
+    entry -> hash = hash;
+    entry -> generation = sources[fd].generation;
+    entry -> fd = fd;
+    entry -> size = size;
+    entry -> kv = *kv;
+    memcpy(entry -> key, key, keySize);
+    entry -> value = entry -> key + keySize;
+    memcpy(entry -> value, value, length);
+    entry -> value[length] = '\0';
+    entry -> next = buckets[hash & (bucketCount - 1)];
+    buckets[hash & (bucketCount - 1)] = entry;
+    pushEntry(entry);
+    used += size;
+    entryCount++;
+    while (used > budget) removeEntry(oldest);
+}
+
+/**
+ * @brief   Caches a key read after cacheGet missed it, under the same lock, so the entry is as up to date as the state
+ *          of the data file cacheGet checked
+ * @param[in]   data    Pointer to the data file of the key's shard
+ * @param[in]   key     Null terminated key
+ * @param[in]   kv      Sizes and timestamps of the key's latest entry
+ * @param[in]   value   Value of the entry, which need not be null terminated, e.g. in the mapping of the data file
+ * @param[in]   length  Length of the value
+*/
+void cachePut(FILE* data, const char* key, Pair* kv, const char* value, size_t length){
+    int fd = fileno(data);
+    if (budget == 0 || fd < 0 || fd >= MAX_MAPPED_FILES) return;
+    uint64_t hash = hashBytes(key, strlen(key));
+    CacheEntry* entry = findEntry(fd, key, hash);
+    if (entry != NULL) removeEntry(entry);
+    addEntry(fd, key, hash, kv, value, length);
+}
+
+/**
+ * @brief   Checks whether the cache is up to date with a data file, before this process writes to it. To be passed to
+ *          cacheWrite once the write is done
+ * @param[in]   data    Pointer to data file
+ * @return  Returns 1 if every change to the file has been seen by the cache, 0 if not or if the cache is off
+*/
+int cacheSynced(FILE* data){
+    CacheSource state;
+    int fd = fileno(data);
+    return budget != 0 && fd >= 0 && fd < MAX_MAPPED_FILES && sourceState(fd, &state);
+}
+
+/**
+ * @brief   Writes a set or del applied by this process through to the cache. A cached key is given its new value, or
+ *          dropped if it was deleted or its value is now stored in the blob file. Keys that aren't cached aren't
+ *          added, so writes don't push hot keys out. The cache then takes the data file's new state as up to date,
+ *          as long as it was up to date before the write, so the write doesn't leave the rest of the file's entries
+ *          stale. Compaction during the write doesn't change any key's value or timestamps, so it is covered too.
+ * @param[in]   data    Pointer to the data file written to, flushed
+ * @param[in]   synced  Result of cacheSynced before the write
+ * @param[in]   key     Null terminated key written
+ * @param[in]   value   Value written. Ignored for tombstones
+ * @param[in]   kv      Sizes and timestamps of the entry written. A valueSize of 0 marks a tombstone
+*/
+void cacheWrite(FILE* data, int synced, const char* key, const char* value, Pair* kv){
+    CacheSource state;
+    if (budget == 0) return;
+    int fd = fileno(data);
+    if (fd < 0 || fd >= MAX_MAPPED_FILES) return;
+    sourceState(fd, &state);
+    if (!synced) state.generation++;
+    sources[fd] = state;
+    uint64_t hash = hashBytes(key, strlen(key));
+    CacheEntry* entry = findEntry(fd, key, hash);
+    if (entry == NULL) return;
+    removeEntry(entry);
+    if (synced && kv -> valueSize != 0 && kv -> valueSize <= MAX_INLINE_VALUE)
+        addEntry(fd, key, hash, kv, value, kv -> valueSize - 1);
+}
+
+/**
+ * @brief   Prints how full the cache is, e.g. for a server's stats. The hits and misses are counted in the stats shared
+ *          by every process, see stats.c
+ * @param[in]   out     Stream to print to
+*/
+void printCache(FILE* out){
+    if (budget == 0){
+        fprintf(out, "Cache is turned off\n");
+        return;
+    }
+    fprintf(out, "Cached keys:\t\t\t%lu\n", (unsigned long)entryCount);
+    fprintf(out, "Cache bytes used:\t\t%lu of %lu\n", (unsigned long)used, (unsigned long)budget);
+}
@@ -0,0 +1,47 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Buckets of the hash table of an empty cache. The table doubles whenever it holds as many entries as buckets
+#define CACHE_MIN_BUCKETS 1024
+
+/**
+ * @brief   A key and its value and timestamps, read by a get. Entries are in a hash table by key, and in a list from most
+ *          to least recently used
+*/
+typedef struct cache_entry{
+    struct cache_entry* next;       // Next entry in the same hash bucket
+    struct cache_entry* newer;      // Neighbours in the list of entries by last use
+    struct cache_entry* older;
+    uint64_t hash;
+    uint64_t generation;    // Generation of the file the entry was read from when it was read, see CacheSource
+    int fd;                 // File descriptor of the data file the entry was read from
+    size_t size;            // Bytes charged to the budget for the entry
+    Pair kv;
+    char* value;            // Null terminated, follows the key
+    char key[];
+} CacheEntry;
+
+/**
+ * @brief   State of a data file when the entries read from it were last known to be up to date. Any change to the file
+ *          not made through cacheWrite moves it to a new generation, leaving every entry read from it stale
+*/
+typedef struct cache_source{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t generation;
+} CacheSource;
+
+int openCache(const char* text, size_t fallback);
+void closeCache(void);
+int cacheGet(FILE* data, const char* key, Pair* kv, const char** value);
+void cachePut(FILE* data, const char* key, Pair* kv, const char* value, size_t length);
+int cacheSynced(FILE* data);
+void cacheWrite(FILE* data, int synced, const char* key, const char* value, Pair* kv);
+void printCache(FILE* out);
+#endif
@@ -0,0 +1,219 @@
+/**
+ * @brief   Function definitions for reading a whole data file with several threads, e.g. to compact it or rebuild its
+ *          index. The file is split into chunks, each starting at an entry that stores its key in full, so a chunk can
+ *          be read without the entries before it: appended entries always store their keys in full, and sorted files
+ *          do every DATA_RESTART_INTERVAL entries. Each thread checks the entries of its chunk against their checksums
+ *          and sorts them by key, then the sorted chunks are merged in pairs, each pair by its own thread.
+ *          The number of threads is taken from the KVDB_THREADS environment variable if set, or is the number of
+ *          processors otherwise. Files smaller than CHUNK_MIN_SIZE per thread are read by fewer threads, so compacting
+ *          a small shard doesn't pay for starting threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "definitions.h"
+#include "record.h"
+#include "chunk.h"
+
+/**
+ * @brief Two sorted runs of entries to be merged by one thread
+*/
+typedef struct merge_pair{
+    DataChunk* left;        // Holds the merged run on return
+    DataChunk* right;       // Emptied on return
+    int result;
+} MergePair;
+
+/**
+ * @brief Small function to get the number of threads to read a file with, from KVDB_THREADS or the number of processors
+*/
+int workerThreads(void){
+    char* env = getenv("KVDB_THREADS");
+    long int threads = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) return 1;
+    return threads > MAX_THREADS ? MAX_THREADS : threads;
+}
+
+/**
+ * @brief   Splits the entries of a data file from an offset on into chunks of about equal size. Only the fields at the
+ *          start of each entry are read, to step from one entry to the next, so this touches every entry but does far
+ *          less work per entry than the threads do. A malformed entry ends the last chunk.
+ * @param[in]   data    Mapping of the data file
+ * @param[in]   start   Offset of the first entry, which must store its key in full
+ * @param[out]  chunks  Array of at least count chunks, whose start and end are filled in
+ * @param[in]   count   Number of chunks wanted
+ * @return  Returns the number of chunks, which is fewer than count if there are too few places to split the file
+*/
+static int splitChunks(MappedFile* data, long int start, DataChunk* chunks, int count){
+    Record record;
+    size_t size = data -> size, pos = start;
+    int found = 1;
+    chunks[0].start = start;
+    while (found < count && pos < size && recordHeader(data -> base + pos, size - pos, &record) != 0){
+        if (record.shared == 0 && pos >= start + (size - start)/count*found){
+            chunks[found - 1].end = pos;
+            chunks[found++].start = pos;
+        }
+        pos += record.size;
+    }
+    chunks[found - 1].end = size;
+    return found;
+}
+
+/**
+ * @brief   Thread reading the entries of a chunk, checking each against its checksum, then sorting them by key then by
+ *          offset. Reading stops at the first entry that is malformed, fails its checksum or refers to a value past
+ *          the end of the blob file, as when replaying the log, see wal.c.
+ * @param[in,out]   arg     Chunk to be read. refs, count and validEnd are filled in
+ * @return  Returns NULL
+*/
+static void* readChunk(void* arg){
+    DataChunk* chunk = arg;
+    Record record;
+    char key[MAX_KEY_SIZE];
+    size_t length = 0, capacity = 1024;
+    long int pos = chunk -> start;
+    chunk -> count = 0;
+    chunk -> result = -1;
+    chunk -> validEnd = pos;
+    chunk -> refs = malloc(capacity*sizeof(KeyRef));
+    if (chunk -> refs == NULL) return NULL;
+    while (pos < chunk -> end){
+        const char* entry = chunk -> data -> base + pos;
+        if (decodeRecord(entry, chunk -> data -> size - pos, 1, &record) == 0 || record.shared > length) break;
+        if (record.blob != NO_BLOB && record.blob + record.kv.valueSize - 1 > chunk -> blobEnd) break;
+        length = record.kv.keySize - 1;
+        memcpy(key + record.shared, record.suffix, length - record.shared);
+        key[length] = '\0';
+        if (chunk -> count == capacity){
+            KeyRef* grown = realloc(chunk -> refs, 2*capacity*sizeof(KeyRef));
+            if (grown == NULL) return NULL;
+            chunk -> refs = grown;
+            capacity *= 2;
+        }
+        if ((chunk -> refs[chunk -> count].key = strdup(key)) == NULL) return NULL;
+        chunk -> refs[chunk -> count].offset = pos;
+        chunk -> count++;
+        pos += record.size;
+        chunk -> validEnd = pos;
+    }
+    qsort(chunk -> refs, chunk -> count, sizeof(KeyRef), compareKeyRef);
+    chunk -> result = 0;
+    return NULL;
+}
+
+/**
+ * @brief   Thread merging two sorted runs of entries into one
+ * @param[in,out]   arg     Pair of runs to be merged
+ * @return  Returns NULL
+*/
+static void* mergeChunks(void* arg){
+    MergePair* pair = arg;
+    DataChunk* left = pair -> left;
+    DataChunk* right = pair -> right;
+    KeyRef* merged = malloc((left -> count + right -> count + 1)*sizeof(KeyRef));
+    if (merged == NULL){
+        pair -> result = -1;
+        return NULL;
+    }
+    size_t i = 0, j = 0, k = 0;
+    while (i < left -> count || j < right -> count){
+        if (j == right -> count || (i < left -> count && compareKeyRef(&left -> refs[i], &right -> refs[j]) <= 0))
+            merged[k++] = left -> refs[i++];
+        else merged[k++] = right -> refs[j++];
+    }
+    free(left -> refs);
+    free(right -> refs);
+    left -> refs = merged;
+    left -> count = k;
+    right -> refs = NULL;
+    right -> count = 0;
+    pair -> result = 0;
+    return NULL;
+}
+
+/**
+ * @brief   Runs a function on each of a number of arguments, each in its own thread, or in this thread if there is only
+ *          one. Any that can't be given a thread are run in this thread
+ * @param[in]   run     Function to run
+ * @param[in]   args    Array of arguments
+ * @param[in]   size    Size of each argument
+ * @param[in]   count   Number of arguments
+*/
+static void runThreads(void* (*run)(void*), void* args, size_t size, int count){
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    for (int i = 0; i < count; i++){
+        void* arg = (char*)args + i*size;
+        started[i] = count > 1 && pthread_create(&threads[i], NULL, run, arg) == 0;
+        if (!started[i]) run(arg);
+    }
+    for (int i = 0; i < count; i++) if (started[i]) pthread_join(threads[i], NULL);
+}
+
+/**
+ * @brief   Reads every whole entry of a data file from an offset on, with several threads, and sorts them by key then
+ *          by offset, so the most recent entry for each key comes last. This is the order compaction needs
+ * @param[in]   data    Mapping of the data file
+ * @param[in]   start   Offset of the first entry, e.g. from dataStart
+ * @param[in]   blobEnd Size of the shard's blob file
+ * @param[out]  refs    On return, holds a malloc'd array of the entries, to be freed with freeRefs
+ * @param[out]  count   On return, holds the number of entries
+ * @return  Returns the offset after the last whole entry, from which anything left is torn, or -1 on failure
+*/
+long int sortEntries(MappedFile* data, long int start, uint64_t blobEnd, KeyRef** refs, size_t* count){
+    DataChunk chunks[MAX_THREADS];
+    MergePair pairs[MAX_THREADS / 2];
+    long int wanted = ((long int)data -> size - start) / CHUNK_MIN_SIZE;
+    int threads = workerThreads();
+    if (wanted < 1) wanted = 1;
+    if (wanted > threads) wanted = threads;
+    memset(chunks, 0, sizeof(chunks));
+    int chunkCount = splitChunks(data, start, chunks, wanted);
+    for (int i = 0; i < chunkCount; i++){
+        chunks[i].data = data;
+        chunks[i].blobEnd = blobEnd;
+    }
+    runThreads(readChunk, chunks, sizeof(DataChunk), chunkCount);
+
+    // Entries after a torn one can't be trusted, as when replaying the log, so later chunks are dropped
+    int used = 0, result = 0;
+    long int end = start;
+    while (used < chunkCount){
+        DataChunk* chunk = &chunks[used++];
+        end = chunk -> validEnd;
+        if (chunk -> result != 0) result = -1;
+        if (end != chunk -> end) break;
+    }
+    for (int i = used; i < chunkCount; i++) freeRefs(chunks[i].refs, chunks[i].count);
+    // Merge neighbouring runs in pairs until only one is left
+    for (int width = 1; width < used && result == 0; width *= 2){
+        int pairCount = 0;
+        for (int i = 0; i + width < used; i += 2*width){
+            pairs[pairCount].left = &chunks[i];
+            pairs[pairCount].right = &chunks[i + width];
+            pairCount++;
+        }
+        runThreads(mergeChunks, pairs, sizeof(MergePair), pairCount);
+        for (int i = 0; i < pairCount; i++) if (pairs[i].result != 0) result = -1;
+    }
+    if (result != 0){
+        fprintf(stderr, "Error allocating memory to read data file\n");
+        for (int i = 0; i < used; i++) freeRefs(chunks[i].refs, chunks[i].count);
+        return -1;
+    }
+    *refs = chunks[0].refs;
+    *count = chunks[0].count;
+    return end;
+}
+
+/**
+ * @brief Small function to free the entries returned by sortEntries
+*/
+void freeRefs(KeyRef* refs, size_t count){
+    for (size_t i = 0; i < count && refs != NULL; i++) free(refs[i].key);
+    free(refs);
+}
@@ -0,0 +1,26 @@
+#ifndef CHUNK_H_
+#define CHUNK_H_
+#include <stdio.h>
+#include <stdint.h>
+#include "map.h"
+#include "compact.h"
+
+/**
+ * @brief   Part of a data file read by one worker thread. It starts at an entry that stores its key in full, so it can
+ *          be read without reading the entries before it
+*/
+typedef struct data_chunk{
+    MappedFile* data;
+    long int start;         // Offset of the first entry in the chunk
+    long int end;           // Offset the next chunk starts at
+    uint64_t blobEnd;       // Size of the shard's blob file. An entry whose value runs past it is torn
+    long int validEnd;      // Offset after the last whole entry read, end if every entry in the chunk is whole
+    KeyRef* refs;           // Entries read, sorted by key then offset
+    size_t count;
+    int result;             // 0 once read, -1 if memory ran out, which unlike a torn entry is an error
+} DataChunk;
+
+int workerThreads(void);
+long int sortEntries(MappedFile* data, long int start, uint64_t blobEnd, KeyRef** refs, size_t* count);
+void freeRefs(KeyRef* refs, size_t count);
+#endif
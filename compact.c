@@ -0,0 +1,270 @@
+/**
+ * @brief   Function definitions for compacting the data file. Writes append new entries and tombstones to the end of
+ *          data.bin, so superseded entries accumulate there. Compaction rewrites the file in alphabetical order holding
+ *          only the latest live entry for each key, and builds a matching index.bin in the same pass. Values in the
+ *          blob file, see blob.c, are left where they are unless over half of the blob file is dead, in which case the
+ *          live ones are copied to a new generation of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "definitions.h"
+#include "index.h"
+#include "set.h"
+#include "get.h"
+#include "shard.h"
+#include "compact.h"
+#include "map.h"
+#include "record.h"
+#include "blob.h"
+#include "stats.h"
+#include "chunk.h"
+#include "lock.h"
+#include "wal.h"
+
+/**
+ * @brief   Comparison function for qsort. Orders entries alphabetically by key, then by file offset so that the 
+ *          most recent entry for each key comes last
+*/
+int compareKeyRef(const void* a, const void* b){
+    const KeyRef* x = a;
+    const KeyRef* y = b;
+    int result = strcmp(x -> key, y -> key);
+    if (result != 0) return result;
+    return (x -> offset > y -> offset) - (x -> offset < y -> offset);
+}
+
+/**
+ * @brief   Decides whether enough of the data file is taken up by superseded entries and tombstones to be worth 
+ *          compacting. Dead bytes must exceed both COMPACT_MIN_DEAD and half of the file, which keeps the total bytes
+ *          rewritten by compaction proportional to the bytes written by sets and dels. Dead values in the blob file
+ *          count towards the dead bytes, and the blob file towards the size of the file.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @return  Returns 1 if the file should be compacted, 0 otherwise
+*/
+int needsCompaction(FILE* data, FILE* index){
+    IndexHeader header;
+    if (readIndexHeader(index, &header) != 0) return 0;
+    fseek(data, 0, SEEK_END);
+    long int deadBytes = header.deadBytes;
+    // The blob file can only make compaction less likely, so it is only looked at if data.bin alone is enough
+    if (deadBytes <= COMPACT_MIN_DEAD || deadBytes*2 <= ftell(data)) return 0;
+    return deadBytes*2 > ftell(data) + blobSize(header.shard, blobGeneration(data));
+}
+
+/**
+ * @brief   Rewrites the data file so it holds only the latest live entry for each key, in alphabetical order, and 
+ *          writes a matching index. Both files are written to temp files and renamed over the originals, after which
+ *          the data and index streams are reopened on the new files. As the keys are written in order, the new tree is
+ *          built bottom up with full pages, rather than by inserting each key, and each key shares its prefix with the key
+ *          before it in the new file, see SortedWriter. The shard being compacted is read from the index header.
+ *          Live values in the blob file are only copied, to a new generation of the file, if they take up less than
+ *          half of it. Otherwise the new entries refer to the values where they are, and the dead ones are carried
+ *          over as the dead bytes of the new index. A large file is read by several threads, see chunk.c.
+ * @param[in]   data    Pointer to data file. Reopened on the compacted file on return
+ * @param[in]   index   Pointer to index file. Reopened on the new index on return
+*/
+int compact(FILE* data, FILE* index){
+    size_t count = 0;
+    KeyRef* refs = NULL;
+    IndexHeader header;
+    uint64_t start = statsClock();
+    if (readIndexHeader(index, &header) != 0){
+        fprintf(stderr, "Error reading index header for compaction\n");
+        return -1;
+    }
+    int shard = header.shard;
+    char tempDataPath[PATH_SIZE], tempIndexPath[PATH_SIZE];
+    shardPath(tempDataPath, TEMP_DATA_PATH, shard);
+    shardPath(tempIndexPath, TEMP_INDEX_PATH, shard);
+
+    // Find the location of every entry in the file, sorted by key, reading the file with several threads if it is large
+    long int offset = dataStart(data);
+    MappedFile* dataMap = offset == -1 || fflush(data) != 0 ? NULL : mapFile(data);
+    uint32_t generation = dataMap == NULL ? 0 : blobGeneration(data);
+    uint64_t blobBytes = blobSize(shard, generation);
+    if (dataMap != NULL && sortEntries(dataMap, offset, blobBytes, &refs, &count) == -1) dataMap = NULL;
+    addStat(STAT_COMPACT_ENTRIES, count);
+
+    // Only the last entry for each key is current, and tombstones have nothing left to shadow in the sorted section, so
+    // they are dropped. Find how much of the blob file the live entries hold
+    PairView view;
+    uint64_t liveBlob = 0;
+    for (size_t i = 0; i < count; i++){
+        if (i + 1 < count && strcmp(refs[i].key, refs[i+1].key) == 0) refs[i].offset = -1;
+        else if (dataMap != NULL && viewPair(dataMap, refs[i].offset, refs[i].key, strlen(refs[i].key), &view) == 1 &&
+            view.kv.valueSize != 0){
+            if (view.blob != NO_BLOB) liveBlob += view.kv.valueSize - 1;
+        }
+        else refs[i].offset = -1;
+    }
+    int oldBlob = openBlob(shard, generation, 0);
+    int newBlob = -1;
+    uint32_t newGeneration = generation;
+    if (blobBytes > 2*liveBlob){
+        newGeneration = (generation + 1) % BLOB_GENERATIONS;
+        newBlob = createBlob(shard, newGeneration);
+    }
+
+    FILE* tempData = fopen(tempDataPath, "w");
+    FILE* tempIndex = fopen(tempIndexPath, "w+");
+    IndexBuilder builder;
+    SortedWriter writer;
+    int result = -1;
+    if (dataMap == NULL || tempData == NULL || tempIndex == NULL || (newGeneration != generation &&
+        newBlob == -1) || beginSorted(&writer, tempData, newGeneration) != 0 || createIndex(tempIndex, &header, shard) != 0 ||
+        beginBuild(&builder, tempIndex, &header) != 0){
+        perror("Error opening temp files for compaction\n");
+    }
+    else{
+        result = 0;
+        for (size_t i = 0; i < count && result == 0; i++){
+            if (refs[i].offset == -1) continue;
+            viewPair(dataMap, refs[i].offset, refs[i].key, strlen(refs[i].key), &view);
+            uint64_t blob = view.blob;
+            if (blob != NO_BLOB && newBlob != -1){
+                long int copied = copyBlob(oldBlob, view.blob, view.kv.valueSize - 1, newBlob);
+                if (copied == -1) result = -1;
+                blob = copied;
+                addStat(STAT_REWRITE_BYTES, view.kv.valueSize - 1);
+            }
+            // Each key appears once in the new file, in order, so it can be added to the end of the tree. A key that
+            // can't be written fails the whole rewrite, as the new files would otherwise replace the shard without it
+            long int newOffset = result == 0 ? writeSorted(&writer, view.key, view.value, blob, &view.kv) : -1;
+            if (newOffset == -1 || buildIndexLine(&builder, 0, view.key, view.kv.keySize - 1, newOffset) != 0)
+                result = -1;
+        }
+        if (endBuild(&builder) != 0) result = -1;
+        addStat(STAT_REWRITE_BYTES, writer.size);
+        header.indexedSize = writer.size;
+        header.deadBytes = newBlob == -1 ? blobBytes - liveBlob : 0;
+        if (result == 0 && writeIndexHeader(tempIndex, &header) != 0) result = -1;
+        // The new data file refers to the new blob file, so it must be synced before the data file replaces the old one
+        if (result == 0 && newBlob != -1 && fdatasync(newBlob) != 0){
+            perror("Error syncing new blob file\n");
+            result = -1;
+        }
+        // Errors writing pages of the index still buffered by the stream only show up when they are flushed, so the
+        // index is flushed and synced while the rewrite can still be abandoned
+        if (result == 0 && (fflush(tempIndex) != 0 || fdatasync(fileno(tempIndex)) != 0)){
+            perror("Error syncing rewritten index file\n");
+            result = -1;
+        }
+    }
+
+    freeRefs(refs, count);
+    char path[PATH_SIZE];
+    if (newBlob != -1) close(newBlob);
+    if (result != 0){
+        if (tempData != NULL) fclose(tempData);
+        if (tempIndex != NULL) fclose(tempIndex);
+        remove(tempDataPath);
+        remove(tempIndexPath);
+        if (newBlob != -1) unlink(blobPath(path, shard, newGeneration));
+        return -1;
+    }
+    if (replaceShard(data, index, tempData, tempIndex, shard) != 0) return -1;
+    // Once the new data file is in place, nothing refers to the old blob file
+    if (newBlob != -1) unlink(blobPath(path, shard, generation));
+    recordOp(STAT_COMPACT, start);
+    return 0;
+}
+
+/**
+ * @brief   Compacts every shard of the database, or rebuilds every shard's index from its data file, e.g. for
+ *          ./kvdb compact or ./kvdb reindex. Shards are done one at a time, each with its writers and readers locked
+ *          out, so the rest of the database stays in use. Each shard's files are read by several threads, see chunk.c.
+ * @param[in]   db      Open database
+ * @param[in]   indexOnly   Whether to rebuild the indexes, leaving the data files as they are, rather than compact
+ * @param[in]   out     Stream the size of each shard before and after is printed to
+ * @return  Returns 0 on success, -1 on failure
+*/
+int compactDatabase(Database* db, int indexOnly, FILE* out){
+    IndexHeader header;
+    int result = 0;
+    for (int shard = 0; shard < db -> shards && result == 0; shard++){
+        FILE* data = db -> data[shard];
+        FILE* index = db -> index[shard];
+        lockRange(shard, LOCK_COMMIT, F_WRLCK);
+        lockRange(shard, LOCK_DATA, F_WRLCK);
+        result = refreshFiles(data, index, shard);
+        fseek(data, 0, SEEK_END);
+        long int before = ftell(data);
+        // The index is marked dirty before the shard is rewritten, as by a write, so if the rewrite stops part way,
+        // e.g. between renaming the new data file and the new index into place, the index is rebuilt rather than
+        // trusted. A damaged index being rebuilt can't be marked, and needn't be
+        if (result == 0 && indexOnly){
+            if (readIndexHeader(index, &header) == 0) result = markIndexDirty(index);
+            if (result == 0) result = rebuildIndex(data, index, shard);
+        }
+        // Compaction reads the dead bytes from the index, so it must be up to date first
+        else if (result == 0){
+            if (indexNeedsLoad(data, index)) result = loadIndex(data, index, shard);
+            if (result == 0) result = markIndexDirty(index);
+            if (result == 0) result = compact(data, index);
+        }
+        if (result == 0) result = readIndexHeader(index, &header);
+        lockRange(shard, LOCK_DATA, F_UNLCK);
+        lockRange(shard, LOCK_COMMIT, F_UNLCK);
+        if (result != 0){
+            fprintf(stderr, "Error %s shard %d\n", indexOnly ? "reindexing" : "compacting", shard);
+            return -1;
+        }
+        fseek(data, 0, SEEK_END);
+        fprintf(out, "Shard %d: %ld bytes of data before, %ld after, %lu keys, %lu dead bytes\n", shard, before,
+            ftell(data), (unsigned long)header.count, (unsigned long)header.deadBytes);
+    }
+    return result;
+}
+
+/**
+ * @brief   Renames a shard's rewritten files, written to TEMP_DATA_PATH and TEMP_INDEX_PATH, over the originals and
+ *          reopens the data and index streams on them. The new data file replaces the log, so it is synced first
+ *          whatever the sync policy, or a crash could leave an empty file in place of the old one.
+ * @param[in]   data        Pointer to data file. Reopened on the new file on return
+ * @param[in]   index       Pointer to index file. Reopened on the new file on return
+ * @param[in]   tempData    Rewritten data file, which is closed
+ * @param[in]   tempIndex   Rewritten index file, which is closed
+ * @param[in]   shard       Number of the shard the files belong to
+ * @return  Returns 0 on success, -1 on failure. The index must have been marked dirty first, see markIndexDirty, so
+ *          a failure between the two renames leaves an index that is rebuilt rather than trusted
+*/
+int replaceShard(FILE* data, FILE* index, FILE* tempData, FILE* tempIndex, int shard){
+    char tempPath[PATH_SIZE], path[PATH_SIZE];
+    uint64_t start = statsClock();
+    if (fflush(tempData) != 0 || fdatasync(fileno(tempData)) != 0){
+        perror("Error syncing rewritten data file\n");
+        fclose(tempData);
+        fclose(tempIndex);
+        return -1;
+    }
+    fclose(tempData);
+    fclose(tempIndex);
+    if (rename(shardPath(tempPath, TEMP_DATA_PATH, shard), shardPath(path, DATA_PATH, shard)) != 0){
+        perror("Error replacing data file\n");
+        remove(tempPath);
+        remove(shardPath(tempPath, TEMP_INDEX_PATH, shard));
+        return -1;
+    }
+    if (freopen(path, "a+", data) == NULL){
+        perror("Error reopening files after rewriting them\n");
+        return -1;
+    }
+    // The new data file is in place with the old index, which was marked dirty before the rewrite, so it is rebuilt
+    // when the shard is next used
+    if (rename(shardPath(tempPath, TEMP_INDEX_PATH, shard), shardPath(path, INDEX_PATH, shard)) != 0){
+        perror("Error replacing index file\n");
+        remove(tempPath);
+        return -1;
+    }
+    if (freopen(path, "r+", index) == NULL){
+        perror("Error reopening files after rewriting them\n");
+        return -1;
+    }
+    recordOp(STAT_RENAME, start);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef COMPACT_H_
+#define COMPACT_H_
+#include <stdio.h>
+
+/**
+ * @brief Location of one entry in the data file, used to sort entries by key during compaction
+*/
+typedef struct key_ref{
+    char* key;
+    long int offset;
+} KeyRef;
+
+int compareKeyRef(const void* a, const void* b);
+int needsCompaction(FILE* data, FILE* index);
+int compact(FILE* data, FILE* index);
+int compactDatabase(Database* db, int indexOnly, FILE* out);
+int replaceShard(FILE* data, FILE* index, FILE* tempData, FILE* tempIndex, int shard);
+#endif
@@ -5,9 +5,79 @@
 #define UTILITY_H_
 
 #define MAX_KEY_SIZE 256
-#define MAX_VALUE_SIZE 1024
+#define MAX_VALUE_SIZE (16 << 20)
+// Longest value, counting its null terminator, stored inline in data.bin. Longer values are stored in the shard's blob
+// file, see blob.c, so rewriting data.bin doesn't copy them
+#define MAX_INLINE_VALUE 1024
+// Marks an entry's value as stored inline, in place of its offset in the blob file
+#define NO_BLOB UINT64_MAX
+// Identifies data.bin, and the version of the format its entries are written in, see record.c
+#define DATA_MAGIC "KVDB"
+#define DATA_VERSION 2
+#define DATA_HEADER_SIZE 8
+// Generations of a shard's blob file, which are numbered in the bytes of the data file header after the version
+#define BLOB_GENERATIONS (1 << 24)
+// Entries of a sorted data file between keys stored in full rather than sharing a prefix with the key before them
+#define DATA_RESTART_INTERVAL 16
+// Bytes of superseded entries and tombstones data.bin must hold before it is compacted
+#define COMPACT_MIN_DEAD 65536
+// Most threads a data file is read with when compacting it or rebuilding its index, and fewest bytes of the file each
+// thread is given, see chunk.c
+#define MAX_THREADS 64
+#define CHUNK_MIN_SIZE (4 << 20)
+// Identifies index.bin as a B+tree index
+#define INDEX_MAGIC 0x5849564b
+#define INDEX_VERSION 8
+// Size of each page of index.bin, matching the size of a page in the page cache
+#define INDEX_PAGE_SIZE 4096
+// Most levels the tree can have. Even with keys of MAX_KEY_SIZE, a page holds at least 15 of them
+#define INDEX_MAX_HEIGHT 16
+// Bloom filter kept in index.bin, see bloom.c. Bits per key it is sized for, bits set per key, bytes in each block
+// holding a key's bits, and fewest keys a filter is sized for
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 6
+#define BLOOM_BLOCK_SIZE 64
+#define BLOOM_MIN_KEYS 1024
+// Paths of each shard's files, formatted with the shard number, and of the lock file shared by every shard
+#define DATA_PATH "data.%d.bin"
+#define INDEX_PATH "index.%d.bin"
+#define QUEUE_PATH "kvdb.%d.queue"
+#define LOCK_PATH "kvdb.lock"
+// Path of the stats shared by every process using the database, see stats.c
+#define STATS_PATH "kvdb.stats"
+// Path of each shard's blob file, formatted with the shard number and the generation of the file
+#define BLOB_PATH "blob.%d.%u.bin"
+// Paths a shard's files are rewritten to before being renamed over the originals, e.g. by compaction
+#define TEMP_DATA_PATH "tempData.%d.bin"
+#define TEMP_INDEX_PATH "tempIndex.%d.bin"
+// Directory of each snapshot, formatted with the snapshot number, and the files in it besides the shards' files, see
+// snapshot.c
+#define SNAPSHOT_PATH "snapshot.%d"
+#define SNAPSHOT_INFO_PATH "snapshot.info"
+#define SNAPSHOT_LOCK_PATH "snapshot.lock"
+#define SNAPSHOT_DROPPED_PATH "dropped"
+#define PATH_SIZE 64
+// Number of shards a new database is split into, unless KVDB_SHARDS is set
+#define DEFAULT_SHARDS 4
+#define MAX_SHARDS 64
+// Bytes of input ./kvdb load sorts in memory at once, before writing them out as a sorted run
+#define LOAD_RUN_SIZE (64 << 20)
+// Most sorted runs ./kvdb load merges at once. Once there are this many, they are merged into one
+#define LOAD_MERGE_WAYS 16
+// Path of each sorted run, formatted with the run number. Runs are unlinked as soon as they are created
+#define LOAD_RUN_PATH "loadRun.%d.bin"
+// Path of the file ./kvdb load keeps values too long to be stored inline in, until they are copied to the blob files
+#define LOAD_BLOB_PATH "loadBlob.bin"
+// Most bytes between the entries read by a multi-get for the pages between them to be read ahead with them, see mget.c
+#define MGET_READAHEAD_GAP 65536
+// Bytes of recently read keys and values a server keeps in memory, unless KVDB_CACHE is set, see cache.c
+#define DEFAULT_CACHE_SIZE (64 << 20)
+// Default path of the Unix socket used by ./kvdb serve and ./kvdb client
+#define SOCKET_PATH "kvdb.sock"
 
 #include <time.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef struct kv_pair{
     size_t keySize;
@@ -16,4 +86,40 @@ typedef struct kv_pair{
     time_t lastSet;
 } Pair;
 
+// An entry read from a mapping of data.bin. value points into the mapping and is not null terminated, or is NULL if the
+// value is in the blob file. The key is copied out, as it may share a prefix with the key before it
+typedef struct pair_view{
+    Pair kv;
+    char key[MAX_KEY_SIZE];
+    const char* value;
+    uint64_t blob;          // Offset of the value in the shard's blob file, or NO_BLOB if it is stored inline
+} PairView;
+
+typedef struct index_header{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shard;         // Number of the shard this index belongs to
+    uint32_t dirty;         // Set while the index is being modified, so a crash part way through can be detected
+    uint64_t root;          // Page number of the root of the tree
+    uint64_t pageCount;     // Number of pages in the file, including the page holding this header
+    uint64_t height;        // Number of levels in the tree, 1 when the root is a leaf
+    uint64_t count;         // Number of keys in the tree
+    uint64_t bloomPage;     // First page of the Bloom filter
+    uint64_t bloomPages;    // Number of pages in the Bloom filter, 0 if there is none
+    uint64_t bloomCapacity; // Number of keys the Bloom filter was sized for
+    uint64_t indexedSize;   // Size of data.bin when the index was last updated
+    uint64_t deadBytes;     // Bytes in data.bin and the blob file held by superseded entries and tombstones
+    uint64_t bootId;        // Boot of the machine the index was built in, see wal.c
+    uint64_t unsyncedRecords;   // Writes committed to data.bin since it was last synced
+    uint64_t lastSync;      // Time data.bin was last synced, in milliseconds since 1/1/1970
+} IndexHeader;
+
+// Open files of every shard in the database, see shard.c
+typedef struct database{
+    int shards;
+    FILE* data[MAX_SHARDS];
+    FILE* index[MAX_SHARDS];
+    int snapshot;           // Number of the snapshot the files belong to, or 0 for the live database
+} Database;
+
 #endif
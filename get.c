@@ -7,63 +7,213 @@
 #include <time.h>
 #include "definitions.h"
 #include "index.h"
+#include "map.h"
+#include "wal.h"
+#include "record.h"
+#include "blob.h"
+#include "stats.h"
+#include "cache.h"
+
 /**
- * @brief Small function to print time in the required format to stdout
+ * @brief Small function to print time in the required format
+ * @param[in]   out     Stream to print to, e.g. stdout or a client connection
  * @param[in]   time    Time object containing seconds since 1/1/1970
 */
-void printTime(time_t time){
+void printTime(FILE* out, time_t time){
     char buf[50];
     struct tm *ts = localtime(&time);
     strftime(buf, 50, "%Y-%m-%d %H:%M:%S", ts);
-    printf("%s", buf);
+    fprintf(out, "%s", buf);
+}
+
+/**
+ * @brief   Reads the KV entry at the current position of the data file. Counterpart of writePair. Entries are read in
+ *          file order, so the start of a key shared with the key before it (see record.c) is taken from *key.
+ * @param[in]   data    Pointer to data file, positioned at the start of an entry
+ * @param[out]  kv      On return, holds the sizes and timestamps of the entry
+ * @param[in,out]   key     Buffer holding the key. On entry, holds the key of the entry before this one, if any, or
+ *                          may point to NULL. Reallocated to fit the entry
+ * @param[in,out]   value   Buffer holding the value. Reallocated to fit the entry, may point to NULL on entry. Left
+ *                          empty if the value is in the blob file
+ * @param[out]  blob    On return, holds the offset of the value in the blob file, or NO_BLOB if it is in value. May be
+ *                      NULL if not needed
+ * @return  Returns 1 if a full entry was read, 0 on end of file or if the entry is malformed or fails its checksum
+*/
+int readPair(FILE* data, Pair* kv, char** key, char** value, uint64_t* blob){
+    char buf[MAX_RECORD_SIZE];
+    Record record;
+    size_t size = 0;
+    int c = getc(data);
+    if (c == EOF) return 0;
+    buf[size++] = c;
+    // Read the varints at the start of the entry, one fewer for a tombstone and one more for a value in the blob file,
+    // then the rest of it
+    int fields = (c & RECORD_TOMBSTONE) ? 4 : (c & RECORD_BLOB) ? 6 : 5;
+    for (int i = 0; i < fields; i++){
+        do{
+            if (size == MAX_RECORD_HEADER_SIZE || (c = getc(data)) == EOF) return 0;
+            buf[size++] = c;
+        } while (c & 0x80);
+    }
+    if (recordHeader(buf, size, &record) != size) return 0;
+    if (fread(buf + size, 1, record.size - size, data) != record.size - size) return 0;
+    if (decodeRecord(buf, record.size, 1, &record) == 0) return 0;
+    if (record.shared > 0 && (*key == NULL || strlen(*key) < record.shared)) return 0;
+    *kv = record.kv;
+    if (blob != NULL) *blob = record.blob;
+    // Tombstones and values in the blob file have no value bytes, but still allocate one byte so value is a valid empty
+    // string
+    size_t valueLength = kv -> valueSize == 0 || record.blob != NO_BLOB ? 0 : kv -> valueSize - 1;
+    *key = realloc(*key, kv -> keySize);
+    *value = realloc(*value, valueLength + 1);
+    size_t suffix = kv -> keySize - 1 - record.shared;
+    memcpy(*key + record.shared, record.suffix, suffix);
+    (*key)[kv -> keySize - 1] = '\0';
+    memcpy(*value, record.value, valueLength);
+    (*value)[valueLength] = '\0';
+    return 1;
 }
+
 /**
- * @brief Function that uses the index and file offsets in the index.bin file to quickly retrieve KV pairs.
+ * @brief   Reads the KV entry at an offset in a mapping of the data file in place. Counterpart of readPair. The index
+ *          holds every key in full, so the start of a key shared with the key before it is taken from the key the
+ *          index holds for the entry.
+ * @param[in]   data    Mapping of data file
+ * @param[in]   offset  File offset of the entry
+ * @param[in]   key     Key of the entry, as held by the index, which need not be null terminated
+ * @param[in]   length  Length of the key
+ * @param[out]  view    On return, holds the sizes and timestamps of the entry and a copy of its key, and points at its
+ *                      value, which is not null terminated, or holds its offset in the blob file
+ * @return  Returns 1 if a full entry was read, 0 if the offset is past the end of the file or the entry is malformed
+*/
+int viewPair(MappedFile* data, long int offset, const char* key, size_t length, PairView* view){
+    Record record;
+    if (offset < 0 || (size_t)offset >= data -> size) return 0;
+    // The checksum is only checked when the log is replayed, see wal.c
+    if (decodeRecord(data -> base + offset, data -> size - offset, 0, &record) == 0 || record.shared > length) return 0;
+    view -> kv = record.kv;
+    memcpy(view -> key, key, record.shared);
+    memcpy(view -> key + record.shared, record.suffix, record.kv.keySize - 1 - record.shared);
+    view -> key[record.kv.keySize - 1] = '\0';
+    view -> value = record.value;
+    view -> blob = record.blob;
+    return 1;
+}
+
+/**
+ * @brief   Finds the most recent entry for a key on the mapped read path. Both the walk down the index and the read
+ *          of the entry happen in the mappings, so no memory is allocated.
  * @param[in]   data    Pointer to file containing data
  * @param[in]   index   Pointer to file holding index
- * @param[in]   mode    Whether get function should return KV or timestamp. mode == 0 => KV pair, mode == 1 => timestamp
- * @return  Returns 1 if key is found, 0 otherwise.
+ * @param[in]   key     String containing key to search for
+ * @param[out]  view    On return, holds the entry, with its value in the mapping of data.bin, if found. Only valid
+ *                      until the next call, as the files may be remapped
+ * @return  Returns 1 if a live entry is found, 0 if the key does not exist or has been deleted, -1 if either file
+ *          couldn't be mapped
+*/
+int viewKey(FILE* data, FILE* index, char* key, PairView* view){
+    MappedFile* dataMap = mapFile(data);
+    MappedFile* indexMap = mapFile(index);
+    if (dataMap == NULL || indexMap == NULL) return -1;
+    uint64_t start = statsClock();
+    long int offset = viewDataIndex(indexMap, key);
+    recordOp(STAT_INDEX_PROBE, start);
+    if (offset == -1) return 0;
+    start = statsClock();
+    int found = viewPair(dataMap, offset, key, strlen(key), view);
+    recordOp(STAT_DATA_READ, start);
+    // Entries with no value are tombstones left by del
+    return found == 1 && view -> kv.valueSize != 0;
+}
+
+/**
+ * @brief   Finds the most recent entry for a key, using the index to go straight to its offset in the data file.
+ * @param[in]   data    Pointer to file containing data. Anything written through the stream must be flushed first
+ * @param[in]   index   Pointer to file holding index
+ * @param[in]   key     String containing key to search for
+ * @param[out]  kv      On return, holds the sizes and timestamps of the entry, if found
+ * @param[out]  value   On return, holds a malloc'd copy of the value if found. Must be freed by the caller
+ * @return  Returns 1 if a live entry is found, 0 if the key does not exist or has been deleted
+*/
+int findPair(FILE* data, FILE* index, char* key, Pair* kv, char** value){
+    PairView view;
+    IndexHeader header;
+    *value = NULL;
+    if (viewKey(data, index, key, &view) != 1) return 0;
+    *kv = view.kv;
+    *value = malloc(kv -> valueSize);
+    if (view.blob == NO_BLOB) memcpy(*value, view.value, kv -> valueSize - 1);
+    else if (readIndexHeader(index, &header) != 0 ||
+        readBlob(openBlob(header.shard, blobGeneration(data), 0), view.blob, *value, kv -> valueSize - 1) != 0){
+        free(*value);
+        *value = NULL;
+        return 0;
+    }
+    (*value)[kv -> valueSize - 1] = '\0';
+    return 1;
+}
+
+/**
+ * @brief   Prints the value of an entry. A value in the blob file is sent straight from the file, see sendBlob, so it is
+ *          never held in memory
+ * @param[in]   out     Stream to print to
+ * @param[in]   data    Pointer to the data file holding the entry
+ * @param[in]   shard   Number of the shard the entry belongs to
+ * @param[in]   view    Entry, as returned by viewPair
+ * @return  Returns 0 on success, -1 on failure
 */
-int get(FILE* data, FILE* index, char* key, int mode){
-    // First get index of key, if it exists
-    long int startCount, endCount;
-    int exists = getDataIndex(index, key, &startCount, &endCount);
-    if (exists==0){
-        printf("Key not found\n");
+int printValue(FILE* out, FILE* data, int shard, PairView* view){
+    size_t length = view -> kv.valueSize - 1;
+    if (view -> blob == NO_BLOB) return fwrite(view -> value, 1, length, out) == length ? 0 : -1;
+    int fd = openBlob(shard, blobGeneration(data), 0);
+    if (fd == -1){
+        fprintf(stderr, "Blob file of shard %d is missing\n", shard);
         return -1;
     }
-    // Seek the starting offset given by the index file
-    fseek(data, startCount, SEEK_SET);
-    size_t readKeySize = 0; size_t readValueSize = 0;
-    time_t firstSet, lastSet;
+    return sendBlob(out, fd, view -> blob, length);
+}
 
-    // While within bounds given by index file, search for the key
-    while(fread(&readKeySize, sizeof(size_t), 1, data) != 0 && ftell(data) <= endCount){
-        fread(&readValueSize, sizeof(size_t), 1, data);
-        // Use dynamically allocated memory due to variable array length
-        char* readKey = malloc(readKeySize);
-        char* readValue = malloc(readValueSize);
-        fread(readKey, 1, readKeySize, data);
-        fread(readValue, 1, readValueSize, data);
-        readKey[readKeySize-1] = '\0'; readValue[readValueSize-1] = '\0';
-        fread(&firstSet, sizeof(time_t), 1, data);
-        fread(&lastSet, sizeof(time_t), 1, data);
-        // If keys match, return either the KV pair or the timestamp
-        if (strcmp(key, readKey) == 0){
-            if (mode == 0)
-                printf("Key: %s, value %s\n", key, readValue);
-            else if (mode == 1){
-                printf("Time first set:\t");
-                printTime(firstSet);
-                printf("\nTime last set:\t");
-                printTime(lastSet);
-                printf("\n");
-            }
-            return 1;
-        }
-        free(readKey);
-        free(readValue);
+/**
+ * @brief Function that uses the file offsets in the index.bin file to quickly retrieve KV pairs. Reads through the
+ *        mappings of the files, so the value is printed straight from the page cache, or sent from the blob file.
+ *        If this process keeps a cache (see cache.c), a key found there is printed without reading either file, and
+ *        a key that isn't is cached once read.
+ * @param[in]   data    Pointer to file containing data
+ * @param[in]   index   Pointer to file holding index
+ * @param[in]   mode    Whether get function should return KV or timestamp. mode == 0 => KV pair, mode == 1 => timestamp
+ * @param[in]   out     Stream the result is printed to
+ * @return  Returns 1 if key is found, 0 otherwise, or -1 if the files or its value could not be read
+*/
+int get(FILE* data, FILE* index, char* key, int mode, FILE* out){
+    PairView view;
+    IndexHeader header;
+    uint64_t start = statsClock();
+    recordPrefix(key, STAT_GET);
+    int found;
+    if (cacheGet(data, key, &view.kv, &view.value) == 1) view.blob = NO_BLOB;
+    else if ((found = viewKey(data, index, key, &view)) != 1){
+        if (found == 0) fprintf(out, "Key not found\n");
+        recordOp(STAT_GET, start);
+        return found;
+    }
+    else if (view.blob == NO_BLOB) cachePut(data, key, &view.kv, view.value, view.kv.valueSize - 1);
+    // Return either the KV pair or the timestamp
+    if (mode == 0){
+        // Only a value in the blob file needs the shard, to find the file
+        header.shard = 0;
+        if (view.blob != NO_BLOB && readIndexHeader(index, &header) != 0) return -1;
+        fprintf(out, "Key: %s, value ", key);
+        if (printValue(out, data, header.shard, &view) != 0) return -1;
+        fprintf(out, "\n");
+        addStat(STAT_BYTES_READ, view.kv.valueSize - 1);
+    }
+    else if (mode == 1){
+        fprintf(out, "Time first set:\t");
+        printTime(out, view.kv.firstSet);
+        fprintf(out, "\nTime last set:\t");
+        printTime(out, view.kv.lastSet);
+        fprintf(out, "\n");
     }
-    printf("Key not found\n");
-    return 0;
+    recordOp(STAT_GET, start);
+    return 1;
 }
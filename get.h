@@ -3,8 +3,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include "map.h"
 
-void printTime(time_t time);
-int get(FILE* data, FILE* index, char* key, int mode);
+void printTime(FILE* out, time_t time);
+int readPair(FILE* data, Pair* kv, char** key, char** value, uint64_t* blob);
+int viewPair(MappedFile* data, long int offset, const char* key, size_t length, PairView* view);
+int viewKey(FILE* data, FILE* index, char* key, PairView* view);
+int findPair(FILE* data, FILE* index, char* key, Pair* kv, char** value);
+int printValue(FILE* out, FILE* data, int shard, PairView* view);
+int get(FILE* data, FILE* index, char* key, int mode, FILE* out);
 
 #endif
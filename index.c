@@ -1,153 +1,948 @@
 /**
- * @brief   Function definitions for creating an ordered index of key starts, and their accompanying file offsets in the data.bin file
+ * @brief   Function definitions for the B+tree index mapping each key to the file offset of its latest entry in data.bin.
+ *          index.bin is split into pages of INDEX_PAGE_SIZE bytes. Page 0 holds the IndexHeader, and every other page is
+ *          a node of the tree. Leaves hold full keys in order, each with the offset of its entry, and are linked so
+ *          keys can be read in order. Internal pages hold the first key of each child after the first, so a lookup or
+ *          insert reads one page per level of the tree, and a page holds around a hundred short keys.
+ *          Keys are compared as unsigned bytes, giving the same order as strcmp. Each page also keeps the four bytes of
+ *          each key after the start every key in the page shares, packed together in key order, so a search compares
+ *          the key it is looking for against many of them at once with SIMD instructions (AVX2 or SSE2 where the
+ *          processor has them), and only the keys whose four bytes match are compared in full.
+ *          The index can always be rebuilt by replaying data.bin.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "definitions.h"
+#include "get.h"
+#include "set.h"
+#include "map.h"
+#include "index.h"
+#include "wal.h"
+#include "bloom.h"
+#include "record.h"
+#include "stats.h"
+#include "shard.h"
+#include "blob.h"
+#include "chunk.h"
+
+// One of the versions of countPrefixes, see searchPage
+typedef int (*PrefixCounter)(const char* prefixes, int count, uint32_t prefix, int* equal);
+
 /**
- * @brief   Compares the first two letters of two entered strings. Return is based on which string comes first when 
- *          ordered alphabetically
- * @param[in]   a   Pointer to the beginning of the first string
- * @param[in]   b   Pointer to the beginning of the second string
- * @return  Returns 0 if start of strings are equal, 1 if the first string is smaller and 2 if the first string is larger
-*/
-int compareString(char* a, char* b){
-    char aStart[3]; char bStart[3];
-    strncpy(aStart, a, 2);
-    strncpy(bStart, b, 2);
-    aStart[2] = '\0'; bStart[2] = '\0';
-    if (strcmp(aStart, bStart) == 0)
-        return 0;
-    else if (a[0]<b[0])
-        return 1;
-    else if (a[0] == b[0] && a[1] < b[1] && strlen(a) >= 2 && strlen(b) >= 2)
-        return 1;
-    return 2;
-}
-/**
- * @brief Small function to write entries to index.bin
- * @param[in]   tempIndex   Pointer to the new index file that is being written to
- * @param[in]   keyStart    Pointer to char array holding the null terminated start of the key.
- * @param[in]   dataCount   Number of bytes written to the file after this entry is written
-*/
-void writeEntry(FILE* tempIndex, char* keyStart, size_t dataCount){
-    if (fwrite(keyStart, 1, 2, tempIndex) != 2) 
-        fprintf(stderr, "Error writing key start %s to index file\n", keyStart);
-    if (fwrite(&dataCount, sizeof(size_t), 1, tempIndex) != 1) 
-        fprintf(stderr, "Error writing dataCount for key start %s to index file\n", keyStart);
-}
-
-/**
- * @brief   This function updates the index.bin file when "set" or "del" commands are called. It handles a
- *          number of different cases:
- *              -   set: New key index (i.e. Key with unique two letter start): Creates new entry in index.bin with
- *                  the index and the file offset at which the key ends. 
- *              -   set: Existing key index: Updates the offset of the existing index to account for another KV pair 
- *                  being stored at this index.
- *              -   del: Non existant key: Prints "Key not found"
- *              -   del: Index corresponding to >1 KV pair: Updates the offset to remove element corresponding to entered key
- *              -   del: Index corresponding to 1 KV pair: Deletes this index record from index.bin
- * @param[in]   index       Pointer to index file
- * @param[in]   key         String containing key
- * @param[in]   pairSize    Contains one of the following (measures in bytes) depending on context:
- *                              - Size of new KV pair.
- *                              - Difference in size between new and old KV pairs (they have same key)
- *                              - Size of deleted entry (will be negative)
+ * @brief   Hashes a key using 64 bit FNV-1a, e.g. to choose the key's shard. Never returns 0.
+ * @param[in]   key     Null terminated key
+ * @return  Returns the hash of the key
+*/
+uint64_t hashKey(char* key){
+    return hashBytes(key, strlen(key));
+}
+
+/**
+ * @brief   Version of hashKey for keys that are not null terminated, e.g. keys read in place from a page
+ * @param[in]   key     Key
+ * @param[in]   length  Length of the key
+*/
+uint64_t hashBytes(const char* key, size_t length){
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+/**
+ * @brief Reads and validates the header at the start of index.bin
+ * @param[in]   index   Pointer to index file
+ * @param[out]  header  On return, holds the header
+ * @return  Returns 0 on success, -1 if the file is empty or is not a B+tree index
 */
-int addIndexLine(FILE* index, char *key, long int pairSize){
+int readIndexHeader(FILE* index, IndexHeader* header){
     rewind(index);
-    FILE* tempIndex = fopen("tempIndex.bin", "w");
-    char ind[3];
-    char keyStart[3];
-    strncpy(keyStart, key, 2);
-    keyStart[2] = '\0';
-    int found = 0;
-    size_t dataCount = 0;
-    size_t prevDataCount = 0;
-    // If file is new or wrong format encountered, add as first line
-    if (fread(ind, 1, 2, index) == 0){
-        dataCount += pairSize;
-        writeEntry(tempIndex, keyStart, dataCount);
+    if (fread(header, sizeof(IndexHeader), 1, index) != 1) return -1;
+    if (header -> magic != INDEX_MAGIC || header -> version != INDEX_VERSION) return -1;
+    return 0;
+}
+
+/**
+ * @brief Small function to write the header back to the start of index.bin
+ * @param[in]   index   Pointer to index file
+ * @param[in]   header  Header to be written
+*/
+int writeIndexHeader(FILE* index, IndexHeader* header){
+    rewind(index);
+    if (fwrite(header, sizeof(IndexHeader), 1, index) != 1){
+        fprintf(stderr, "Error writing index header\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Small functions to read and write a page of the tree
+ * @param[in]   index   Pointer to index file
+ * @param[in]   pageNo  Number of the page
+ * @param[in,out]   page    Buffer of INDEX_PAGE_SIZE bytes to be read into or written
+*/
+int readPage(FILE* index, uint64_t pageNo, char* page){
+    fseek(index, pageNo*INDEX_PAGE_SIZE, SEEK_SET);
+    if (fread(page, INDEX_PAGE_SIZE, 1, index) != 1){
+        fprintf(stderr, "Error reading page %lu of index file\n", (unsigned long)pageNo);
+        return -1;
+    }
+    return 0;
+}
+int writePage(FILE* index, uint64_t pageNo, char* page){
+    fseek(index, pageNo*INDEX_PAGE_SIZE, SEEK_SET);
+    if (fwrite(page, INDEX_PAGE_SIZE, 1, index) != 1){
+        fprintf(stderr, "Error writing page %lu of index file\n", (unsigned long)pageNo);
+        return -1;
+    }
+    addStat(STAT_INDEX_BYTES, INDEX_PAGE_SIZE);
+    return 0;
+}
+
+/**
+ * @brief   Reads a cell of a page in place. Fields are not aligned, so they are copied out
+ * @param[in]   page    Contents of the page
+ * @param[in]   i       Position of the cell in key order
+ * @param[out]  cell    On return, holds the cell. Its key points into the page
+ * @return  Returns 0 on success, -1 if the cell is out of bounds e.g. because the page is corrupt
+*/
+int readCell(const char* page, int i, IndexCell* cell){
+    PageHeader header;
+    uint16_t pos;
+    memcpy(&header, page, sizeof(PageHeader));
+    if (i < 0 || i >= header.count) return -1;
+    memcpy(&pos, page + sizeof(PageHeader) + header.count*KEY_PREFIX_SIZE + i*sizeof(uint16_t), sizeof(uint16_t));
+    if (pos < header.heapStart || pos + CELL_HEADER_SIZE > INDEX_PAGE_SIZE) return -1;
+    memcpy(&(cell -> length), page + pos, sizeof(uint16_t));
+    memcpy(&(cell -> value), page + pos + sizeof(uint16_t), sizeof(uint64_t));
+    if (pos + CELL_HEADER_SIZE + cell -> length > INDEX_PAGE_SIZE) return -1;
+    cell -> key = page + pos + CELL_HEADER_SIZE;
+    return 0;
+}
+
+/**
+ * @brief   Compares two keys that may not be null terminated as unsigned bytes, like strcmp
+ * @return  Returns a negative number if a comes first, a positive number if b comes first, and 0 if they are equal
+*/
+int compareKeys(const char* a, size_t aLength, const char* b, size_t bLength){
+    int result = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (result != 0) return result;
+    return (aLength > bLength) - (aLength < bLength);
+}
+
+/**
+ * @brief   Small function to get the prefix of a key kept in its page: the KEY_PREFIX_SIZE bytes after the start shared
+ *          by every key in the page, padded with zeroes, as a big endian number. Keys hold no zero bytes, so comparing
+ *          the prefixes of two keys as numbers gives the same order as comparing the keys, or a tie
+ * @param[in]   key     Key, after the bytes shared by the page
+ * @param[in]   length  Length of the rest of the key
+*/
+static uint32_t keyPrefix(const char* key, size_t length){
+    uint32_t prefix = 0;
+    for (size_t i = 0; i < KEY_PREFIX_SIZE; i++) prefix = prefix << 8 | (i < length ? (unsigned char)key[i] : 0);
+    return prefix;
+}
+
+/**
+ * @brief   Counts the key prefixes of a page below and equal to the prefix of a key. The prefixes are in key order, so
+ *          those below the key come first, then those equal to it, and counting stops at the first one above it
+ * @param[in]   prefixes    Block of key prefixes of the page, which need not be aligned
+ * @param[in]   count       Number of prefixes in the block
+ * @param[in]   prefix      Prefix of the key searched for
+ * @param[out]  equal       On return, holds the number of prefixes equal to the key's
+ * @return  Returns the number of prefixes below the key's
+*/
+static int countPrefixes(const char* prefixes, int count, uint32_t prefix, int* equal){
+    int below = 0;
+    *equal = 0;
+    for (int i = 0; i < count; i++){
+        uint32_t other;
+        memcpy(&other, prefixes + i*KEY_PREFIX_SIZE, KEY_PREFIX_SIZE);
+        if (other > prefix) break;
+        if (other < prefix) below++;
+        else (*equal)++;
+    }
+    return below;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief   Versions of countPrefixes comparing four prefixes at a time with SSE2, and eight at a time with AVX2. There
+ *          are no unsigned compares, so the top bit of each prefix is flipped to compare them as signed numbers
+*/
+__attribute__((target("sse2")))
+static int countPrefixesSse2(const char* prefixes, int count, uint32_t prefix, int* equal){
+    __m128i flip = _mm_set1_epi32(INT32_MIN);
+    __m128i key = _mm_xor_si128(_mm_set1_epi32(prefix), flip);
+    int below = 0, i = 0;
+    *equal = 0;
+    for (; i + 4 <= count; i += 4){
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(prefixes + i*KEY_PREFIX_SIZE)), flip);
+        int lower = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(key, block)));
+        int same = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(key, block)));
+        below += __builtin_popcount(lower);
+        *equal += __builtin_popcount(same);
+        if ((lower | same) != 0xf) return below;
     }
+    int rest;
+    below += countPrefixes(prefixes + i*KEY_PREFIX_SIZE, count - i, prefix, &rest);
+    *equal += rest;
+    return below;
+}
+
+__attribute__((target("avx2")))
+static int countPrefixesAvx2(const char* prefixes, int count, uint32_t prefix, int* equal){
+    __m256i flip = _mm256_set1_epi32(INT32_MIN);
+    __m256i key = _mm256_xor_si256(_mm256_set1_epi32(prefix), flip);
+    int below = 0, i = 0;
+    *equal = 0;
+    for (; i + 8 <= count; i += 8){
+        __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(prefixes + i*KEY_PREFIX_SIZE)), flip);
+        int lower = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key, block)));
+        int same = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(key, block)));
+        below += __builtin_popcount(lower);
+        *equal += __builtin_popcount(same);
+        if ((lower | same) != 0xff) return below;
+    }
+    int rest;
+    below += countPrefixesSse2(prefixes + i*KEY_PREFIX_SIZE, count - i, prefix, &rest);
+    *equal += rest;
+    return below;
+}
+#endif
+
+/**
+ * @brief   Picks the fastest version of countPrefixes the processor supports, the first time a page is searched.
+ *          Setting KVDB_SIMD to 0 picks the plain loop, e.g. to measure the difference
+*/
+static PrefixCounter pickPrefixCounter(void){
+    char* env = getenv("KVDB_SIMD");
+    if (env != NULL && strcmp(env, "0") == 0) return countPrefixes;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return countPrefixesAvx2;
+    if (__builtin_cpu_supports("sse2")) return countPrefixesSse2;
+#endif
+    return countPrefixes;
+}
+
+/**
+ * @brief   Searches a page for a key. The start every key in the page shares is compared first, then the key's prefix is
+ *          compared against the block of key prefixes to find the cells it could be, and only those are compared in
+ *          full, by binary search. Usually there is at most one.
+ * @param[in]   page    Contents of the page
+ * @param[in]   key     Key to search for, which need not be null terminated
+ * @param[in]   length  Length of the key
+ * @param[out]  found   On return, 1 if the page holds the key and 0 otherwise
+ * @return  Returns the position of the first cell with a key not before the one searched for
+*/
+int searchPage(const char* page, const char* key, uint16_t length, int* found){
+    static PrefixCounter counter = NULL;
+    PageHeader header;
+    IndexCell cell;
+    memcpy(&header, page, sizeof(PageHeader));
+    *found = 0;
+    if (header.count == 0 || readCell(page, 0, &cell) != 0 || cell.length < header.shared) return 0;
+    // A key not starting with the shared bytes comes before or after every key in the page
+    int result = compareKeys(cell.key, header.shared, key, length < header.shared ? length : header.shared);
+    if (result != 0) return result > 0 ? 0 : header.count;
+    if (counter == NULL) counter = pickPrefixCounter();
+    int equal;
+    int low = counter(page + sizeof(PageHeader), header.count, keyPrefix(key + header.shared, length - header.shared),
+        &equal);
+    int high = low + equal;
+    while (low < high){
+        int mid = (low + high) / 2;
+        if (readCell(page, mid, &cell) != 0) return low;
+        result = compareKeys(cell.key, cell.length, key, length);
+        if (result == 0){
+            *found = 1;
+            return mid;
+        }
+        if (result < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * @brief   Small function to find the child of an internal page that a key belongs in
+*/
+static uint64_t childFor(const char* page, const char* key, uint16_t length){
+    PageHeader header;
+    IndexCell cell;
+    int found;
+    memcpy(&header, page, sizeof(PageHeader));
+    int pos = searchPage(page, key, length, &found);
+    // Each cell's child holds the keys from the cell's key up to the next cell's key
+    if (!found) pos--;
+    if (pos < 0 || readCell(page, pos, &cell) != 0) return header.link;
+    return cell.value;
+}
+
+/**
+ * @brief Small function to make a page empty
+ * @param[out]  page    Buffer of INDEX_PAGE_SIZE bytes
+ * @param[in]   leaf    1 for a leaf, 0 for an internal page
+ * @param[in]   link    For a leaf, the next leaf. For an internal page, the child before the first key
+*/
+void initPage(char* page, int leaf, uint64_t link){
+    PageHeader header;
+    memset(page, 0, INDEX_PAGE_SIZE);
+    memset(&header, 0, sizeof(PageHeader));
+    header.leaf = leaf;
+    header.heapStart = INDEX_PAGE_SIZE;
+    header.link = link;
+    memcpy(page, &header, sizeof(PageHeader));
+}
+
+/**
+ * @brief   Fills in the block of key prefixes of a page from its cells, e.g. once the start its keys share has changed
+ * @param[in,out]   page    Contents of the page
+*/
+static void setPrefixes(char* page){
+    PageHeader header;
+    IndexCell cell;
+    memcpy(&header, page, sizeof(PageHeader));
+    for (int i = 0; i < header.count && readCell(page, i, &cell) == 0; i++){
+        uint32_t prefix = keyPrefix(cell.key + header.shared, cell.length - header.shared);
+        memcpy(page + sizeof(PageHeader) + i*KEY_PREFIX_SIZE, &prefix, KEY_PREFIX_SIZE);
+    }
+}
+
+/**
+ * @brief   Adds a cell to a page, if there is room for it
+ * @param[in,out]   page    Contents of the page
+ * @param[in]   pos     Position of the new cell in key order
+ * @param[in]   key     Key of the cell, which need not be null terminated
+ * @param[in]   length  Length of the key
+ * @param[in]   value   Value of the cell
+ * @return  Returns 0 on success, -1 if the page is full
+*/
+int pageInsert(char* page, int pos, const char* key, uint16_t length, uint64_t value){
+    PageHeader header;
+    IndexCell first;
+    memcpy(&header, page, sizeof(PageHeader));
+    size_t size = CELL_HEADER_SIZE + length;
+    if (header.heapStart < sizeof(PageHeader) + (header.count + 1)*SLOT_SIZE + size) return -1;
+    // The start shared by every key in the page shrinks to the part of it the new key shares. The first key of a page
+    // shares all of itself
+    uint16_t shared = length;
+    if (header.count > 0){
+        shared = 0;
+        if (readCell(page, 0, &first) == 0)
+            while (shared < header.shared && shared < length && first.key[shared] == key[shared]) shared++;
+    }
+    header.heapStart -= size;
+    memcpy(page + header.heapStart, &length, sizeof(uint16_t));
+    memcpy(page + header.heapStart + sizeof(uint16_t), &value, sizeof(uint64_t));
+    memcpy(page + header.heapStart + CELL_HEADER_SIZE, key, length);
+    // Make room for the new slot. The offsets move up past the grown block of prefixes, the ones after the new cell
+    // moving first as they move furthest
+    char* prefixes = page + sizeof(PageHeader);
+    char* offsets = prefixes + header.count*KEY_PREFIX_SIZE;
+    char* moved = offsets + KEY_PREFIX_SIZE;
+    memmove(moved + (pos + 1)*sizeof(uint16_t), offsets + pos*sizeof(uint16_t), (header.count - pos)*sizeof(uint16_t));
+    memmove(moved, offsets, pos*sizeof(uint16_t));
+    memmove(prefixes + (pos + 1)*KEY_PREFIX_SIZE, prefixes + pos*KEY_PREFIX_SIZE, (header.count - pos)*KEY_PREFIX_SIZE);
+    memcpy(moved + pos*sizeof(uint16_t), &(header.heapStart), sizeof(uint16_t));
+    header.count++;
+    if (shared != header.shared || header.count == 1){
+        header.shared = shared;
+        memcpy(page, &header, sizeof(PageHeader));
+        setPrefixes(page);
+        return 0;
+    }
+    uint32_t prefix = keyPrefix(key + shared, length - shared);
+    memcpy(prefixes + pos*KEY_PREFIX_SIZE, &prefix, KEY_PREFIX_SIZE);
+    memcpy(page, &header, sizeof(PageHeader));
+    return 0;
+}
+
+/**
+ * @brief   Splits a full page in two to make room for a new cell. Cells are shared out so each page holds about half
+ *          the bytes, except when a key is added to the end of the last leaf, as when keys are added in order: then
+ *          the new leaf starts with just the new key, so leaves are left full.
+ * @param[in,out]   page    Contents of the full page. On return, holds the first half of the cells
+ * @param[out]  right   On return, holds the second half of the cells
+ * @param[in]   rightNo Page number the second half will be written to
+ * @param[in]   pos     Position of the new cell in key order
+ * @param[in]   cell    The new cell
+ * @param[out]  separator   Buffer of at least MAX_KEY_SIZE bytes. On return, holds the first key of the right page,
+ *                      which is to be added to the parent
+ * @param[out]  length  On return, holds the length of the separator
+*/
+int splitPage(char* page, char* right, uint64_t rightNo, int pos, IndexCell* cell, char* separator, uint16_t* length){
+    char old[INDEX_PAGE_SIZE];
+    IndexCell cells[INDEX_PAGE_SIZE / CELL_HEADER_SIZE + 1];
+    PageHeader header;
+    memcpy(old, page, INDEX_PAGE_SIZE);
+    memcpy(&header, old, sizeof(PageHeader));
+    int total = header.count + 1;
+    size_t bytes = 0;
+    for (int i = 0; i < total; i++){
+        if (i == pos) cells[i] = *cell;
+        else if (readCell(old, i < pos ? i : i - 1, &cells[i]) != 0) return -1;
+        bytes += CELL_HEADER_SIZE + cells[i].length;
+    }
+    // Choose the first cell of the right page
+    int split = 0;
+    if (header.leaf && header.link == 0 && pos == header.count) split = header.count;
     else{
-        rewind(index);
-        while(fread(ind, 1, 2, index) != 0){
-            ind[2] = '\0';
-            fread(&dataCount, sizeof(size_t), 1, index);
-            // If correct posiiton already found, increase offset and continue to writing
-            if (found != 0) dataCount += pairSize;
-            // Else, check if this is the correct position
-            else {
-                int result = compareString(keyStart, ind);
-                // If strings are equal, increase the count for the next string
-                if (result == 0){
-                    dataCount += pairSize;
-                    found = 1;
-                    if (prevDataCount == dataCount){
-                        // In this case, the key has no bytes associated with it in data file i.e. it is deleted
-                        continue;
-                    }
-                }
-                // If key is less, must update this data count to be prevDataCount + pairSize and update next dataCount 
-                else if (result == 1){
-                    size_t thisCount = prevDataCount + pairSize;    // Update the new entry's count
-                    dataCount = thisCount + (dataCount - prevDataCount);    // Update next 
-                    writeEntry(tempIndex, keyStart, thisCount);
-                    found = 1;
-                }
-                prevDataCount = dataCount;
-            }
-            // Now write back to file
-            writeEntry(tempIndex, ind, dataCount);
+        for (size_t half = 0; split < total - 1 && half < bytes/2; split++) half += CELL_HEADER_SIZE + cells[split].length;
+        if (split == 0) split = 1;
+    }
+    // The separator may be the new cell's key, so copy it before the pages are rewritten
+    *length = cells[split].length;
+    memcpy(separator, cells[split].key, *length);
+    if (header.leaf){
+        initPage(right, 1, header.link);
+        initPage(page, 1, rightNo);
+        for (int i = 0; i < total; i++){
+            char* target = i < split ? page : right;
+            pageInsert(target, i < split ? i : i - split, cells[i].key, cells[i].length, cells[i].value);
+        }
+    }
+    else{
+        // The separator moves up to the parent, and its child becomes the right page's first child
+        initPage(right, 0, cells[split].value);
+        initPage(page, 0, header.link);
+        for (int i = 0; i < total; i++){
+            if (i == split) continue;
+            char* target = i < split ? page : right;
+            pageInsert(target, i < split ? i : i - split - 1, cells[i].key, cells[i].length, cells[i].value);
         }
-        // If adding to end of file, must update dataCount accordingly
-        if (found == 0){
-            dataCount += pairSize;
-            writeEntry(tempIndex, keyStart, dataCount);
+    }
+    return 0;
+}
+
+/**
+ * @brief   Truncates the index file and writes an empty tree, which is a single empty leaf, and an empty Bloom filter
+ * @param[in]   index       Pointer to index file
+ * @param[out]  header      On return, holds the header of the new tree
+ * @param[in]   shard       Number of the shard the index belongs to
+*/
+static int writeEmptyIndex(FILE* index, IndexHeader* header, int shard){
+    char page[INDEX_PAGE_SIZE];
+    memset(header, 0, sizeof(IndexHeader));
+    header -> magic = INDEX_MAGIC;
+    header -> version = INDEX_VERSION;
+    header -> shard = shard;
+    header -> root = 1;
+    header -> pageCount = 2;
+    header -> height = 1;
+    header -> bootId = currentBootId();
+    fflush(index);
+    if (ftruncate(fileno(index), 0) != 0){
+        perror("Error resizing index.bin\n");
+        return -1;
+    }
+    // The header page is padded with zeroes
+    memset(page, 0, INDEX_PAGE_SIZE);
+    memcpy(page, header, sizeof(IndexHeader));
+    if (writePage(index, 0, page) != 0) return -1;
+    initPage(page, 1, 0);
+    if (writePage(index, header -> root, page) != 0 || buildBloom(index, header) != 0) return -1;
+    return writeIndexHeader(index, header);
+}
+
+/**
+ * @brief   Creates an empty index, see writeEmptyIndex. Its pages are counted as building an index rather than as written
+ *          by sets and dels, see stats.c
+*/
+int createIndex(FILE* index, IndexHeader* header, int shard){
+    beginIndexBuild();
+    int result = writeEmptyIndex(index, header, shard);
+    endIndexBuild();
+    return result;
+}
+
+/**
+ * @brief   Adds a key to the tree, or points it at a new entry if it is already there. The leaf the key belongs in is
+ *          found by reading one page per level. If the leaf is full it is split, and the first key of the new leaf is
+ *          added to its parent, which may split in turn. When the root splits, a new root is added above it.
+ * @param[in]   index   Pointer to index file
+ * @param[in,out]   header  Header of the index. The root, page count, height and key count are updated, but the header
+ *                      is not written
+ * @param[in]   key     Key to be added
+ * @param[in]   offset  File offset of the key's entry in the data file
+ * @return  Returns 1 if the key was added, 0 if it was already in the tree and -1 on failure
+*/
+int insertIndexLine(FILE* index, IndexHeader* header, char* key, long int offset){
+    char page[INDEX_PAGE_SIZE];
+    char right[INDEX_PAGE_SIZE];
+    char separators[2][MAX_KEY_SIZE];
+    uint64_t path[INDEX_MAX_HEIGHT];
+    int depth = 0;
+    int found;
+    uint64_t pageNo = header -> root;
+    PageHeader pageHeader;
+    IndexCell cell = {key, strlen(key), offset};
+
+    // Find the leaf the key belongs in, remembering the path to it
+    for (;;){
+        if (readPage(index, pageNo, page) != 0) return -1;
+        memcpy(&pageHeader, page, sizeof(PageHeader));
+        if (pageHeader.leaf) break;
+        if (depth == INDEX_MAX_HEIGHT - 1) return -1;
+        path[depth++] = pageNo;
+        pageNo = childFor(page, cell.key, cell.length);
+    }
+    int pos = searchPage(page, cell.key, cell.length, &found);
+    if (found){
+        // Point the key at its new entry in place
+        IndexCell old;
+        if (readCell(page, pos, &old) != 0) return -1;
+        memcpy((char*)old.key - sizeof(uint64_t), &(cell.value), sizeof(uint64_t));
+        return writePage(index, pageNo, page);
+    }
+    header -> count++;
+    for (int level = 0; ; level++){
+        if (pageInsert(page, pos, cell.key, cell.length, cell.value) == 0)
+            return writePage(index, pageNo, page) == 0 ? 1 : -1;
+        // The page is full, so split it and add the new page to the parent
+        uint64_t rightNo = header -> pageCount++;
+        char* separator = separators[level % 2];
+        uint16_t length;
+        if (splitPage(page, right, rightNo, pos, &cell, separator, &length) != 0 ||
+            writePage(index, pageNo, page) != 0 || writePage(index, rightNo, right) != 0) return -1;
+        cell.key = separator;
+        cell.length = length;
+        cell.value = rightNo;
+        if (depth == 0){
+            if (header -> height == INDEX_MAX_HEIGHT) return -1;
+            // The root has split, so the tree grows a level
+            uint64_t rootNo = header -> pageCount++;
+            initPage(page, 0, pageNo);
+            pageInsert(page, 0, cell.key, cell.length, cell.value);
+            header -> root = rootNo;
+            header -> height++;
+            return writePage(index, rootNo, page) == 0 ? 1 : -1;
         }
+        pageNo = path[--depth];
+        if (readPage(index, pageNo, page) != 0) return -1;
+        pos = searchPage(page, cell.key, cell.length, &found);
     }
-//    fclose(index);
-    fclose(tempIndex);
-    remove("index.bin");
-    rename("tempIndex.bin", "index.bin");
-    index = fopen("index.bin", "r");
+}
+
+/**
+ * @brief Small functions to get the number of cells in a page, and to set the link of a page
+*/
+static int cellCount(const char* page){
+    PageHeader header;
+    memcpy(&header, page, sizeof(PageHeader));
+    return header.count;
+}
+static void setLink(char* page, uint64_t link){
+    memcpy(page + offsetof(PageHeader, link), &link, sizeof(uint64_t));
+}
+
+/**
+ * @brief   Starts building a tree from keys in order, replacing the empty tree written by createIndex
+ * @param[out]  builder Builder to be initialised
+ * @param[in]   index   Pointer to index file
+ * @param[in,out]   header  Header of the index, which is updated as keys are added but is not written
+*/
+int beginBuild(IndexBuilder* builder, FILE* index, IndexHeader* header){
+    memset(builder, 0, sizeof(IndexBuilder));
+    builder -> index = index;
+    builder -> header = header;
+    builder -> pages = malloc(INDEX_MAX_HEIGHT * INDEX_PAGE_SIZE);
+    if (builder -> pages == NULL){
+        fprintf(stderr, "Error allocating memory to build index\n");
+        return -1;
+    }
+    header -> pageCount = 1;
+    header -> height = 0;
+    header -> count = 0;
+    header -> bloomPages = 0;
     return 0;
 }
 
 /**
- * @brief Function to obtain a file offset range that contains a particular key. This can be used to rapidly obtain
- *        keys in the data file. 
- * @param[in]   index   Pointer to index.bin file.
+ * @brief   Adds a key to a tree being built. Keys must be added to the leaves in order, and each must be new. Once a
+ *          page is full it is written out, and the next page at that level is added to the level above, so every
+ *          page but the last at each level is left full.
+ * @param[in,out]   builder Builder started by beginBuild
+ * @param[in]   level   Level to add the key to, 0 for the leaves
+ * @param[in]   key     Key to be added, which need not be null terminated
+ * @param[in]   length  Length of the key
+ * @param[in]   value   For a leaf, file offset of the key's entry. Otherwise, child holding the keys from this key on
+*/
+int buildIndexLine(IndexBuilder* builder, int level, const char* key, uint16_t length, uint64_t value){
+    if (level == INDEX_MAX_HEIGHT) return -1;
+    char* page = builder -> pages + level*INDEX_PAGE_SIZE;
+    IndexHeader* header = builder -> header;
+    if (level == builder -> levels){
+        // First page of a new level. Above the leaves, its first child is the first page of the level below
+        builder -> pageNos[level] = builder -> firstPages[level] = header -> pageCount++;
+        initPage(page, level == 0, level == 0 ? 0 : builder -> firstPages[level - 1]);
+        builder -> levels++;
+    }
+    else if (pageInsert(page, cellCount(page), key, length, value) == 0){
+        if (level == 0) header -> count++;
+        return 0;
+    }
+    else{
+        // The page is full, so write it out and start the next page at this level
+        uint64_t next = header -> pageCount++;
+        if (level == 0) setLink(page, next);
+        if (writePage(builder -> index, builder -> pageNos[level], page) != 0) return -1;
+        builder -> pageNos[level] = next;
+        if (level > 0){
+            // The child becomes the first child of the new page, and its key goes to the level above instead
+            initPage(page, 0, value);
+            return buildIndexLine(builder, level + 1, key, length, next);
+        }
+        initPage(page, 1, 0);
+        if (buildIndexLine(builder, level + 1, key, length, next) != 0) return -1;
+    }
+    if (level == 0) header -> count++;
+    return pageInsert(page, cellCount(page), key, length, value);
+}
+
+/**
+ * @brief   Finishes building a tree, writing out the last page at each level, then builds its Bloom filter
+ * @param[in,out]   builder Builder started by beginBuild, whose memory is freed
+*/
+int endBuild(IndexBuilder* builder){
+    int result = 0;
+    if (builder -> levels == 0){
+        // No keys were added, so the tree is a single empty leaf
+        builder -> pageNos[0] = builder -> header -> pageCount++;
+        initPage(builder -> pages, 1, 0);
+        builder -> levels = 1;
+    }
+    for (int level = 0; level < builder -> levels && result == 0; level++)
+        result = writePage(builder -> index, builder -> pageNos[level], builder -> pages + level*INDEX_PAGE_SIZE);
+    builder -> header -> root = builder -> pageNos[builder -> levels - 1];
+    builder -> header -> height = builder -> levels;
+    free(builder -> pages);
+    builder -> pages = NULL;
+    // The filter follows the tree, sized for the number of keys now known
+    if (result == 0) result = buildBloom(builder -> index, builder -> header);
+    return result;
+}
+
+/**
+ * @brief   This function updates index.bin when "set" or "del" commands are called. The key is pointed at its new
+ *          entry, which is a tombstone when the key is deleted, or is added to the tree and the Bloom filter if it is new.
+ * @param[in]   index       Pointer to index file
+ * @param[in]   key         String containing key
+ * @param[in]   offset      File offset of the key's new entry in data.bin
+ * @param[in]   end         File offset just after the entry, up to which data.bin is then covered by the index
+ * @param[in]   deadBytes   Number of bytes in data.bin and the blob file made obsolete by this write, used to decide
+ *                          when to compact
+*/
+int addIndexLine(FILE* index, char *key, long int offset, long int end, long int deadBytes){
+    IndexHeader header;
+    if (readIndexHeader(index, &header) != 0){
+        fprintf(stderr, "index.bin is not a valid index\n");
+        return -1;
+    }
+    int added = insertIndexLine(index, &header, key, offset);
+    if (added == -1 || (added == 1 && bloomAdd(index, &header, key) != 0)) return -1;
+    // Record how much of the data file is covered by the index, which is only up to this entry, as entries after it
+    // may not have been indexed yet
+    header.indexedSize = end;
+    header.deadBytes += deadBytes;
+    if (writeIndexHeader(index, &header) != 0) return -1;
+    return fflush(index);
+}
+
+/**
+ * @brief   Small function to get a page of a mapped index, checking it is within the file
+ * @return  Returns a pointer to the page in the mapping, or NULL if it is out of bounds
+*/
+const char* mappedPage(MappedFile* index, IndexHeader* header, uint64_t pageNo){
+    if (pageNo == 0 || pageNo >= header -> pageCount || (pageNo + 1)*INDEX_PAGE_SIZE > index -> size) return NULL;
+    return index -> base + pageNo*INDEX_PAGE_SIZE;
+}
+
+/**
+ * @brief   Small function to read the header of a mapped index
+ * @return  Returns 0 on success, -1 if the file is not a valid index
+*/
+static int mappedHeader(MappedFile* index, IndexHeader* header){
+    if (index -> size < sizeof(IndexHeader)) return -1;
+    memcpy(header, index -> base, sizeof(IndexHeader));
+    return header -> magic == INDEX_MAGIC && header -> version == INDEX_VERSION ? 0 : -1;
+}
+
+/**
+ * @brief   Finds the leaf of a mapped index that a key belongs in
+ * @param[in]   index   Mapping of index.bin
+ * @param[in]   header  Header of the index
+ * @param[in]   key     Key to search for, or NULL for the first leaf
+ * @param[in]   length  Length of the key
+ * @param[out]  pageNo  On return, holds the page number of the leaf
+ * @return  Returns a pointer to the leaf in the mapping, or NULL if the index is corrupt
+*/
+static const char* findLeaf(MappedFile* index, IndexHeader* header, const char* key, uint16_t length, uint64_t* pageNo){
+    *pageNo = header -> root;
+    for (uint64_t level = 0; level < INDEX_MAX_HEIGHT; level++){
+        const char* page = mappedPage(index, header, *pageNo);
+        if (page == NULL) return NULL;
+        PageHeader pageHeader;
+        memcpy(&pageHeader, page, sizeof(PageHeader));
+        if (pageHeader.leaf) return page;
+        *pageNo = key == NULL ? pageHeader.link : childFor(page, key, length);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Function to obtain the file offset of the latest entry for a key in the data file
+ * @param[in]   index   Pointer to index.bin file. Anything written through the stream must be flushed first
  * @param[in]   key     Pointer to string containing key.
- * @param[out]  startCount  On return, holds the start file offset in bytes, where the key is located within [startCount, endCount]
- * @param[out]  endCount    On return, holds the end file offset in bytes.
+ * @return  Returns the file offset of the key's latest entry, which may be a tombstone, or -1 if the key has never been set
 */
-size_t getDataIndex(FILE* index, char *key, long int* startCount, long int* endCount){
-    rewind(index);
-    char ind[3];
-    char keyStart[3];
-    strncpy(keyStart, key, 2);
-    keyStart[2] = '\0';
-    // Initialise to 0 in case file is empty
-    *startCount = 0;
-    *endCount = 0;
-    size_t dataCount = 0;
-    // Read through to find the correct key start (if there is one) and return it's accompanying file offset range
-    while(fread(ind, 1, 2, index) != 0){
-        ind[2] = '\0';
-        int result = compareString(keyStart, ind);
-        fread(&dataCount, sizeof(size_t), 1, index);
-        if (result == 0){
-            *endCount = dataCount;
+long int getDataIndex(FILE* index, char *key){
+    MappedFile* indexMap = mapFile(index);
+    if (indexMap == NULL) return -1;
+    return viewDataIndex(indexMap, key);
+}
+
+/**
+ * @brief   Version of getDataIndex for the mapped read path. The Bloom filter is checked first, then the tree is
+ *          walked and keys compared in place in the mapping, without any copying or allocation.
+ * @param[in]   index   Mapping of index.bin
+ * @param[in]   key     Pointer to string containing key.
+ * @return  Returns the file offset of the key's latest entry, which may be a tombstone, or -1 if the key has never been set
+*/
+long int viewDataIndex(MappedFile* index, char *key){
+    IndexHeader header;
+    IndexCell cell;
+    uint64_t pageNo;
+    int found;
+    size_t length = strlen(key);
+    if (length >= MAX_KEY_SIZE || mappedHeader(index, &header) != 0) return -1;
+    // Most keys that have never been set are ruled out here, without walking the tree
+    if (bloomMayContain(index, &header, key, length) == 0){
+        addStat(STAT_BLOOM_REJECTS, 1);
+        return -1;
+    }
+    addStat(STAT_INDEX_PAGES, header.height);
+    const char* page = findLeaf(index, &header, key, length, &pageNo);
+    if (page == NULL) return -1;
+    int pos = searchPage(page, key, length, &found);
+    if (!found || readCell(page, pos, &cell) != 0) return -1;
+    return cell.value;
+}
+
+/**
+ * @brief   Positions a cursor at the first key of a mapped index that is not before a given key
+ * @param[out]  cursor  Cursor to be positioned
+ * @param[in]   index   Mapping of index.bin
+ * @param[in]   key     Null terminated key to start from, or NULL to start from the first key
+ * @return  Returns 0 on success, -1 if the index is not valid
+*/
+int seekIndex(IndexCursor* cursor, MappedFile* index, const char* key){
+    int found;
+    memset(cursor, 0, sizeof(IndexCursor));
+    cursor -> index = index;
+    if (mappedHeader(index, &(cursor -> header)) != 0) return -1;
+    size_t length = key == NULL ? 0 : strlen(key);
+    if (length >= MAX_KEY_SIZE) length = MAX_KEY_SIZE - 1;
+    const char* page = findLeaf(index, &(cursor -> header), key, length, &(cursor -> page));
+    if (page == NULL){
+        cursor -> page = 0;
+        return -1;
+    }
+    cursor -> cell = key == NULL ? 0 : searchPage(page, key, length, &found);
+    return 0;
+}
+
+/**
+ * @brief   Reads the key at a cursor and moves it on to the next key, following the links between leaves
+ * @param[in,out]   cursor  Cursor positioned by seekIndex
+ * @param[out]  cell    On return, holds the key and the file offset of its entry. The key points into the mapping
+ * @return  Returns 1 if a key was read, 0 once every key has been read
+*/
+int nextIndex(IndexCursor* cursor, IndexCell* cell){
+    PageHeader pageHeader;
+    // Pages are linked in order, so there can't be more leaves to visit than pages
+    for (uint64_t visited = 0; cursor -> page != 0 && visited < cursor -> header.pageCount; visited++){
+        const char* page = mappedPage(cursor -> index, &(cursor -> header), cursor -> page);
+        if (page == NULL) break;
+        memcpy(&pageHeader, page, sizeof(PageHeader));
+        if (cursor -> cell < pageHeader.count){
+            if (readCell(page, cursor -> cell++, cell) != 0) break;
             return 1;
         }
-        else if (result == 1){
-            *endCount = *startCount;
-            return 0;
+        cursor -> page = pageHeader.link;
+        cursor -> cell = 0;
+    }
+    cursor -> page = 0;
+    return 0;
+}
+
+/**
+ * @brief   Adds every entry in the data file from a given offset onwards to the index, in order, so later entries
+ *          for a key replace earlier ones. The offset must be 0 or the offset of an entry that stores its key in full.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @param[in]   from    File offset of the first entry to be indexed
+ * @return  Returns 0 on success, -1 if an entry couldn't be indexed, leaving the index covering the entries before it
+*/
+int indexData(FILE* data, FILE* index, long int from){
+    Pair read;
+    PairView old;
+    char* readKey = NULL;
+    char* readValue = NULL;
+    long int start = dataStart(data);
+    if (start == -1) return -1;
+    long int offset = from > start ? from : start;
+    int result = 0;
+    fseek(data, offset, SEEK_SET);
+    while (readPair(data, &read, &readKey, &readValue, NULL) == 1){
+        long int next = ftell(data);
+        // Account for the entry this one replaces, and for tombstones which will be dropped by compaction
+        long int deadBytes = read.valueSize == 0 ? pairSize(&read, NO_BLOB) : 0;
+        long int oldOffset = getDataIndex(index, readKey);
+        MappedFile* dataMap = oldOffset == -1 ? NULL : mapFile(data);
+        if (dataMap != NULL && viewPair(dataMap, oldOffset, readKey, read.keySize - 1, &old) == 1 &&
+            old.kv.valueSize != 0) deadBytes += pairSize(&old.kv, old.blob);
+        if (addIndexLine(index, readKey, offset, next, deadBytes) != 0){
+            result = -1;
+            break;
         }
-        *startCount = dataCount;
+        offset = next;
+        fseek(data, offset, SEEK_SET);
     }
-    *endCount = *startCount;
-    rewind(index);
+    free(readKey); free(readValue);
+    return result;
+}
+
+/**
+ * @brief   Small function to check whether the index can be trusted, or must be rebuilt from data.bin. This is the case
+ *          if it is missing or not a valid index, if a process died while modifying it, if it covers more of data.bin
+ *          than survived a crash, or if the machine has rebooted since it was built, see wal.c.
+ * @param[in]   header  Header of the index
+ * @param[in]   dataSize    Size of data.bin
+*/
+int indexNeedsRebuild(IndexHeader* header, long int dataSize){
+    return header -> dirty || header -> indexedSize > (uint64_t)dataSize ||
+        (currentBootId() != 0 && header -> bootId != currentBootId());
+}
+
+/**
+ * @brief   Rebuilds a shard's index from the whole of data.bin, e.g. if it is damaged or can't be trusted after a crash.
+ *          The file is read by several threads if it is large, see chunk.c, and the tree is built bottom up from the
+ *          sorted keys rather than by inserting each entry in turn. The new index is written to TEMP_INDEX_PATH and
+ *          renamed over the old one, so readers in other processes see either the old index or the new one. Anything
+ *          after the last whole entry of data.bin is cut off first.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file. Reopened on the new index on return
+ * @param[in]   shard   Number of the shard the files belong to
+ * @return  Returns 0 on success, -1 on failure
+*/
+static int buildFromData(FILE* data, FILE* index, int shard){
+    IndexHeader header;
+    IndexBuilder builder;
+    Record record;
+    KeyRef* refs = NULL;
+    size_t count = 0;
+    char tempPath[PATH_SIZE], path[PATH_SIZE];
+    uint64_t begin = statsClock();
+    memset(&builder, 0, sizeof(IndexBuilder));
+    long int start = dataStart(data);
+    MappedFile* dataMap = start == -1 || fflush(data) != 0 ? NULL : mapFile(data);
+    if (dataMap == NULL) return -1;
+    uint64_t blobBytes = blobSize(shard, blobGeneration(data));
+    long int end = sortEntries(dataMap, start, blobBytes, &refs, &count);
+    if (end == -1 || truncateTorn(data, end, shard) == -1){
+        freeRefs(refs, count);
+        return -1;
+    }
+    FILE* temp = fopen(shardPath(tempPath, TEMP_INDEX_PATH, shard), "w+");
+    int result = temp == NULL || createIndex(temp, &header, shard) != 0 || beginBuild(&builder, temp, &header) != 0 ?
+        -1 : 0;
+    // Only the last entry for each key is current, and keys whose last entry is a tombstone are left out. Everything
+    // else in data.bin and the blob file is dead
+    uint64_t liveBytes = 0, liveBlob = 0;
+    for (size_t i = 0; i < count && result == 0; i++){
+        if (i + 1 < count && strcmp(refs[i].key, refs[i+1].key) == 0) continue;
+        decodeRecord(dataMap -> base + refs[i].offset, end - refs[i].offset, 0, &record);
+        if (record.kv.valueSize == 0) continue;
+        liveBytes += record.size;
+        if (record.blob != NO_BLOB) liveBlob += record.kv.valueSize - 1;
+        result = buildIndexLine(&builder, 0, refs[i].key, record.kv.keySize - 1, refs[i].offset);
+    }
+    freeRefs(refs, count);
+    if (temp != NULL && builder.pages != NULL && endBuild(&builder) != 0) result = -1;
+    if (result == 0){
+        header.indexedSize = end;
+        header.deadBytes = (end - start - liveBytes) + (blobBytes - liveBlob);
+        result = writeIndexHeader(temp, &header);
+    }
+    if (temp != NULL && fclose(temp) != 0) result = -1;
+    if (result != 0){
+        fprintf(stderr, "Error rebuilding index of shard %d\n", shard);
+        remove(tempPath);
+        return -1;
+    }
+    if (rename(tempPath, shardPath(path, INDEX_PATH, shard)) != 0 || freopen(path, "r+", index) == NULL){
+        perror("Error replacing index file\n");
+        return -1;
+    }
+    recordOp(STAT_REINDEX, begin);
     return 0;
 }
+
+/**
+ * @brief   Rebuilds a shard's index from data.bin, see buildFromData, counting its pages as building an index
+*/
+int rebuildIndex(FILE* data, FILE* index, int shard){
+    beginIndexBuild();
+    int result = buildFromData(data, index, shard);
+    endIndexBuild();
+    return result;
+}
+
+/**
+ * @brief   Prepares the index for use when the database is opened, replaying data.bin as a write-ahead log. If the
+ *          index can't be trusted, it is rebuilt from the whole of data.bin. Otherwise entries appended to data.bin
+ *          after the index was last updated are indexed. Anything after the last whole entry is cut off first.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @param[in]   shard   Number of the shard the files belong to
+*/
+static int replayData(FILE* data, FILE* index, int shard){
+    IndexHeader header;
+    // A data file written before the format was versioned is rewritten in the current format, moving every entry
+    int upgraded = dataStart(data) == -1;
+    if (upgraded && upgradeData(data, shard) != 0) return -1;
+    fseek(data, 0, SEEK_END);
+    if (!upgraded && (readIndexHeader(index, &header) != 0 || indexNeedsRebuild(&header, ftell(data))))
+        return rebuildIndex(data, index, shard);
+    if (upgraded && createIndex(index, &header, shard) != 0) return -1;
+    long int dataSize = truncateTorn(data, header.indexedSize, shard);
+    if (dataSize == -1) return -1;
+    if (dataSize > (long int)header.indexedSize){
+        // If replaying stops part way, the index is left dirty, so it is rebuilt from data.bin when next used
+        if (markIndexDirty(index) != 0 || indexData(data, index, header.indexedSize) != 0) return -1;
+    }
+    // Everything replayed is already in the data file, so there is nothing new to sync
+    return syncLog(data, index, 0, 0);
+}
+
+/**
+ * @brief   Prepares a shard's index for use, see replayData, counting its pages as building an index
+*/
+int loadIndex(FILE* data, FILE* index, int shard){
+    beginIndexBuild();
+    int result = replayData(data, index, shard);
+    endIndexBuild();
+    return result;
+}
@@ -1,8 +1,86 @@
 #ifndef INDEX_C_
 #define INDEX_C_
 #include <stdio.h>
-int compareString(char* a, char* b);
-void writeEntry(FILE* tempIndex, char* keyStart, size_t dataCount);
-int addIndexLine(FILE* index, char *key, long int pairSize);
-size_t getDataIndex(FILE* index, char *key, long int* startCount, long int* endCount);
-#endif
\ No newline at end of file
+#include <stdint.h>
+#include "map.h"
+
+// Bytes at the start of each cell before its key: the key length and the value
+#define CELL_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint64_t))
+// Bytes of each key, after the start shared by every key in its page, kept in the page's block of key prefixes
+#define KEY_PREFIX_SIZE sizeof(uint32_t)
+// Bytes at the front of a page for each cell: its key prefix and the offset of the cell
+#define SLOT_SIZE (KEY_PREFIX_SIZE + sizeof(uint16_t))
+
+/**
+ * @brief   Header at the start of each page of the tree. It is followed by a block holding a prefix of each cell's key,
+ *          then the offsets of the cells, both in key order, and the cells themselves fill the page from the end
+*/
+typedef struct page_header{
+    uint16_t leaf;          // 1 for a leaf, 0 for an internal page
+    uint16_t count;         // Number of cells in the page
+    uint16_t heapStart;     // Offset of the lowest cell in the page
+    uint16_t shared;        // Bytes every key in the page starts with, which the key prefixes start after
+    uint64_t link;          // Leaf: page number of the next leaf, 0 for the last. Internal: child before the first key
+} PageHeader;
+
+/**
+ * @brief   One cell of a page: a key, without a null terminator, and its value. In a leaf the value is the file offset
+ *          of the key's latest entry in data.bin. In an internal page it is the child holding keys from this key on
+*/
+typedef struct index_cell{
+    const char* key;
+    uint16_t length;
+    uint64_t value;
+} IndexCell;
+
+/**
+ * @brief Position in the leaves of a mapped index, used to read keys in order
+*/
+typedef struct index_cursor{
+    MappedFile* index;
+    IndexHeader header;
+    uint64_t page;          // Page number of the current leaf, 0 once every key has been read
+    int cell;               // Position of the next cell in the leaf
+} IndexCursor;
+
+/**
+ * @brief   Builds a tree from keys added in order, filling each page before starting the next, e.g. when compacting.
+ *          One page is kept in memory for each level of the tree.
+*/
+typedef struct index_builder{
+    FILE* index;
+    IndexHeader* header;
+    int levels;
+    uint64_t pageNos[INDEX_MAX_HEIGHT];     // Page being filled at each level
+    uint64_t firstPages[INDEX_MAX_HEIGHT];  // First page of each level
+    char* pages;                            // Contents of the page being filled at each level
+} IndexBuilder;
+
+uint64_t hashKey(char* key);
+uint64_t hashBytes(const char* key, size_t length);
+int readIndexHeader(FILE* index, IndexHeader* header);
+int writeIndexHeader(FILE* index, IndexHeader* header);
+int readPage(FILE* index, uint64_t pageNo, char* page);
+int writePage(FILE* index, uint64_t pageNo, char* page);
+int readCell(const char* page, int i, IndexCell* cell);
+int compareKeys(const char* a, size_t aLength, const char* b, size_t bLength);
+int searchPage(const char* page, const char* key, uint16_t length, int* found);
+void initPage(char* page, int leaf, uint64_t link);
+int pageInsert(char* page, int pos, const char* key, uint16_t length, uint64_t value);
+int splitPage(char* page, char* right, uint64_t rightNo, int pos, IndexCell* cell, char* separator, uint16_t* length);
+int createIndex(FILE* index, IndexHeader* header, int shard);
+int insertIndexLine(FILE* index, IndexHeader* header, char* key, long int offset);
+int beginBuild(IndexBuilder* builder, FILE* index, IndexHeader* header);
+int buildIndexLine(IndexBuilder* builder, int level, const char* key, uint16_t length, uint64_t value);
+int endBuild(IndexBuilder* builder);
+int addIndexLine(FILE* index, char *key, long int offset, long int end, long int deadBytes);
+const char* mappedPage(MappedFile* index, IndexHeader* header, uint64_t pageNo);
+long int getDataIndex(FILE* index, char *key);
+long int viewDataIndex(MappedFile* index, char *key);
+int seekIndex(IndexCursor* cursor, MappedFile* index, const char* key);
+int nextIndex(IndexCursor* cursor, IndexCell* cell);
+int indexData(FILE* data, FILE* index, long int from);
+int indexNeedsRebuild(IndexHeader* header, long int dataSize);
+int rebuildIndex(FILE* data, FILE* index, int shard);
+int loadIndex(FILE* data, FILE* index, int shard);
+#endif
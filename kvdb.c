@@ -2,9 +2,10 @@
  * @brief   Main function for implementing IO for the database.
  *          Database is a binary file, with an index file to make getting values faster.
  *          Binary file is quicker to write and read to. Data is stored dynamically and contiguously so memory footprint is small.
- *          All values are stored in alphabetical order in both index.bin and data.bin. This implementation is scalable. If database 
- *          will be large, can extend implementation to have multiple data files holding different alphabetical ranges. 
- *          These will be pointed to by the index file. 
+ *          Writes are appended to the end of data.bin, with deletes stored as tombstones, so a write does not rewrite
+ *          the file. index.bin is a B+tree mapping each key to the offset of its latest entry. Once enough of data.bin
+ *          is dead, it is compacted back into alphabetical order. scan and range read keys in order from the leaves of the tree. This implementation is scalable. The database is split
+ *          into shards by key hash, each with its own data and index files, so a write only touches one shard.
  * @date    24-10-2023
 */
 #include <stdio.h>
@@ -12,30 +13,46 @@
 #include <string.h>
 #include <time.h> 
 #include <sys/file.h>
-#include <semaphore.h>
 #include "definitions.h"
 #include "index.h"
 #include "set.h"
 #include "get.h"
+#include "server.h"
+#include "lock.h"
+#include "shard.h"
+#include "scan.h"
+#include "load.h"
+#include "stats.h"
+#include "mget.h"
+#include "compact.h"
+#include "snapshot.h"
 
 int main(int argc, char* argv[]){
-    sem_t mutex;
-    if (sem_init(&mutex, 0, 1) != 0) {
-        perror("sem_init");
+    if (argc < 2){
+        printf("No command entered. For help type ./kvdb help\n");
         return -1;
     }
-    // Open files if they exist, else create them 
-    FILE* index = fopen("index.bin", "r");
-    if (index == NULL) index = fopen("index.bin", "w+");
-    FILE* data = fopen("data.bin", "r");
-    if (data == NULL) data = fopen("data.bin", "w+");
-    
-    if (index == NULL){
-        perror("Error opening index.bin\n");
+    // The client only talks to a running server, so doesn't need the database files
+    if (strcmp(argv[1], "client") == 0){
+        if (argc > 3){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb client [socket]\n");
+            return -1;
+        }
+        return client(argc == 3 ? argv[2] : SOCKET_PATH);
+    }
+    // Open every shard's files, creating them if they don't exist
+    Database db;
+    if (openDatabase(&db) != 0) return -1;
+    // A snapshot's files are never written, so it can only be read, and without taking locks, see snapshot.c
+    if (db.snapshot != 0 && strcmp(argv[1], "get") != 0 && strcmp(argv[1], "ts") != 0 && strcmp(argv[1], "mget") != 0 &&
+        strcmp(argv[1], "scan") != 0 && strcmp(argv[1], "range") != 0){
+        printf("Snapshot %d is read only. Unset KVDB_SNAPSHOT to use the live database\n", db.snapshot);
+        closeDatabase(&db);
         return -1;
     }
-    if (data == NULL){
-        perror("Error opening data.bin\n");
+    // Other processes may be using the database at the same time, see lock.c
+    if (db.snapshot == 0 && openLock() != 0){
+        closeDatabase(&db);
         return -1;
     }
     char command[10];
@@ -44,80 +61,194 @@ int main(int argc, char* argv[]){
     if (strcmp(command, "set") == 0){
         if (argc != 4){
             printf("Incorrect numer of arguments entered\nUsage: ./test set key value\n");
-            fclose(data); fclose(index);
+            closeDatabase(&db);
             return 0;
         }
         // Begin by initialising a Pair struct
         Pair* entry = malloc(sizeof(Pair));
-        entry -> keySize = strlen(argv[2]) + 1;
-        if (entry -> keySize > MAX_KEY_SIZE){
-            fprintf(stderr, "Entered key is too long. To adjust maximum key size, please edit #define in utility.h\n");
-            fclose(data); fclose(index);
+        if (initPair(entry, argv[2], argv[3], stderr) != 0){
+            free(entry);
+            closeDatabase(&db);
             return -1;
         }
-        entry -> valueSize = strlen(argv[3]) + 1;
-        if (entry -> valueSize > MAX_VALUE_SIZE){
-            fprintf(stderr, "Entered value is too long. To adjust maximum value size, please edit #define in utility.h\n");
-            fclose(data); fclose(index);
-            return -1;
-        }
-        time(&(entry -> firstSet));
-        time(&(entry -> lastSet));
 
-        // Use semaphores to ensure exclusive write access 
-        sem_wait(&mutex);
-        set(data, index, argv[2], argv[3], entry, 0);
-        sem_post(&mutex);
+        // Queue the write to be group committed with any concurrent writes to the key's shard
+        int shard = shardOf(&db, argv[2]);
+        commitWrite(db.data[shard], db.index[shard], shard, argv[2], argv[3], entry, 0);
 
         free(entry);
     }
     else if (strcmp(command, "get") == 0){
         if (argc != 3){
             printf("Incorrect number of arguments entered.\nUsage: ./test get key\n");
-            fclose(data); fclose(index);
+            closeDatabase(&db);
             return -1;
         }
-        // Don't need any semaphores here - writing processes write to a temp file then rename so no issues with reading
-        get(data, index, argv[2], 0);
+        // Readers share the lock, so only wait for a commit in progress to the key's shard
+        int shard = shardOf(&db, argv[2]);
+        if (beginRead(db.data[shard], db.index[shard], shard) == 0){
+            get(db.data[shard], db.index[shard], argv[2], 0, stdout);
+            endRead(shard);
+        }
 
     }
     else if (strcmp(command, "ts") == 0){
         if (argc != 3){
             printf("Incorrect number of arguments entered.\nUsage: ./test ts key\n");
-            fclose(data); fclose(index);
+            closeDatabase(&db);
             return -1;
         }
 
-        // Don't need any semaphores here - writing processes write to a temp file then rename so no issues with reading
-        get(data, index, argv[2], 1);
+        // Readers share the lock, so only wait for a commit in progress to the key's shard
+        int shard = shardOf(&db, argv[2]);
+        if (beginRead(db.data[shard], db.index[shard], shard) == 0){
+            get(db.data[shard], db.index[shard], argv[2], 1, stdout);
+            endRead(shard);
+        }
 
     }
+    else if (strcmp(command, "mget") == 0){
+        if (argc < 3){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb mget key [key ...], or ./kvdb mget - to read keys from stdin\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // Finds every key in the index, then reads the entries in file order, in one sweep of each data file
+        if (argc == 3 && strcmp(argv[2], "-") == 0){
+            size_t count;
+            char** keys = readKeys(stdin, &count);
+            long int result = keys == NULL ? -1 : mget(&db, keys, count, stdout);
+            if (keys != NULL) freeKeys(keys, count);
+            if (result == -1){
+                closeDatabase(&db);
+                return -1;
+            }
+        }
+        else mget(&db, argv + 2, argc - 2, stdout);
+    }
     else if (strcmp(command, "del") == 0){
         if (argc != 3){
             printf("Incorrect number of arguments entered.\nUsage: ./test del key\n");
-            fclose(data); fclose(index);
+            closeDatabase(&db);
             return -1;
         }
         char value[] = "null";
-        Pair* entry = malloc(sizeof(Pair));
-        // Use semaphores to ensure exclusive write
-        sem_wait(&mutex);
-        set(data, index, argv[2], value, entry, 1);
-        sem_post(&mutex);
+        Pair* entry = calloc(1, sizeof(Pair));
+        // Queue the write to be group committed with any concurrent writes to the key's shard
+        int shard = shardOf(&db, argv[2]);
+        if (commitWrite(db.data[shard], db.index[shard], shard, argv[2], value, entry, 1) == 1) printf("Key not found\n");
         free(entry);
     }
+    else if (strcmp(command, "scan") == 0){
+        if (argc != 3){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb scan prefix\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // Streams every key starting with the prefix, in order, from all shards
+        scan(&db, NULL, NULL, argv[2], stdout);
+    }
+    else if (strcmp(command, "range") == 0){
+        if (argc != 4){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb range from to\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // Streams every key from the first to the second inclusive, in order, from all shards
+        scan(&db, argv[2], argv[3], NULL, stdout);
+    }
+    else if (strcmp(command, "load") == 0){
+        if (argc != 3){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb load file\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // Sorts the whole file, then rewrites every shard in one pass, instead of a set per line
+        FILE* input = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+        if (input == NULL){
+            perror("Error opening file to load\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        long int result = load(&db, input, stdout);
+        if (input != stdin) fclose(input);
+        if (result == -1){
+            closeDatabase(&db);
+            return -1;
+        }
+    }
+    else if (strcmp(command, "compact") == 0 || strcmp(command, "reindex") == 0){
+        if (argc != 2){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb %s\n", command);
+            closeDatabase(&db);
+            return -1;
+        }
+        // Rewrites one shard at a time, reading each data file with a thread per processor
+        if (compactDatabase(&db, strcmp(command, "reindex") == 0, stdout) != 0){
+            closeDatabase(&db);
+            return -1;
+        }
+    }
+    else if (strcmp(command, "stats") == 0){
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], "reset") != 0)){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb stats [reset]\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // The stats are shared by every process using the database, including any server
+        if (argc == 3) printf(resetStats() == 0 ? "Stats reset\n" : "Stats are turned off\n");
+        else printStats(stdout);
+    }
+    else if (strcmp(command, "snapshot") == 0){
+        int list = argc == 3 && strcmp(argv[2], "list") == 0;
+        int drop = argc == 4 && strcmp(argv[2], "drop") == 0;
+        int backup = argc == 5 && strcmp(argv[2], "backup") == 0;
+        if (argc != 2 && !list && !drop && !backup){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb snapshot [list | drop number | backup number dir]\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // Taking a snapshot links the data files and copies the indexes, so costs little however large the database is
+        int result = list ? listSnapshots(stdout) : drop ? dropSnapshot(atoi(argv[3]), stdout) :
+            backup ? backupSnapshot(atoi(argv[3]), argv[4], stdout) : createSnapshot(&db, stdout);
+        if (result != 0){
+            closeDatabase(&db);
+            return -1;
+        }
+    }
+    else if (strcmp(command, "serve") == 0){
+        if (argc > 3){
+            printf("Incorrect number of arguments entered.\nUsage: ./kvdb serve [socket]\n");
+            closeDatabase(&db);
+            return -1;
+        }
+        // The server keeps the files open, and takes the same locks as other processes for each request
+        serve(&db, argc == 3 ? argv[2] : SOCKET_PATH);
+    }
     else if (strcmp(command, "help") == 0){
         printf("Usage:\n");
         printf("./kvdb set key value\tSets a key value pair in the database\n");
         printf("./kvdb get key\t\tGets the value correspoding to the entered key from the database\n");
         printf("./kvdb ts key\t\tReturns the timestamp that this key was first and last set.\n");
+        printf("./kvdb mget key ...\tGets the values of many keys at once, in one pass over the data, or reads the keys from stdin for -\n");
         printf("./kvdb del key\t\tDeletes a key value pair from the database\n");
+        printf("./kvdb scan prefix\tLists every key value pair whose key starts with prefix, in alphabetical order\n");
+        printf("./kvdb range from to\tLists every key value pair with a key from from to to inclusive, in alphabetical order\n");
+        printf("./kvdb load file\tLoads a file of \"key value\" lines, or stdin for -, replacing any keys already set\n");
+        printf("./kvdb compact\t\tCompacts every shard now, dropping superseded entries and tombstones\n");
+        printf("./kvdb reindex\t\tRebuilds every shard's index from its data file, e.g. if it is damaged\n");
+        printf("./kvdb stats [reset]\tPrints the latency of each operation, bytes written and hot key prefixes, or clears them\n");
+        printf("./kvdb snapshot\t\tTakes a snapshot of the database as it is now, and prints its number\n");
+        printf("./kvdb snapshot list\tLists every snapshot, with the time it was taken and the bytes only it keeps on disk\n");
+        printf("./kvdb snapshot drop number\tDrops a snapshot, which is removed once no process is reading it\n");
+        printf("./kvdb snapshot backup number dir\tCopies a snapshot to dir as a database of its own\n");
+        printf("KVDB_SNAPSHOT=number ./kvdb get|ts|mget|scan|range ...\tReads a snapshot instead of the live database\n");
+        printf("./kvdb serve [socket]\tKeeps the database open and serves requests over a Unix socket (default %s)\n", SOCKET_PATH);
+        printf("./kvdb client [socket]\tSends requests read from stdin, one per line e.g. \"get key\", to a running server\n");
     }
     else{
         printf("Unknown command entered. For help type ./kvdb help\n");
     }
-    sem_destroy(&mutex);
-    fclose(index);
-    fclose(data);
+    closeDatabase(&db);
     return 0;
 }
@@ -0,0 +1,478 @@
+/**
+ * @brief   Function definitions for bulk loading key value pairs from a file, e.g. to load an initial dataset without
+ *          running a set per key. The input is sorted with an external merge sort: up to LOAD_RUN_SIZE bytes of it are
+ *          sorted in memory at a time and written out as a sorted run, and the runs are merged, so memory use does not
+ *          depend on the size of the input. The merged keys come out in alphabetical order, so each shard's data file
+ *          and index are then written in one sequential pass, merged with the keys already in the shard, in the same
+ *          form compaction leaves them in. Values too long to be stored inline are set aside in a file of their own
+ *          while the input is sorted, so the runs only hold their offsets, and are copied to the blob file of their
+ *          shard as the shard is written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "definitions.h"
+#include "index.h"
+#include "set.h"
+#include "get.h"
+#include "compact.h"
+#include "shard.h"
+#include "lock.h"
+#include "load.h"
+#include "record.h"
+#include "blob.h"
+#include "stats.h"
+#include "wal.h"
+
+/**
+ * @brief Small function to open a new sorted run. It is unlinked straight away, so it is removed once closed
+*/
+static FILE* openRun(int* runs){
+    char path[PATH_SIZE];
+    FILE* run = fopen(shardPath(path, LOAD_RUN_PATH, (*runs)++), "w+");
+    if (run == NULL){
+        perror("Error creating sorted run\n");
+        return NULL;
+    }
+    unlink(path);
+    return run;
+}
+
+/**
+ * @brief   Sorts the input held in memory and writes it out as a sorted run. Each ref points at a key in the buffer,
+ *          followed by its value, and its offset is its position in the input, so the last entry for a key wins.
+ *          Values too long to be stored inline are appended to the load's blob file, and the run holds their offsets.
+ * @param[in]   refs    Keys read from the input
+ * @param[in]   count   Number of keys
+ * @param[in]   now     Time the load started, used as the time every key was set
+ * @param[in,out]   runs    Number of runs created so far
+ * @param[in]   blob    File descriptor of the load's blob file
+ * @return  Returns the run, positioned at its first entry, or NULL on failure
+*/
+static FILE* writeRun(KeyRef* refs, size_t count, time_t now, int* runs, int blob){
+    SortedWriter writer;
+    FILE* run = openRun(runs);
+    if (run == NULL) return NULL;
+    if (beginSorted(&writer, run, 0) != 0){
+        fclose(run);
+        return NULL;
+    }
+    qsort(refs, count, sizeof(KeyRef), compareKeyRef);
+    Pair kv;
+    kv.firstSet = kv.lastSet = now;
+    size_t i;
+    for (i = 0; i < count; i++){
+        if (i + 1 < count && strcmp(refs[i].key, refs[i+1].key) == 0) continue;
+        char* value = refs[i].key + strlen(refs[i].key) + 1;
+        kv.keySize = strlen(refs[i].key) + 1;
+        kv.valueSize = strlen(value) + 1;
+        uint64_t blobOffset = NO_BLOB;
+        if (kv.valueSize > MAX_INLINE_VALUE){
+            long int offset = appendBlob(blob, value, kv.valueSize - 1);
+            if (offset == -1) break;
+            blobOffset = offset;
+        }
+        if (writeSorted(&writer, refs[i].key, value, blobOffset, &kv) == -1) break;
+    }
+    if (i < count || ferror(run) || fflush(run) != 0){
+        perror("Error writing sorted run\n");
+        fclose(run);
+        return NULL;
+    }
+    fseek(run, DATA_HEADER_SIZE, SEEK_SET);
+    return run;
+}
+
+/**
+ * @brief Small function to read the next entry of a run, or mark it finished
+*/
+static void advanceRun(LoadRun* run){
+    run -> valid = readPair(run -> file, &(run -> kv), &(run -> key), &(run -> value), &(run -> blob));
+}
+
+/**
+ * @brief   Starts merging sorted runs, reading the first entry of each
+ * @param[out]  merge   Runs to be initialised
+ * @param[in]   files   Sorted runs, oldest first, each positioned at its first entry
+ * @param[in]   count   Number of runs
+*/
+static void beginMerge(LoadRun* merge, FILE** files, int count){
+    memset(merge, 0, count*sizeof(LoadRun));
+    for (int i = 0; i < count; i++){
+        merge[i].file = files[i];
+        advanceRun(&merge[i]);
+    }
+}
+
+/**
+ * @brief   Finds the run holding the next key in a merge. If several runs hold the key, the entry in the newest run
+ *          is the one loaded, and the others are skipped.
+ * @param[in,out]   merge   Runs being merged
+ * @param[in]   count   Number of runs
+ * @return  Returns the position of the run, whose entry should be read then advanced past, or -1 once every run is
+ *          finished
+*/
+static int nextMerged(LoadRun* merge, int count){
+    int best = -1;
+    for (int i = 0; i < count; i++){
+        if (merge[i].valid && (best == -1 || strcmp(merge[i].key, merge[best].key) <= 0)) best = i;
+    }
+    for (int i = 0; best != -1 && i < count; i++){
+        if (i != best && merge[i].valid && strcmp(merge[i].key, merge[best].key) == 0) advanceRun(&merge[i]);
+    }
+    return best;
+}
+
+/**
+ * @brief Small function to free the buffers of a merge and close its runs
+*/
+static void endMerge(LoadRun* merge, int count){
+    for (int i = 0; i < count; i++){
+        free(merge[i].key);
+        free(merge[i].value);
+        fclose(merge[i].file);
+    }
+}
+
+/**
+ * @brief   Merges every sorted run into one, so there are never more than LOAD_MERGE_WAYS open at once
+ * @param[in,out]   files   Sorted runs, oldest first. On return, the first holds the merged run
+ * @param[in,out]   count   Number of runs, 1 on return
+ * @param[in,out]   runs    Number of runs created so far
+*/
+static int mergeRuns(FILE** files, int* count, int* runs){
+    LoadRun merge[LOAD_MERGE_WAYS];
+    SortedWriter writer;
+    FILE* merged = openRun(runs);
+    if (merged == NULL) return -1;
+    if (beginSorted(&writer, merged, 0) != 0){
+        fclose(merged);
+        return -1;
+    }
+    beginMerge(merge, files, *count);
+    int next, failed = 0;
+    while (!failed && (next = nextMerged(merge, *count)) != -1){
+        // A key that can't be written fails the merge, rather than leaving a run with the keys after it missing
+        failed = writeSorted(&writer, merge[next].key, merge[next].value, merge[next].blob, &(merge[next].kv)) == -1;
+        advanceRun(&merge[next]);
+    }
+    endMerge(merge, *count);
+    if (failed || ferror(merged) || fflush(merged) != 0){
+        perror("Error writing sorted run\n");
+        fclose(merged);
+        *count = 0;
+        return -1;
+    }
+    fseek(merged, DATA_HEADER_SIZE, SEEK_SET);
+    files[0] = merged;
+    *count = 1;
+    return 0;
+}
+
+/**
+ * @brief   Reads the input and sorts it into runs. Each line holds a key, a space and a value, which runs to the end of
+ *          the line. Lines that can't be loaded are reported and skipped.
+ * @param[in]   input   File to be loaded
+ * @param[out]  files   On return, holds the sorted runs, oldest first
+ * @param[out]  count   On return, holds the number of runs
+ * @param[in]   now     Time the load started
+ * @param[in]   blob    File descriptor of the load's blob file
+ * @return  Returns the number of lines read, or -1 on failure
+*/
+static long int sortInput(FILE* input, FILE** files, int* count, time_t now, int blob){
+    size_t bufferSize = LOAD_RUN_SIZE, used = 0, refCount = 0, refCapacity = 1024;
+    char* buffer = malloc(bufferSize);
+    KeyRef* refs = malloc(refCapacity * sizeof(KeyRef));
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    long int lineNo = 0, loaded = 0;
+    int runs = 0, result = 0;
+    *count = 0;
+    if (buffer == NULL || refs == NULL){
+        fprintf(stderr, "Error allocating memory to sort input\n");
+        free(buffer);
+        free(refs);
+        return -1;
+    }
+    while (result == 0 && (length = getline(&line, &lineCapacity, input)) != -1){
+        lineNo++;
+        while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r')) line[--length] = '\0';
+        if (length == 0) continue;
+        char* value = strchr(line, ' ');
+        if (value == NULL){
+            fprintf(stderr, "Skipping line %ld: expected a key and a value\n", lineNo);
+            continue;
+        }
+        *value++ = '\0';
+        Pair entry;
+        if (initPair(&entry, line, value, stderr) != 0){
+            fprintf(stderr, "Skipping line %ld\n", lineNo);
+            continue;
+        }
+        // Once the buffer is full, sort it and write it out, merging the runs once there are too many to keep open
+        if (used + entry.keySize + entry.valueSize > bufferSize){
+            files[*count] = writeRun(refs, refCount, now, &runs, blob);
+            if (files[*count] == NULL) result = -1;
+            else if (++(*count) == LOAD_MERGE_WAYS) result = mergeRuns(files, count, &runs);
+            used = refCount = 0;
+        }
+        if (refCount == refCapacity){
+            KeyRef* grown = realloc(refs, 2*refCapacity*sizeof(KeyRef));
+            if (grown == NULL){
+                fprintf(stderr, "Error allocating memory to sort input\n");
+                result = -1;
+                break;
+            }
+            refs = grown;
+            refCapacity *= 2;
+        }
+        refs[refCount].key = memcpy(buffer + used, line, entry.keySize + entry.valueSize);
+        refs[refCount].offset = refCount;
+        refCount++;
+        used += entry.keySize + entry.valueSize;
+        loaded++;
+    }
+    if (result == 0 && refCount > 0){
+        files[*count] = writeRun(refs, refCount, now, &runs, blob);
+        if (files[*count] == NULL) result = -1;
+        else (*count)++;
+    }
+    free(line);
+    free(buffer);
+    free(refs);
+    if (result != 0){
+        for (int i = 0; i < *count; i++) fclose(files[i]);
+        *count = 0;
+        return -1;
+    }
+    return loaded;
+}
+
+/**
+ * @brief Small function to move a shard's cursor over its existing keys on to the next live entry
+*/
+static void advanceExisting(ShardLoad* load){
+    IndexCell cell;
+    load -> existingValid = 0;
+    while (nextIndex(&(load -> existing), &cell) == 1){
+        // Entries with no value are tombstones left by del, and are dropped like compaction drops them
+        if (viewPair(load -> existingData, cell.value, cell.key, cell.length, &(load -> view)) == 1 &&
+            load -> view.kv.valueSize != 0){
+            load -> existingValid = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief   Starts rewriting a shard, opening its temp files and a cursor over the keys already in it. LOCK_COMMIT and
+ *          LOCK_DATA must be held exclusively.
+ * @param[out]  load    Rewrite to be started
+ * @param[in]   db      Open database
+ * @param[in]   shard   Number of the shard
+*/
+static int beginShardLoad(ShardLoad* load, Database* db, int shard){
+    char path[PATH_SIZE];
+    memset(load, 0, sizeof(ShardLoad));
+    load -> shard = shard;
+    load -> blob = -1;
+    if (refreshFiles(db -> data[shard], db -> index[shard], shard) != 0) return -1;
+    if (indexNeedsLoad(db -> data[shard], db -> index[shard]) &&
+        loadIndex(db -> data[shard], db -> index[shard], shard) != 0) return -1;
+    load -> existingData = mapFile(db -> data[shard]);
+    MappedFile* index = mapFile(db -> index[shard]);
+    if (load -> existingData == NULL || index == NULL || seekIndex(&(load -> existing), index, NULL) != 0) return -1;
+    // The shard's existing values stay where they are in its blob file, so the new data file refers to the same one
+    load -> generation = blobGeneration(db -> data[shard]);
+    load -> data = fopen(shardPath(path, TEMP_DATA_PATH, shard), "w");
+    load -> index = fopen(shardPath(path, TEMP_INDEX_PATH, shard), "w+");
+    if (load -> data == NULL || load -> index == NULL ||
+        beginSorted(&(load -> writer), load -> data, load -> generation) != 0 ||
+        createIndex(load -> index, &(load -> header), shard) != 0 || beginBuild(&(load -> builder), load -> index, &(load -> header)) != 0){
+        perror("Error opening temp files for load\n");
+        return -1;
+    }
+    advanceExisting(load);
+    return 0;
+}
+
+/**
+ * @brief   Adds an entry to the end of a shard being rewritten
+ * @param[in,out]   load    Rewrite of the shard
+ * @param[in]   key     Key, which must come after every key added so far
+ * @param[in]   value   Value, unless it is in the shard's blob file
+ * @param[in]   blob    Offset of the value in the shard's blob file, or NO_BLOB
+ * @param[in]   kv      Sizes and timestamps of the entry
+*/
+static int addLoaded(ShardLoad* load, const char* key, const char* value, uint64_t blob, Pair* kv){
+    long int offset = writeSorted(&(load -> writer), key, value, blob, kv);
+    if (offset == -1) return -1;
+    if (blob != NO_BLOB) load -> liveBlob += kv -> valueSize - 1;
+    return buildIndexLine(&(load -> builder), 0, key, kv -> keySize - 1, offset);
+}
+
+/**
+ * @brief   Copies the shard's existing keys that come before a key into its rewrite. If the key itself is in the shard,
+ *          it is skipped, as the loaded entry replaces it.
+ * @param[in,out]   load    Rewrite of the shard
+ * @param[in]   key     Key about to be loaded, or NULL to copy every remaining key
+ * @param[out]  firstSet    If the key is in the shard, set to the time it was first set
+ * @return  Returns 1 if the key was in the shard, 0 if not, -1 on failure
+*/
+static int copyExisting(ShardLoad* load, char* key, time_t* firstSet){
+    while (load -> existingValid){
+        int order = key == NULL ? -1 : strcmp(load -> view.key, key);
+        if (order > 0) return 0;
+        if (order == 0){
+            *firstSet = load -> view.kv.firstSet;
+            advanceExisting(load);
+            return 1;
+        }
+        if (addLoaded(load, load -> view.key, load -> view.value, load -> view.blob, &(load -> view.kv)) != 0) return -1;
+        advanceExisting(load);
+    }
+    return 0;
+}
+
+/**
+ * @brief   Adds an entry from the merged runs to a shard being rewritten, copying its value from the load's blob file to
+ *          the shard's if it is too long to be stored inline
+ * @param[in,out]   load    Rewrite of the shard
+ * @param[in]   run     Run holding the entry
+ * @param[in]   blob    File descriptor of the load's blob file
+*/
+static int addMerged(ShardLoad* load, LoadRun* run, int blob){
+    uint64_t blobOffset = NO_BLOB;
+    if (run -> blob != NO_BLOB){
+        if (load -> blob == -1) load -> blob = openBlob(load -> shard, load -> generation, 1);
+        long int offset = load -> blob == -1 ? -1 : copyBlob(blob, run -> blob, run -> kv.valueSize - 1, load -> blob);
+        if (offset == -1) return -1;
+        blobOffset = offset;
+        addStat(STAT_REWRITE_BYTES, run -> kv.valueSize - 1);
+    }
+    addStat(STAT_USER_BYTES, run -> kv.keySize - 1 + run -> kv.valueSize - 1);
+    return addLoaded(load, run -> key, run -> value, blobOffset, &(run -> kv));
+}
+
+/**
+ * @brief   Finishes rewriting a shard, copying the rest of its existing keys and writing out the index. Values in the
+ *          blob file that are no longer referred to are counted as dead, so compaction reclaims them
+ * @param[in,out]   load    Rewrite of the shard. Its temp files are left open, to be renamed by replaceShard
+*/
+static int endShardLoad(ShardLoad* load){
+    int result = copyExisting(load, NULL, NULL);
+    if (endBuild(&(load -> builder)) != 0) result = -1;
+    load -> header.indexedSize = load -> writer.size;
+    addStat(STAT_REWRITE_BYTES, load -> writer.size);
+    load -> header.deadBytes = blobSize(load -> shard, load -> generation) - load -> liveBlob;
+    // Values copied to the blob file must be synced before the data file referring to them replaces the old one
+    if (result == 0 && load -> blob != -1 && fdatasync(load -> blob) != 0){
+        perror("Error syncing blob file\n");
+        result = -1;
+    }
+    if (result == 0) result = writeIndexHeader(load -> index, &(load -> header));
+    return result;
+}
+
+/**
+ * @brief   Loads key value pairs from a file into the database, replacing the value of any key already there. The input
+ *          is sorted first, then every shard is rewritten in one pass with its writers and readers locked out, and the
+ *          new files replace the old ones once every shard has been written. A failure before then leaves the
+ *          database as it was, but one while the files are being replaced leaves the load partly applied, as reported.
+ * @param[in]   db      Open database
+ * @param[in]   input   File to be loaded. Each line holds a key, a space and a value running to the end of the line
+ * @param[in]   out     Stream the number of keys loaded is printed to
+ * @return  Returns the number of lines loaded, or -1 on failure
+*/
+long int load(Database* db, FILE* input, FILE* out){
+    FILE* files[LOAD_MERGE_WAYS];
+    LoadRun merge[LOAD_MERGE_WAYS];
+    ShardLoad* loads = calloc(db -> shards, sizeof(ShardLoad));
+    char path[PATH_SIZE];
+    int count, result = 0, started = 0;
+    time_t now = time(NULL);
+    uint64_t start = statsClock();
+    // Like the runs, the load's blob file is unlinked straight away, so it is removed once closed
+    int blob = open(LOAD_BLOB_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (blob == -1){
+        perror("Error creating " LOAD_BLOB_PATH "\n");
+        free(loads);
+        return -1;
+    }
+    unlink(LOAD_BLOB_PATH);
+    long int loaded = sortInput(input, files, &count, now, blob);
+    if (loads == NULL || loaded == -1){
+        if (loaded != -1) for (int i = 0; i < count; i++) fclose(files[i]);
+        free(loads);
+        close(blob);
+        return -1;
+    }
+
+    // Every shard is locked, in order, as scans do, for the whole pass
+    for (int shard = 0; shard < db -> shards; shard++){
+        lockRange(shard, LOCK_COMMIT, F_WRLCK);
+        lockRange(shard, LOCK_DATA, F_WRLCK);
+    }
+    for (; started < db -> shards && result == 0; started++) result = beginShardLoad(&loads[started], db, started);
+    beginMerge(merge, files, count);
+    int next;
+    while (result == 0 && (next = nextMerged(merge, count)) != -1){
+        LoadRun* run = &merge[next];
+        ShardLoad* shardLoad = &loads[shardOf(db, run -> key)];
+        // A key already in the database keeps the time it was first set, as with set
+        int exists = copyExisting(shardLoad, run -> key, &(run -> kv.firstSet));
+        if (exists == -1 || addMerged(shardLoad, run, blob) != 0) result = -1;
+        shardLoad -> count += exists == 0;
+        advanceRun(run);
+    }
+    endMerge(merge, count);
+    close(blob);
+    for (int shard = 0; shard < db -> shards && result == 0; shard++) result = endShardLoad(&loads[shard]);
+
+    // Only replace the shards once they have all been written, so a failure while reading or writing them leaves the
+    // database as it was. Each shard is replaced by its own renames, so if replacing one fails, the shards before it
+    // keep the loaded data and the rest are left as they were
+    int replaced = 0;
+    for (int shard = 0; shard < started; shard++){
+        ShardLoad* shardLoad = &loads[shard];
+        // As for compaction, the old index is marked dirty first, unless it is too damaged to be trusted anyway
+        IndexHeader header;
+        if (result == 0 && readIndexHeader(db -> index[shard], &header) == 0 && markIndexDirty(db -> index[shard]) != 0)
+            result = -1;
+        if (result == 0 && replaceShard(db -> data[shard], db -> index[shard], shardLoad -> data, shardLoad -> index,
+            shard) != 0){
+            fprintf(stderr, "Error replacing the files of shard %d\n", shard);
+            result = -1;
+            continue;
+        }
+        if (result == 0){
+            replaced++;
+            continue;
+        }
+        if (shardLoad -> builder.pages != NULL) endBuild(&(shardLoad -> builder));
+        if (shardLoad -> data != NULL) fclose(shardLoad -> data);
+        if (shardLoad -> index != NULL) fclose(shardLoad -> index);
+        remove(shardPath(path, TEMP_DATA_PATH, shard));
+        remove(shardPath(path, TEMP_INDEX_PATH, shard));
+    }
+    for (int shard = db -> shards - 1; shard >= 0; shard--){
+        lockRange(shard, LOCK_DATA, F_UNLCK);
+        lockRange(shard, LOCK_COMMIT, F_UNLCK);
+    }
+    long int added = 0;
+    for (int shard = 0; shard < db -> shards; shard++) added += loads[shard].count;
+    free(loads);
+    if (result != 0 && replaced > 0)
+        fprintf(stderr, "Error loading file. It was only partly applied: shards 0 to %d hold the loaded data, the rest "
+            "are as they were\n", replaced - 1);
+    else if (result != 0) fprintf(stderr, "Error loading file. The database is as it was\n");
+    if (result != 0) return -1;
+    fprintf(out, "Loaded %ld lines, %ld new keys\n", loaded, added);
+    recordOp(STAT_LOAD, start);
+    return loaded;
+}
@@ -0,0 +1,42 @@
+#ifndef LOAD_H_
+#define LOAD_H_
+#include <stdio.h>
+#include "map.h"
+#include "index.h"
+#include "record.h"
+
+/**
+ * @brief One sorted run being merged, holding its next entry
+*/
+typedef struct load_run{
+    FILE* file;
+    Pair kv;
+    char* key;
+    char* value;
+    uint64_t blob;          // Offset of the value in the load's blob file, or NO_BLOB if it is in value
+    int valid;              // Whether the entry holds the next entry of the run, 0 once the run is finished
+} LoadRun;
+
+/**
+ * @brief   Rewrite of one shard during a load. The shard's existing keys are read in order through its index and
+ *          merged with the keys loaded into it, and both are written to the shard's temp files
+*/
+typedef struct shard_load{
+    int shard;
+    FILE* data;             // Temp data file
+    FILE* index;            // Temp index file
+    IndexHeader header;
+    IndexBuilder builder;
+    SortedWriter writer;    // Writes the temp data file
+    long int count;         // Number of loaded keys that were not in the shard
+    uint32_t generation;    // Generation of the shard's blob file, which the rewrite keeps
+    int blob;               // File descriptor of the shard's blob file, -1 until a value is copied to it
+    uint64_t liveBlob;      // Bytes of the blob file held by values written to the rewrite
+    MappedFile* existingData;
+    IndexCursor existing;   // Next of the shard's existing keys
+    PairView view;          // Entry of the next existing key
+    int existingValid;      // Whether view holds an entry
+} ShardLoad;
+
+long int load(Database* db, FILE* input, FILE* out);
+#endif
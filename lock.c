@@ -0,0 +1,345 @@
+/**
+ * @brief   Function definitions for sharing the database between concurrent processes. kvdb.lock holds three
+ *          fcntl byte range locks for each shard, so processes using different shards never wait for each other:
+ *              -   LOCK_DATA: Held shared by readers, so any number can read at once, and exclusively while writes are
+ *                  applied. Readers therefore always see the shard's data and index files in a consistent state.
+ *              -   LOCK_COMMIT: Held by the writer currently committing a batch.
+ *              -   LOCK_QUEUE: Held briefly while the shard's queue is modified.
+ *          Writers don't apply their own writes. Each appends its write to its shard's queue, e.g. kvdb.0.queue, and
+ *          waits for LOCK_COMMIT. The first to get it becomes the leader, and applies every write in the queue as one
+ *          group commit with a single flush, and at most one sync as set by the sync policy (see wal.c). Writers queued
+ *          behind it usually find their write already committed when they get the lock, so under contention many writes
+ *          share each commit instead of each paying for its own.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "definitions.h"
+#include "index.h"
+#include "set.h"
+#include "shard.h"
+#include "lock.h"
+#include "wal.h"
+#include "stats.h"
+
+// File descriptor of kvdb.lock, opened by openLock
+static int lockFd = -1;
+// Set once the process has opened a snapshot rather than the live database, see snapshot.c. A snapshot's files are
+// never written, so reads take no locks
+static int snapshotReads = 0;
+
+/**
+ * @brief Small function to stop beginRead and endRead taking locks, once a snapshot has been opened
+*/
+void useSnapshotReads(void){
+    snapshotReads = 1;
+}
+
+/**
+ * @brief   Opens kvdb.lock, creating it if needed. Must be called before any other function in this file.
+ * @return  Returns 0 on success, -1 on failure
+*/
+int openLock(void){
+    lockFd = open(LOCK_PATH, O_RDWR | O_CREAT, 0644);
+    if (lockFd == -1){
+        perror("Error opening " LOCK_PATH "\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Takes, or releases, one of a shard's locks in kvdb.lock, waiting until it is available
+ * @param[in]   shard   Number of the shard
+ * @param[in]   lock    Which lock, one of LOCK_DATA, LOCK_COMMIT or LOCK_QUEUE
+ * @param[in]   type    F_RDLCK for shared, F_WRLCK for exclusive or F_UNLCK to release
+*/
+int lockRange(int shard, int lock, short type){
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = shard*LOCKS_PER_SHARD + lock;
+    fl.l_len = 1;
+    while (fcntl(lockFd, F_SETLKW, &fl) == -1){
+        if (errno == EINTR) continue;
+        perror("Error locking " LOCK_PATH "\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Brings an open database file up to date with changes made by other processes. If the file has been renamed
+ *          over (e.g. by compaction in another process), the stream is reopened on the new file. Otherwise any data
+ *          buffered by the stream is discarded, as it may be stale.
+ * @param[in]   file    Stream to be refreshed
+ * @param[in]   path    Path the stream was opened from
+ * @param[in]   mode    Mode the stream was opened with
+*/
+int refreshFile(FILE* file, char* path, char* mode){
+    struct stat opened, current;
+    if (fstat(fileno(file), &opened) == 0 && stat(path, &current) == 0 &&
+        (opened.st_dev != current.st_dev || opened.st_ino != current.st_ino)){
+        if (freopen(path, mode, file) == NULL){
+            perror("Error reopening database file\n");
+            return -1;
+        }
+        return 0;
+    }
+    return fflush(file);
+}
+
+/**
+ * @brief Small function to check whether the index is missing, behind data.bin or must be rebuilt, and needs loading
+*/
+int indexNeedsLoad(FILE* data, FILE* index){
+    IndexHeader header;
+    if (readIndexHeader(index, &header) != 0) return 1;
+    fseek(data, 0, SEEK_END);
+    return ftell(data) > (long int)header.indexedSize || indexNeedsRebuild(&header, ftell(data));
+}
+
+/**
+ * @brief Small function to bring both of a shard's files up to date, used after taking a lock
+*/
+int refreshFiles(FILE* data, FILE* index, int shard){
+    char path[PATH_SIZE];
+    if (refreshFile(data, shardPath(path, DATA_PATH, shard), "a+") != 0) return -1;
+    return refreshFile(index, shardPath(path, INDEX_PATH, shard), "r+");
+}
+
+/**
+ * @brief   Starts a read. Waits for any commit in progress to finish, then holds LOCK_DATA shared until endRead, so
+ *          the files can't change during the read while other readers carry on in parallel. If the index needs
+ *          loading, e.g. after a crash, this is done first with the write locks held. Reads of a snapshot do
+ *          nothing here, as its files never change.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @param[in]   shard   Number of the shard the files belong to
+*/
+int beginRead(FILE* data, FILE* index, int shard){
+    if (snapshotReads) return 0;
+    for (;;){
+        if (lockRange(shard, LOCK_DATA, F_RDLCK) != 0) return -1;
+        if (refreshFiles(data, index, shard) != 0) return -1;
+        if (indexNeedsLoad(data, index) == 0) return 0;
+        // Loading writes to the index, so drop the shared lock and take the same locks a commit does
+        lockRange(shard, LOCK_DATA, F_UNLCK);
+        lockRange(shard, LOCK_COMMIT, F_WRLCK);
+        lockRange(shard, LOCK_DATA, F_WRLCK);
+        int result = refreshFiles(data, index, shard) == 0 ? loadIndex(data, index, shard) : -1;
+        lockRange(shard, LOCK_DATA, F_UNLCK);
+        lockRange(shard, LOCK_COMMIT, F_UNLCK);
+        if (result != 0){
+            fprintf(stderr, "Error loading index of shard %d\n", shard);
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Ends a read of a shard started by beginRead
+*/
+int endRead(int shard){
+    if (snapshotReads) return 0;
+    return lockRange(shard, LOCK_DATA, F_UNLCK);
+}
+
+/**
+ * @brief   Reads the queue header, initialising the queue if it is empty. LOCK_QUEUE must be held.
+ * @param[in]   queue   File descriptor of the shard's queue
+ * @param[out]  header  On return, holds the header
+*/
+int readQueueHeader(int queue, QueueHeader* header){
+    if (pread(queue, header, sizeof(QueueHeader), 0) == sizeof(QueueHeader)) return 0;
+    memset(header, 0, sizeof(QueueHeader));
+    header -> commitOffset = sizeof(QueueHeader);
+    return pwrite(queue, header, sizeof(QueueHeader), 0) == sizeof(QueueHeader) ? 0 : -1;
+}
+
+/**
+ * @brief   Marks a writer's result as read. Once every queued write is committed, and its result has been read or the
+ *          queue has grown past QUEUE_MAX_SIZE, the queue is emptied. LOCK_QUEUE must be held.
+ * @param[in]   queue   File descriptor of the shard's queue
+ * @param[in,out]   header  Header of the queue, written back on return
+*/
+int consumeResult(int queue, QueueHeader* header){
+    struct stat st;
+    if (header -> pending > 0) header -> pending--;
+    if (fstat(queue, &st) == 0 && header -> commitOffset == (uint64_t)st.st_size &&
+        (header -> pending == 0 || st.st_size > QUEUE_MAX_SIZE)){
+        // Writers whose results are dropped here find a different sequence number at their offset, see commitWrite
+        if (ftruncate(queue, sizeof(QueueHeader)) == 0) header -> commitOffset = sizeof(QueueHeader);
+    }
+    return pwrite(queue, header, sizeof(QueueHeader), 0) == sizeof(QueueHeader) ? 0 : -1;
+}
+
+/**
+ * @brief   Applies every uncommitted write in the queue as one batch, with a single sync. LOCK_COMMIT must be held.
+ * @param[in]   queue   File descriptor of the shard's queue
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @param[in]   shard   Number of the shard the files belong to
+ * @return  Returns 0 on success, -1 if the batch couldn't be applied or synced
+*/
+int commitQueue(int queue, FILE* data, FILE* index, int shard){
+    QueueHeader header;
+    struct stat st;
+    uint64_t began = statsClock();
+    // Take the queued writes. Writes queued after this go in the next batch
+    lockRange(shard, LOCK_QUEUE, F_WRLCK);
+    readQueueHeader(queue, &header);
+    fstat(queue, &st);
+    size_t start = header.commitOffset;
+    size_t length = st.st_size - start;
+    char* batch = malloc(length);
+    if (batch == NULL || pread(queue, batch, length, start) != (ssize_t)length){
+        lockRange(shard, LOCK_QUEUE, F_UNLCK);
+        free(batch);
+        fprintf(stderr, "Error reading queue of shard %d\n", shard);
+        return -1;
+    }
+    lockRange(shard, LOCK_QUEUE, F_UNLCK);
+
+    // Apply them with readers locked out
+    lockRange(shard, LOCK_DATA, F_WRLCK);
+    int result = refreshFiles(data, index, shard);
+    if (result == 0 && indexNeedsLoad(data, index)) result = loadIndex(data, index, shard);
+    // A crash while the batch is applied leaves the index dirty, so it is rebuilt from data.bin
+    if (result == 0) result = markIndexDirty(index);
+    uint64_t lastSeq = header.committedSeq;
+    uint64_t records = 0;
+    size_t pos = 0;
+    while (result == 0 && pos + sizeof(QueueRecord) <= length){
+        // Records follow keys and values of any length, so may not be aligned
+        QueueRecord record;
+        memcpy(&record, batch + pos, sizeof(QueueRecord));
+        char* key = batch + pos + sizeof(QueueRecord);
+        char* value = key + record.entry.keySize;
+        size_t keySize = record.entry.keySize, valueSize = record.entry.valueSize;
+        record.result = set(data, index, key, value, &(record.entry), record.mode);
+        memcpy(batch + pos, &record, sizeof(QueueRecord));
+        lastSeq = record.seq;
+        records++;
+        pos += sizeof(QueueRecord) + keySize + valueSize;
+    }
+    // One sync, if the sync policy calls for one, covers every write in the batch
+    int applied = result == 0;
+    if (applied) result = syncLog(data, index, records, 0);
+    lockRange(shard, LOCK_DATA, F_UNLCK);
+
+    // Publish the results. An applied batch must not be applied again, so if it couldn't be synced it is still taken
+    // off the queue, with every write in it reported as failed
+    for (pos = 0; applied && result != 0 && pos + sizeof(QueueRecord) <= length;){
+        QueueRecord record;
+        memcpy(&record, batch + pos, sizeof(QueueRecord));
+        record.result = -1;
+        memcpy(batch + pos, &record, sizeof(QueueRecord));
+        pos += sizeof(QueueRecord) + record.entry.keySize + record.entry.valueSize;
+    }
+    if (applied){
+        lockRange(shard, LOCK_QUEUE, F_WRLCK);
+        pwrite(queue, batch, length, start);
+        readQueueHeader(queue, &header);
+        header.committedSeq = lastSeq;
+        header.commitOffset = start + length;
+        pwrite(queue, &header, sizeof(QueueHeader), 0);
+        lockRange(shard, LOCK_QUEUE, F_UNLCK);
+    }
+    free(batch);
+    recordOp(STAT_COMMIT, began);
+    return result;
+}
+
+/**
+ * @brief   Syncs any writes committed to a shard that the sync policy has not synced yet, e.g. so a server can sync
+ *          every N milliseconds while no writes are arriving
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @param[in]   shard   Number of the shard the files belong to
+*/
+int syncShard(FILE* data, FILE* index, int shard){
+    lockRange(shard, LOCK_COMMIT, F_WRLCK);
+    lockRange(shard, LOCK_DATA, F_WRLCK);
+    int result = refreshFiles(data, index, shard);
+    if (result == 0 && indexNeedsLoad(data, index) == 0) result = syncLog(data, index, 0, 1);
+    lockRange(shard, LOCK_DATA, F_UNLCK);
+    lockRange(shard, LOCK_COMMIT, F_UNLCK);
+    return result;
+}
+
+/**
+ * @brief   Function to set, update or delete a key when other processes may be using the database. The write is
+ *          queued, then committed either by this process or by another writer's group commit.
+ * @param[in]   data    Pointer to file containing data
+ * @param[in]   index   Pointer to file containing index
+ * @param[in]   shard   Number of the shard the key belongs to
+ * @param[in]   key     String containing key to be added/updated/deleted
+ * @param[in]   value   If key to be added/updated, contains corresponding value. If key is to be deleted, contains "null"
+ * @param[in]   entry   Holds other relevant variables; key size, value size and times key was first and last set
+ * @param[in]   mode    Determines if key is to be added/updated (mode = 0) or deleted (mode = 1)
+ * @return  Returns the result of set once the write is committed, or -1 on failure
+*/
+int commitWrite(FILE* data, FILE* index, int shard, char* key, char* value, Pair* entry, int mode){
+    char path[PATH_SIZE];
+    int queue = open(shardPath(path, QUEUE_PATH, shard), O_RDWR | O_CREAT, 0644);
+    if (queue == -1){
+        perror("Error opening write queue\n");
+        return -1;
+    }
+    // Deletes carry no value, and keySize is filled in by set
+    QueueRecord record;
+    memset(&record, 0, sizeof(record));
+    record.mode = mode;
+    record.entry = *entry;
+    record.entry.keySize = strlen(key) + 1;
+    record.entry.valueSize = mode == 1 ? 0 : entry -> valueSize;
+
+    // Queue the write
+    QueueHeader header;
+    lockRange(shard, LOCK_QUEUE, F_WRLCK);
+    readQueueHeader(queue, &header);
+    record.seq = ++header.lastSeq;
+    off_t offset = lseek(queue, 0, SEEK_END);
+    int queued = pwrite(queue, &record, sizeof(record), offset) == sizeof(record) &&
+        pwrite(queue, key, record.entry.keySize, offset + sizeof(record)) == (ssize_t)record.entry.keySize &&
+        pwrite(queue, value, record.entry.valueSize, offset + sizeof(record) + record.entry.keySize) ==
+            (ssize_t)record.entry.valueSize;
+    if (queued){
+        header.pending++;
+        pwrite(queue, &header, sizeof(header), 0);
+    }
+    else ftruncate(queue, offset);
+    lockRange(shard, LOCK_QUEUE, F_UNLCK);
+    if (!queued){
+        perror("Error writing to write queue\n");
+        close(queue);
+        return -1;
+    }
+
+    // Wait for the current commit to finish. If it didn't include this write, lead the next one
+    lockRange(shard, LOCK_COMMIT, F_WRLCK);
+    lockRange(shard, LOCK_QUEUE, F_WRLCK);
+    readQueueHeader(queue, &header);
+    lockRange(shard, LOCK_QUEUE, F_UNLCK);
+    int result = 0;
+    if (header.committedSeq < record.seq) result = commitQueue(queue, data, index, shard);
+    lockRange(shard, LOCK_COMMIT, F_UNLCK);
+
+    // Collect the result. If the queue has been emptied since, the write was still committed
+    QueueRecord committed;
+    lockRange(shard, LOCK_QUEUE, F_WRLCK);
+    readQueueHeader(queue, &header);
+    if (result == 0 && pread(queue, &committed, sizeof(committed), offset) == sizeof(committed) &&
+        committed.seq == record.seq)
+        result = committed.result;
+    consumeResult(queue, &header);
+    lockRange(shard, LOCK_QUEUE, F_UNLCK);
+    close(queue);
+    return result;
+}
@@ -0,0 +1,47 @@
+#ifndef LOCK_H_
+#define LOCK_H_
+#include <stdio.h>
+#include <stdint.h>
+
+// Byte offsets of a shard's locks in kvdb.lock, relative to the shard's first lock
+#define LOCK_DATA 0
+#define LOCK_COMMIT 1
+#define LOCK_QUEUE 2
+#define LOCKS_PER_SHARD 3
+// Size a queue may grow to before it is emptied without waiting for every writer to read its result
+#define QUEUE_MAX_SIZE (1 << 20)
+
+/**
+ * @brief Header at the start of a shard's queue
+*/
+typedef struct queue_header{
+    uint64_t lastSeq;       // Sequence number of the last write queued
+    uint64_t committedSeq;  // Sequence number of the last write committed
+    uint64_t commitOffset;  // File offset of the first write not yet committed
+    uint64_t pending;       // Number of queued writes whose results have not been read yet
+} QueueHeader;
+
+/**
+ * @brief A queued write, followed in the queue by its key and value
+*/
+typedef struct queue_record{
+    uint64_t seq;
+    int32_t mode;           // As for set, 0 to set and 1 to delete
+    int32_t result;         // Return value of set, filled in when the write is committed
+    Pair entry;
+} QueueRecord;
+
+int openLock(void);
+void useSnapshotReads(void);
+int lockRange(int shard, int lock, short type);
+int refreshFile(FILE* file, char* path, char* mode);
+int indexNeedsLoad(FILE* data, FILE* index);
+int refreshFiles(FILE* data, FILE* index, int shard);
+int beginRead(FILE* data, FILE* index, int shard);
+int endRead(int shard);
+int readQueueHeader(int queue, QueueHeader* header);
+int consumeResult(int queue, QueueHeader* header);
+int commitQueue(int queue, FILE* data, FILE* index, int shard);
+int syncShard(FILE* data, FILE* index, int shard);
+int commitWrite(FILE* data, FILE* index, int shard, char* key, char* value, Pair* entry, int mode);
+#endif
@@ -0,0 +1,72 @@
+/**
+ * @brief   Function definitions for memory mapping the database files, so the read path can look at entries in place
+ *          instead of copying them through stdio and malloc'd buffers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "map.h"
+
+// Mappings kept between calls so a long running process only remaps when files change, indexed by file descriptor
+static MappedFile maps[MAX_MAPPED_FILES];
+
+/**
+ * @brief Small function to remove a mapping, leaving the MappedFile empty
+ * @param[in,out]   map     Mapping to be removed
+*/
+void unmapFile(MappedFile* map){
+    if (map -> base != NULL) munmap(map -> base, map -> length);
+    memset(map, 0, sizeof(MappedFile));
+}
+
+/**
+ * @brief   Makes sure a mapping covers the whole of a file in its current state. The file is remapped if it has been
+ *          replaced since it was mapped (e.g. renamed over by compaction) or has grown past the end of the mapping.
+ *          Mappings are made with room to spare, so a file that is appended to is not remapped on every write; only
+ *          the first map -> size bytes may be read.
+ * @param[in]   file    Open file to be mapped. Anything written through the stream must be flushed first
+ * @param[in,out]   map     Mapping of the file, which may be empty on entry
+ * @return  Returns 0 on success, -1 on failure
+*/
+int refreshMap(FILE* file, MappedFile* map){
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0){
+        perror("Error reading file size\n");
+        return -1;
+    }
+    if (map -> base != NULL && (map -> dev != st.st_dev || map -> ino != st.st_ino || (size_t)st.st_size > map -> length))
+        unmapFile(map);
+    map -> size = st.st_size;
+    map -> dev = st.st_dev;
+    map -> ino = st.st_ino;
+    if (map -> base != NULL || st.st_size == 0) return 0;
+
+    // Leave room for the file to double in size before it needs remapping
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = ((size_t)st.st_size*2 + MAP_MIN_SPARE + page - 1) / page * page;
+    void* base = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (base == MAP_FAILED){
+        perror("Error mapping file\n");
+        return -1;
+    }
+    map -> base = base;
+    map -> length = length;
+    return 0;
+}
+
+/**
+ * @brief   Gets an up to date mapping of an open file, reusing the mapping made by a previous call where possible.
+ * @param[in]   file    Open file to be mapped
+ * @return  Returns the mapping, or NULL on failure. Only valid until the next call for the same file
+*/
+MappedFile* mapFile(FILE* file){
+    int fd = fileno(file);
+    if (fd < 0 || fd >= MAX_MAPPED_FILES){
+        fprintf(stderr, "Too many open files to map\n");
+        return NULL;
+    }
+    return refreshMap(file, &maps[fd]) == 0 ? &maps[fd] : NULL;
+}
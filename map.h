@@ -0,0 +1,25 @@
+#ifndef MAP_H_
+#define MAP_H_
+#include <stdio.h>
+#include <sys/types.h>
+
+// Spare bytes mapped past the end of a file, so appends don't force a remap
+#define MAP_MIN_SPARE (1 << 20)
+// Highest file descriptor that can be mapped by mapFile
+#define MAX_MAPPED_FILES 1024
+
+/**
+ * @brief Read only mapping of a database file
+*/
+typedef struct mapped_file{
+    char* base;     // Start of the mapping, NULL if nothing is mapped
+    size_t length;  // Length of the mapping, which may extend past the end of the file
+    size_t size;    // Size of the file when the mapping was last refreshed
+    dev_t dev;      // Identity of the mapped file, to detect it being replaced
+    ino_t ino;
+} MappedFile;
+
+void unmapFile(MappedFile* map);
+int refreshMap(FILE* file, MappedFile* map);
+MappedFile* mapFile(FILE* file);
+#endif
@@ -0,0 +1,230 @@
+/**
+ * @brief   Function definitions for getting many keys at once. Every key is looked up in its shard's index first, then
+ *          the lookups are sorted by shard and file offset and the entries read in that order, so each data file is read
+ *          in one forward sweep rather than at the random offsets the keys happen to be at. With KVDB_READAHEAD set to
+ *          1, the kernel is also told up front which parts of each data file the sweep will read, so pages not in the
+ *          page cache are read in ahead of it, many at once, rather than one fault at a time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "definitions.h"
+#include "index.h"
+#include "get.h"
+#include "lock.h"
+#include "shard.h"
+#include "record.h"
+#include "mget.h"
+#include "stats.h"
+
+/**
+ * @brief   Comparison function for qsort. Orders lookups by shard, then by file offset, with keys the index doesn't hold
+ *          first
+*/
+static int compareLookup(const void* a, const void* b){
+    const KeyLookup* x = *(KeyLookup* const*)a;
+    const KeyLookup* y = *(KeyLookup* const*)b;
+    if (x -> shard != y -> shard) return x -> shard - y -> shard;
+    return (x -> offset > y -> offset) - (x -> offset < y -> offset);
+}
+
+/**
+ * @brief   Advises the kernel to read the pages holding a run of entries, sorted by offset, from the mapping of their
+ *          data file. Entries closer together than MGET_READAHEAD_GAP are covered by one range, so the pages between
+ *          them are read too, but the kernel is asked once per range rather than once per entry
+ * @param[in]   data    Mapping of the data file
+ * @param[in]   order   Lookups of the entries, sorted by offset, all in the data file
+ * @param[in]   count   Number of lookups
+*/
+static void readAhead(MappedFile* data, KeyLookup** order, size_t count){
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = 0, end = 0;
+    for (size_t i = 0; i <= count; i++){
+        if (i < count && (order[i] -> offset == -1 || (size_t)order[i] -> offset >= data -> size)) continue;
+        size_t offset = i < count ? (size_t)order[i] -> offset : SIZE_MAX;
+        if (end > start && (i == count || offset > end + MGET_READAHEAD_GAP)){
+            madvise(data -> base + start, end - start, MADV_WILLNEED);
+            end = start;
+        }
+        if (i == count) break;
+        // An entry's size isn't known until it is read, so assume the largest
+        size_t entryEnd = offset + MAX_RECORD_SIZE < data -> size ? offset + MAX_RECORD_SIZE : data -> size;
+        if (end == start) start = offset / page * page;
+        end = (entryEnd + page - 1) / page * page;
+    }
+}
+
+/**
+ * @brief   Looks up many keys at once. A shared lock is taken on every shard holding one of the keys, in order, and held
+ *          until endMultiGet, so the entries stay valid until then. Keys may be given in any order and more than once.
+ * @param[out]  mg      Multi-get to be initialised. mg -> lookups holds the result for each key, in the order given
+ * @param[in]   db      Open database
+ * @param[in]   keys    Null terminated keys, which must stay valid until endMultiGet
+ * @param[in]   count   Number of keys
+ * @return  Returns the number of keys found, or -1 on failure, in which case mg must not be used
+*/
+int beginMultiGet(MultiGet* mg, Database* db, char** keys, size_t count){
+    MappedFile* dataMaps[MAX_SHARDS];
+    MappedFile* indexMaps[MAX_SHARDS];
+    int needed[MAX_SHARDS] = {0};
+    char* env = getenv("KVDB_READAHEAD");
+    int readahead = env != NULL && strcmp(env, "1") == 0;
+    memset(mg, 0, sizeof(MultiGet));
+    mg -> db = db;
+    mg -> count = count;
+    mg -> lookups = calloc(count + 1, sizeof(KeyLookup));
+    KeyLookup** order = malloc((count + 1)*sizeof(KeyLookup*));
+    if (mg -> lookups == NULL || order == NULL){
+        fprintf(stderr, "Error allocating lookups for %lu keys\n", (unsigned long)count);
+        free(order);
+        endMultiGet(mg);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++){
+        mg -> lookups[i].key = keys[i];
+        mg -> lookups[i].shard = shardOf(db, keys[i]);
+        mg -> lookups[i].offset = -1;
+        needed[mg -> lookups[i].shard] = 1;
+        order[i] = &mg -> lookups[i];
+    }
+    // Shards are locked in order, as scans do, so two processes never wait for each other's locks
+    for (int shard = 0; shard < db -> shards; shard++){
+        if (!needed[shard]) continue;
+        if (beginRead(db -> data[shard], db -> index[shard], shard) != 0){
+            free(order);
+            endMultiGet(mg);
+            return -1;
+        }
+        mg -> locked[shard] = 1;
+        dataMaps[shard] = mapFile(db -> data[shard]);
+        indexMaps[shard] = mapFile(db -> index[shard]);
+        if (dataMaps[shard] == NULL || indexMaps[shard] == NULL){
+            fprintf(stderr, "Error reading files of shard %d\n", shard);
+            free(order);
+            endMultiGet(mg);
+            return -1;
+        }
+    }
+    // Find every key's entry before reading any of them
+    for (size_t i = 0; i < count; i++){
+        KeyLookup* lookup = &mg -> lookups[i];
+        lookup -> offset = viewDataIndex(indexMaps[lookup -> shard], lookup -> key);
+    }
+    qsort(order, count, sizeof(KeyLookup*), compareLookup);
+    if (readahead){
+        for (size_t from = 0, to; from < count; from = to){
+            for (to = from; to < count && order[to] -> shard == order[from] -> shard; to++);
+            readAhead(dataMaps[order[from] -> shard], order + from, to - from);
+        }
+    }
+    int found = 0;
+    for (size_t i = 0; i < count; i++){
+        KeyLookup* lookup = order[i];
+        if (lookup -> offset == -1) continue;
+        // Entries with no value are tombstones left by del
+        lookup -> found = viewPair(dataMaps[lookup -> shard], lookup -> offset, lookup -> key, strlen(lookup -> key),
+            &(lookup -> view)) == 1 && lookup -> view.kv.valueSize != 0;
+        found += lookup -> found;
+    }
+    free(order);
+    return found;
+}
+
+/**
+ * @brief Ends a multi-get started by beginMultiGet, releasing its locks and lookups
+*/
+void endMultiGet(MultiGet* mg){
+    for (int shard = 0; shard < MAX_SHARDS; shard++){
+        if (mg -> locked[shard]) endRead(shard);
+        mg -> locked[shard] = 0;
+    }
+    free(mg -> lookups);
+    mg -> lookups = NULL;
+    mg -> count = 0;
+}
+
+/**
+ * @brief   Prints the value of each of many keys, in the order the keys are given, in the same form as get. The entries
+ *          are read in file order, see beginMultiGet, so this reads each data file once rather than once per key
+ * @param[in]   db      Open database
+ * @param[in]   keys    Null terminated keys
+ * @param[in]   count   Number of keys
+ * @param[in]   out     Stream the values are printed to
+ * @return  Returns the number of keys found, or -1 on failure
+*/
+long int mget(Database* db, char** keys, size_t count, FILE* out){
+    MultiGet mg;
+    uint64_t start = statsClock();
+    int found = beginMultiGet(&mg, db, keys, count);
+    if (found == -1) return -1;
+    for (size_t i = 0; i < count; i++){
+        KeyLookup* lookup = &mg.lookups[i];
+        recordPrefix(lookup -> key, STAT_GET);
+        if (!lookup -> found){
+            fprintf(out, "Key not found\n");
+            continue;
+        }
+        fprintf(out, "Key: %s, value ", lookup -> key);
+        if (printValue(out, db -> data[lookup -> shard], lookup -> shard, &(lookup -> view)) != 0){
+            endMultiGet(&mg);
+            return -1;
+        }
+        fprintf(out, "\n");
+        addStat(STAT_BYTES_READ, lookup -> view.kv.valueSize - 1);
+    }
+    endMultiGet(&mg);
+    recordOp(STAT_MGET, start);
+    return found;
+}
+
+/**
+ * @brief   Reads keys separated by spaces or newlines, e.g. for ./kvdb mget -
+ * @param[in]   input   File to read from
+ * @param[out]  count   On return, holds the number of keys read
+ * @return  Returns a malloc'd array of malloc'd keys, to be freed with freeKeys, or NULL on failure
+*/
+char** readKeys(FILE* input, size_t* count){
+    size_t capacity = 64;
+    char** keys = malloc(capacity*sizeof(char*));
+    char key[MAX_KEY_SIZE];
+    size_t length = 0;
+    int c;
+    *count = 0;
+    if (keys == NULL) return NULL;
+    do{
+        c = getc(input);
+        if (c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r'){
+            if (length == MAX_KEY_SIZE - 1){
+                fprintf(stderr, "Entered key is too long. To adjust maximum key size, please edit #define in definitions.h\n");
+                freeKeys(keys, *count);
+                return NULL;
+            }
+            key[length++] = c;
+            continue;
+        }
+        if (length == 0) continue;
+        char** grown = *count < capacity ? keys : realloc(keys, 2*capacity*sizeof(char*));
+        key[length] = '\0';
+        if (grown == NULL || (grown[*count] = strdup(key)) == NULL){
+            fprintf(stderr, "Error allocating memory for keys\n");
+            freeKeys(grown == NULL ? keys : grown, *count);
+            return NULL;
+        }
+        if (grown != keys) capacity *= 2;
+        keys = grown;
+        (*count)++;
+        length = 0;
+    } while (c != EOF);
+    return keys;
+}
+
+/**
+ * @brief Small function to free the keys returned by readKeys
+*/
+void freeKeys(char** keys, size_t count){
+    for (size_t i = 0; i < count; i++) free(keys[i]);
+    free(keys);
+}
@@ -0,0 +1,32 @@
+#ifndef MGET_H_
+#define MGET_H_
+#include <stdio.h>
+
+/**
+ * @brief One key of a multi-get, and its entry once read
+*/
+typedef struct key_lookup{
+    char* key;
+    int shard;
+    long int offset;        // Offset of the key's latest entry in its shard's data file, or -1 if the index has none
+    int found;              // Whether view holds a live entry
+    PairView view;          // Entry of the key, pointing into the mapping of its data file
+} KeyLookup;
+
+/**
+ * @brief   Lookup of many keys at once. Every key is found in the index first, then the entries are read in file order,
+ *          so each data file is read in one forward sweep however the keys are ordered
+*/
+typedef struct multi_get{
+    Database* db;
+    KeyLookup* lookups;     // One for each key, in the order the keys were given
+    size_t count;
+    int locked[MAX_SHARDS]; // Whether a shared lock is held on each shard
+} MultiGet;
+
+int beginMultiGet(MultiGet* mg, Database* db, char** keys, size_t count);
+void endMultiGet(MultiGet* mg);
+long int mget(Database* db, char** keys, size_t count, FILE* out);
+char** readKeys(FILE* input, size_t* count);
+void freeKeys(char** keys, size_t count);
+#endif
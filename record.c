@@ -0,0 +1,297 @@
+/**
+ * @brief   Function definitions for the format entries are stored in in data.bin. Every data file starts with
+ *          DATA_MAGIC, the DATA_VERSION it was written in and the generation of the shard's blob file its entries refer
+ *          to (3 bytes, least significant first), followed by its entries, each laid out as:
+ *              -   A byte of flags, RECORD_TOMBSTONE for an entry left by del, RECORD_BLOB for an entry whose value is
+ *                  in the blob file
+ *              -   Varints: bytes of the key shared with the key before it, bytes of the key stored, bytes of the value
+ *                  (not stored for a tombstone), time last set, time last set minus time first set, and for
+ *                  RECORD_BLOB the offset of the value in the blob file
+ *              -   The rest of the key and the value, unless it is in the blob file, without null terminators
+ *              -   A CRC32 of the rest of the entry, least significant byte first
+ *          Varints hold 7 bits per byte, least significant first, with the top bit set on every byte but the last, so
+ *          the format is the same whatever the byte order or word size of the machine, and small numbers take one byte.
+ *          Entries appended by set store their key in full. Sorted files written by compaction share prefixes between
+ *          keys, see SortedWriter, and are read either in order or through the index, which holds every key in full.
+ *          Version 2 added RECORD_BLOB and the blob generation, so a version 1 file is read as it is.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "definitions.h"
+#include "record.h"
+#include "set.h"
+#include "shard.h"
+#include "wal.h"
+
+/**
+ * @brief Small function to get the number of bytes a varint takes up
+*/
+size_t varintSize(uint64_t value){
+    size_t size = 1;
+    while (value >= 0x80){
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+/**
+ * @brief   Writes a varint
+ * @param[out]  buf     Buffer of at least MAX_VARINT_SIZE bytes
+ * @param[in]   value   Number to be written
+ * @return  Returns the number of bytes written
+*/
+size_t putVarint(char* buf, uint64_t value){
+    size_t size = 0;
+    while (value >= 0x80){
+        buf[size++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[size++] = (char)value;
+    return size;
+}
+
+/**
+ * @brief   Reads a varint
+ * @param[in]   buf         Buffer holding the varint
+ * @param[in]   available   Bytes that may be read from buf
+ * @param[out]  value       On return, holds the number read
+ * @return  Returns the number of bytes read, or 0 if the varint runs past the end of the buffer or is too long
+*/
+size_t getVarint(const char* buf, size_t available, uint64_t* value){
+    *value = 0;
+    for (size_t i = 0; i < available && i < MAX_VARINT_SIZE; i++){
+        unsigned char byte = buf[i];
+        *value |= (uint64_t)(byte & 0x7f) << (7*i);
+        if ((byte & 0x80) == 0) return i + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Encodes an entry
+ * @param[out]  buf     Buffer of at least MAX_RECORD_SIZE bytes
+ * @param[in]   key     Null terminated key
+ * @param[in]   value   Value, kv -> valueSize - 1 bytes. Ignored for a tombstone or if the value is in the blob file
+ * @param[in]   blob    Offset of the value in the blob file, or NO_BLOB to store it inline
+ * @param[in]   kv      Sizes and timestamps of the entry. A valueSize of 0 marks a tombstone
+ * @param[in]   shared  Bytes at the start of the key shared with the key before it, which are not stored
+ * @return  Returns the number of bytes the entry takes up
+*/
+size_t encodeRecord(char* buf, const char* key, const char* value, uint64_t blob, Pair* kv, size_t shared){
+    size_t keyLength = kv -> keySize - 1;
+    size_t valueLength = kv -> valueSize == 0 ? 0 : kv -> valueSize - 1;
+    int inBlob = kv -> valueSize != 0 && blob != NO_BLOB;
+    size_t size = 0;
+    buf[size++] = kv -> valueSize == 0 ? RECORD_TOMBSTONE : inBlob ? RECORD_BLOB : 0;
+    size += putVarint(buf + size, shared);
+    size += putVarint(buf + size, keyLength - shared);
+    if (kv -> valueSize != 0) size += putVarint(buf + size, valueLength);
+    size += putVarint(buf + size, (uint64_t)kv -> lastSet);
+    size += putVarint(buf + size, (uint64_t)(kv -> lastSet - kv -> firstSet));
+    if (inBlob) size += putVarint(buf + size, blob);
+    memcpy(buf + size, key + shared, keyLength - shared);
+    size += keyLength - shared;
+    if (!inBlob){
+        memcpy(buf + size, value, valueLength);
+        size += valueLength;
+    }
+    uint32_t checksum = crc32Update(0, buf, size);
+    for (int i = 0; i < 4; i++) buf[size++] = (char)(checksum >> (8*i));
+    return size;
+}
+
+/**
+ * @brief   Decodes the fields at the start of an entry, which give the size of the rest of it
+ * @param[in]   buf         Buffer holding the start of the entry
+ * @param[in]   available   Bytes that may be read from buf
+ * @param[out]  record      On return, holds the sizes and timestamps of the entry, and its size in the file
+ * @return  Returns the number of bytes before the key, or 0 if they run past the end of the buffer or are malformed
+*/
+size_t recordHeader(const char* buf, size_t available, Record* record){
+    uint64_t shared, suffix, valueLength = 0, lastSet, age, blob = NO_BLOB;
+    size_t size = 1, read;
+    if (available < 1 || (buf[0] & ~(RECORD_TOMBSTONE | RECORD_BLOB)) != 0 ||
+        buf[0] == (RECORD_TOMBSTONE | RECORD_BLOB)) return 0;
+    int tombstone = buf[0] & RECORD_TOMBSTONE;
+    int inBlob = buf[0] & RECORD_BLOB;
+    if ((read = getVarint(buf + size, available - size, &shared)) == 0) return 0;
+    size += read;
+    if ((read = getVarint(buf + size, available - size, &suffix)) == 0) return 0;
+    size += read;
+    if (!tombstone){
+        if ((read = getVarint(buf + size, available - size, &valueLength)) == 0) return 0;
+        size += read;
+    }
+    if ((read = getVarint(buf + size, available - size, &lastSet)) == 0) return 0;
+    size += read;
+    if ((read = getVarint(buf + size, available - size, &age)) == 0) return 0;
+    size += read;
+    if (inBlob){
+        if ((read = getVarint(buf + size, available - size, &blob)) == 0 || blob == NO_BLOB) return 0;
+        size += read;
+    }
+    if (shared + suffix + 1 > MAX_KEY_SIZE || valueLength + 1 > (inBlob ? MAX_VALUE_SIZE : MAX_INLINE_VALUE)) return 0;
+    record -> shared = shared;
+    record -> kv.keySize = shared + suffix + 1;
+    record -> kv.valueSize = tombstone ? 0 : valueLength + 1;
+    record -> kv.lastSet = (time_t)lastSet;
+    record -> kv.firstSet = (time_t)(lastSet - age);
+    record -> blob = blob;
+    record -> size = size + suffix + (inBlob ? 0 : valueLength) + sizeof(uint32_t);
+    return size;
+}
+
+/**
+ * @brief   Decodes an entry in place
+ * @param[in]   buf         Buffer holding the entry
+ * @param[in]   available   Bytes that may be read from buf
+ * @param[in]   verify      Whether to check the entry against its checksum
+ * @param[out]  record      On return, holds the entry, pointing into buf
+ * @return  Returns 1 if a whole entry was decoded, 0 if it runs past the end of the buffer, is malformed, or fails its
+ *          checksum
+*/
+int decodeRecord(const char* buf, size_t available, int verify, Record* record){
+    size_t size = recordHeader(buf, available, record);
+    if (size == 0 || record -> size > available) return 0;
+    record -> suffix = buf + size;
+    record -> value = record -> blob != NO_BLOB ? NULL : record -> suffix + (record -> kv.keySize - 1 - record -> shared);
+    if (!verify) return 1;
+    const unsigned char* stored = (const unsigned char*)buf + record -> size - sizeof(uint32_t);
+    uint32_t checksum = stored[0] | stored[1] << 8 | stored[2] << 16 | (uint32_t)stored[3] << 24;
+    return checksum == crc32Update(0, buf, record -> size - sizeof(uint32_t));
+}
+
+/**
+ * @brief   Writes the header at the start of a new data file
+ * @param[in]   data        Pointer to the new, empty data file
+ * @param[in]   generation  Generation of the shard's blob file the entries of the file refer to
+*/
+int writeDataHeader(FILE* data, uint32_t generation){
+    char header[DATA_HEADER_SIZE] = DATA_MAGIC;
+    size_t pos = strlen(DATA_MAGIC);
+    header[pos++] = DATA_VERSION;
+    for (int i = 0; i < 3; i++) header[pos++] = (char)(generation >> (8*i));
+    if (fwrite(header, DATA_HEADER_SIZE, 1, data) != 1){
+        perror("ERROR: Failed writing data file header\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Checks the header of a data file, to find where its entries start
+ * @param[in]   data    Pointer to data file
+ * @return  Returns the file offset of the first entry, 0 if the file is empty or holds only part of a header, e.g.
+ *          after a crash part way through the first write, or -1 if the file is not in this format or any version of
+ *          it up to DATA_VERSION
+*/
+long int dataStart(FILE* data){
+    char read[DATA_HEADER_SIZE];
+    size_t magic = strlen(DATA_MAGIC);
+    rewind(data);
+    size_t size = fread(read, 1, DATA_HEADER_SIZE, data);
+    if (memcmp(read, DATA_MAGIC, size < magic ? size : magic) != 0) return -1;
+    if (size > magic && (read[magic] < 1 || read[magic] > DATA_VERSION)) return -1;
+    return size == DATA_HEADER_SIZE ? DATA_HEADER_SIZE : 0;
+}
+
+/**
+ * @brief   Small function to get the generation of the shard's blob file the entries of a data file refer to, from the
+ *          header of the file. Reads the file without moving the stream, whose header must have been flushed
+ * @return  Returns the generation, or 0 if the file has no header yet
+*/
+uint32_t blobGeneration(FILE* data){
+    unsigned char header[DATA_HEADER_SIZE];
+    if (pread(fileno(data), header, DATA_HEADER_SIZE, 0) != DATA_HEADER_SIZE) return 0;
+    size_t pos = strlen(DATA_MAGIC) + 1;
+    return header[pos] | header[pos+1] << 8 | (uint32_t)header[pos+2] << 16;
+}
+
+/**
+ * @brief   Updates the version in the header of a data file written in an older version of the format to DATA_VERSION,
+ *          before an entry only the current version can read is appended to it. Each version only adds to the one
+ *          before, so nothing else in the file changes, and older versions of kvdb refuse the file rather than
+ *          mistaking the new entries for a torn write
+ * @param[in]   data    Pointer to data file, whose header must have been flushed
+ * @param[in]   shard   Number of the shard the file belongs to. The stream is opened for appending, which places
+ *                      every write at the end of the file, so the header is written through a second descriptor
+*/
+int updateDataVersion(FILE* data, int shard){
+    char path[PATH_SIZE];
+    char version;
+    off_t pos = strlen(DATA_MAGIC);
+    if (pread(fileno(data), &version, 1, pos) != 1) return -1;
+    if (version == DATA_VERSION) return 0;
+    version = DATA_VERSION;
+    int fd = open(shardPath(path, DATA_PATH, shard), O_WRONLY);
+    if (fd == -1 || pwrite(fd, &version, 1, pos) != 1){
+        perror("ERROR: Failed updating data file header\n");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief   Rewrites a data file written before the format had a version, in the current format, keeping every entry in
+ *          order. Those files hold each entry as its raw key size and value size (size_t), key and value with null
+ *          terminators, time first and last set (time_t) and a CRC32 of all of those. Anything after the last whole
+ *          entry is dropped. The index must be rebuilt afterwards, as every offset changes.
+ * @param[in]   data    Pointer to data file. Reopened on the new file on return
+ * @param[in]   shard   Number of the shard the file belongs to
+ * @return  Returns 0 on success, -1 on failure or if the file is not in the old format either
+*/
+int upgradeData(FILE* data, int shard){
+    char tempPath[PATH_SIZE], path[PATH_SIZE];
+    char key[MAX_KEY_SIZE], value[MAX_INLINE_VALUE];
+    Pair kv;
+    uint32_t checksum;
+    rewind(data);
+    if (fread(key, 1, strlen(DATA_MAGIC), data) == strlen(DATA_MAGIC) && memcmp(key, DATA_MAGIC, strlen(DATA_MAGIC)) == 0){
+        fprintf(stderr, "data.%d.bin was written by a newer version of kvdb\n", shard);
+        return -1;
+    }
+    FILE* temp = fopen(shardPath(tempPath, TEMP_DATA_PATH, shard), "w");
+    if (temp == NULL || writeDataHeader(temp, 0) != 0){
+        perror("Error opening temp file to upgrade data file\n");
+        if (temp != NULL) fclose(temp);
+        return -1;
+    }
+    fprintf(stderr, "Upgrading data.%d.bin to format version %d\n", shard, DATA_VERSION);
+    rewind(data);
+    while (fread(&kv.keySize, sizeof(size_t), 1, data) == 1 && fread(&kv.valueSize, sizeof(size_t), 1, data) == 1 &&
+        kv.keySize > 0 && kv.keySize <= MAX_KEY_SIZE && kv.valueSize <= MAX_INLINE_VALUE &&
+        fread(key, 1, kv.keySize, data) == kv.keySize && fread(value, 1, kv.valueSize, data) == kv.valueSize &&
+        fread(&kv.firstSet, sizeof(time_t), 1, data) == 1 && fread(&kv.lastSet, sizeof(time_t), 1, data) == 1 &&
+        fread(&checksum, sizeof(uint32_t), 1, data) == 1){
+        uint32_t crc = crc32Update(0, &kv.keySize, sizeof(size_t));
+        crc = crc32Update(crc, &kv.valueSize, sizeof(size_t));
+        crc = crc32Update(crc, key, kv.keySize);
+        crc = crc32Update(crc, value, kv.valueSize);
+        crc = crc32Update(crc, &kv.firstSet, sizeof(time_t));
+        if (crc32Update(crc, &kv.lastSet, sizeof(time_t)) != checksum || key[kv.keySize - 1] != '\0') break;
+        if (writePair(temp, key, value, &kv) == -1){
+            fclose(temp);
+            return -1;
+        }
+    }
+    // As with compaction, the new file replaces the log, so it is synced before being renamed over it
+    if (fflush(temp) != 0 || fdatasync(fileno(temp)) != 0){
+        perror("Error syncing upgraded data file\n");
+        fclose(temp);
+        return -1;
+    }
+    fclose(temp);
+    rename(tempPath, shardPath(path, DATA_PATH, shard));
+    if (freopen(path, "a+", data) == NULL){
+        perror("Error reopening data file after upgrading it\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef RECORD_H_
+#define RECORD_H_
+#include <stdio.h>
+#include <stdint.h>
+
+// Flags in the first byte of each entry. Any other bit set marks the entry as malformed
+#define RECORD_TOMBSTONE 0x01
+#define RECORD_BLOB 0x02
+// Most bytes a 64 bit varint takes up
+#define MAX_VARINT_SIZE 10
+// Most bytes of an entry before its key: flags, then varint shared prefix, key, value, timestamp and blob fields
+#define MAX_RECORD_HEADER_SIZE (1 + 6*MAX_VARINT_SIZE)
+#define MAX_RECORD_SIZE (MAX_RECORD_HEADER_SIZE + MAX_KEY_SIZE + MAX_INLINE_VALUE + sizeof(uint32_t))
+
+/**
+ * @brief   An entry decoded in place from a buffer holding it. Sizes in kv count a null terminator, as in memory, though
+ *          none is stored
+*/
+typedef struct record{
+    Pair kv;
+    size_t shared;          // Bytes at the start of the key taken from the key before it in the file
+    const char* suffix;     // Rest of the key, kv.keySize - 1 - shared bytes
+    const char* value;      // Value, kv.valueSize - 1 bytes, or nothing for a tombstone. NULL if it is in the blob file
+    uint64_t blob;          // Offset of the value in the blob file, or NO_BLOB if it is stored inline
+    size_t size;            // Bytes the entry takes up in the file
+} Record;
+
+/**
+ * @brief   Writes the entries of a data file in key order, e.g. when compacting. Each key is stored as the length of the
+ *          prefix it shares with the key before it and the rest of the key, except every DATA_RESTART_INTERVAL entries,
+ *          where it is stored in full, so the file can be read from any restart point
+*/
+typedef struct sorted_writer{
+    FILE* data;
+    char key[MAX_KEY_SIZE]; // Last key written
+    size_t length;          // Length of the last key written
+    long int count;         // Number of entries written
+    long int size;          // Size of the file so far
+} SortedWriter;
+
+size_t varintSize(uint64_t value);
+size_t putVarint(char* buf, uint64_t value);
+size_t getVarint(const char* buf, size_t available, uint64_t* value);
+size_t encodeRecord(char* buf, const char* key, const char* value, uint64_t blob, Pair* kv, size_t shared);
+size_t recordHeader(const char* buf, size_t available, Record* record);
+int decodeRecord(const char* buf, size_t available, int verify, Record* record);
+int writeDataHeader(FILE* data, uint32_t generation);
+long int dataStart(FILE* data);
+uint32_t blobGeneration(FILE* data);
+int updateDataVersion(FILE* data, int shard);
+int upgradeData(FILE* data, int shard);
+#endif
@@ -0,0 +1,153 @@
+/**
+ * @brief   Function definitions for ordered scans over a range of keys, or over every key starting with a prefix.
+ *          Each shard's index is a B+tree, so a scan walks down the tree to the first key in range, then follows the
+ *          leaves in order, reading each entry from the mapping of the data file. Shards are merged so keys come out in
+ *          alphabetical order across the whole database, one entry at a time, so memory use does not depend on the
+ *          number of keys.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "definitions.h"
+#include "index.h"
+#include "set.h"
+#include "get.h"
+#include "lock.h"
+#include "scan.h"
+#include "stats.h"
+
+/**
+ * @brief   Small function to check a key against the bounds of a scan
+ * @return  Returns -1 if the key comes before the keys in range, 1 if it comes after them, and 0 if it is in range
+*/
+int scanBound(ScanIterator* it, const char* key){
+    if (it -> lower != NULL && strcmp(key, it -> lower) < 0) return -1;
+    if (it -> prefix != NULL){
+        int result = strncmp(key, it -> prefix, strlen(it -> prefix));
+        if (result != 0) return result < 0 ? -1 : 1;
+    }
+    if (it -> upper != NULL && strcmp(key, it -> upper) > 0) return 1;
+    return 0;
+}
+
+/**
+ * @brief   Moves a cursor on to the next live entry in range, or marks it finished
+*/
+static void advanceCursor(ScanIterator* it, ShardCursor* cursor){
+    IndexCell cell;
+    cursor -> valid = 0;
+    while (nextIndex(&(cursor -> index), &cell) == 1){
+        addStat(STAT_SCAN_ENTRIES, 1);
+        if (viewPair(cursor -> data, cell.value, cell.key, cell.length, &(cursor -> view)) == 0) continue;
+        int bound = scanBound(it, cursor -> view.key);
+        // Keys are read in order, so nothing after a key past the range can be in it
+        if (bound > 0) return;
+        // Entries with no value are tombstones left by del
+        if (bound == 0 && cursor -> view.kv.valueSize != 0){
+            cursor -> valid = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief   Starts a scan over every shard of the database. A shared lock is taken on every shard, in order, and held
+ *          until closeScan, so the scan sees a consistent database and writers wait for it to finish.
+ * @param[out]  it      Iterator to be initialised
+ * @param[in]   db      Open database
+ * @param[in]   lower   Lowest key to return, or NULL
+ * @param[in]   upper   Highest key to return, or NULL
+ * @param[in]   prefix  Prefix every key returned must start with, or NULL
+ * @return  Returns 0 on success, -1 on failure, in which case the iterator must not be used
+*/
+int openScan(ScanIterator* it, Database* db, const char* lower, const char* upper, const char* prefix){
+    memset(it, 0, sizeof(ScanIterator));
+    it -> db = db;
+    it -> lower = lower;
+    it -> upper = upper;
+    it -> prefix = prefix;
+    for (int shard = 0; shard < db -> shards; shard++){
+        ShardCursor* cursor = &it -> cursors[shard];
+        if (beginRead(db -> data[shard], db -> index[shard], shard) != 0){
+            closeScan(it);
+            return -1;
+        }
+        it -> locked++;
+        cursor -> data = mapFile(db -> data[shard]);
+        MappedFile* index = mapFile(db -> index[shard]);
+        // Start from the first key that can be in range
+        const char* start = lower;
+        if (prefix != NULL && (start == NULL || strcmp(prefix, start) > 0)) start = prefix;
+        if (cursor -> data == NULL || index == NULL || seekIndex(&(cursor -> index), index, start) != 0){
+            fprintf(stderr, "Error reading files of shard %d\n", shard);
+            closeScan(it);
+            return -1;
+        }
+        advanceCursor(it, cursor);
+    }
+    return 0;
+}
+
+/**
+ * @brief   Gets the next entry of a scan, in alphabetical order
+ * @param[in]   it      Iterator started by openScan
+ * @param[out]  view    On return, points at the entry in the mapping of its data file. Only valid until closeScan.
+ *                      it -> shard is set to the shard the entry belongs to
+ * @return  Returns 1 if an entry is returned, 0 once the scan is finished
+*/
+int nextScan(ScanIterator* it, PairView* view){
+    ShardCursor* best = NULL;
+    // Keys belong to exactly one shard, so there are no ties
+    for (int shard = 0; shard < it -> db -> shards; shard++){
+        ShardCursor* cursor = &it -> cursors[shard];
+        if (cursor -> valid && (best == NULL || strcmp(cursor -> view.key, best -> view.key) < 0)) best = cursor;
+    }
+    if (best == NULL) return 0;
+    *view = best -> view;
+    it -> shard = best - it -> cursors;
+    advanceCursor(it, best);
+    return 1;
+}
+
+/**
+ * @brief Ends a scan started by openScan, releasing its locks
+*/
+void closeScan(ScanIterator* it){
+    for (int shard = 0; shard < it -> locked; shard++) endRead(shard);
+    it -> locked = 0;
+    memset(it -> cursors, 0, sizeof(it -> cursors));
+}
+
+/**
+ * @brief   Prints every key and value in range, in alphabetical order. Entries are printed as they are read, so
+ *          memory use does not depend on the number of keys in range.
+ * @param[in]   db      Open database
+ * @param[in]   lower   Lowest key to print, or NULL
+ * @param[in]   upper   Highest key to print, or NULL
+ * @param[in]   prefix  Prefix every key printed must start with, or NULL
+ * @param[in]   out     Stream the entries are printed to
+ * @return  Returns the number of entries printed, or -1 on failure
+*/
+long int scan(Database* db, const char* lower, const char* upper, const char* prefix, FILE* out){
+    ScanIterator it;
+    PairView view;
+    long int count = 0;
+    uint64_t start = statsClock();
+    if (openScan(&it, db, lower, upper, prefix) != 0) return -1;
+    while (nextScan(&it, &view) == 1){
+        fprintf(out, "Key: %s, value ", view.key);
+        if (printValue(out, db -> data[it.shard], it.shard, &view) != 0){
+            closeScan(&it);
+            return -1;
+        }
+        fprintf(out, "\n");
+        addStat(STAT_BYTES_READ, view.kv.valueSize - 1);
+        count++;
+    }
+    closeScan(&it);
+    addStat(STAT_SCAN_KEYS, count);
+    recordOp(STAT_SCAN, start);
+    if (count == 0) fprintf(out, "No keys found\n");
+    return count;
+}
@@ -0,0 +1,36 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+#include <stdio.h>
+#include "map.h"
+#include "index.h"
+
+/**
+ * @brief Position of a scan in one shard, walking the leaves of the shard's index in key order
+*/
+typedef struct shard_cursor{
+    MappedFile* data;
+    IndexCursor index;
+    PairView view;          // Next live entry in range
+    int valid;              // Whether view holds an entry
+} ShardCursor;
+
+/**
+ * @brief   Ordered scan over every shard of a database. Keys from lower to upper inclusive that start with prefix are
+ *          returned in alphabetical order. Any of the bounds may be NULL.
+*/
+typedef struct scan_iterator{
+    Database* db;
+    const char* lower;
+    const char* upper;
+    const char* prefix;
+    int locked;             // Number of shards locked, from shard 0
+    int shard;              // Shard of the entry last returned by nextScan
+    ShardCursor cursors[MAX_SHARDS];
+} ScanIterator;
+
+int scanBound(ScanIterator* it, const char* key);
+int openScan(ScanIterator* it, Database* db, const char* lower, const char* upper, const char* prefix);
+int nextScan(ScanIterator* it, PairView* view);
+void closeScan(ScanIterator* it);
+long int scan(Database* db, const char* lower, const char* upper, const char* prefix, FILE* out);
+#endif
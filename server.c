@@ -0,0 +1,512 @@
+/**
+ * @brief   Function definitions for running the database as a long lived server over a Unix domain socket, and for a
+ *          client that talks to it. The server keeps every shard's files open, so requests don't pay for process
+ *          startup and opening files.
+ *          Requests are lines of text e.g. "set key value", "get key", "ts key", "del key", "mget key ...",
+ *          "scan prefix", "range from to" or "stats". Keys cannot contain spaces, values can contain anything but
+ *          newlines. The response to each request is what the equivalent ./kvdb command prints, followed by a line
+ *          holding only ".". Clients may pipeline requests, sending many before reading any responses, and responses
+ *          are always returned in the order requests were sent. Values in blob files are not buffered with the rest of
+ *          the responses, but sent to the socket straight from the file with sendfile once the responses before them
+ *          have been written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include "definitions.h"
+#include "set.h"
+#include "get.h"
+#include "server.h"
+#include "lock.h"
+#include "shard.h"
+#include "scan.h"
+#include "wal.h"
+#include "blob.h"
+#include "stats.h"
+#include "mget.h"
+#include "cache.h"
+
+static volatile sig_atomic_t stopServer = 0;
+
+/**
+ * @brief Signal handler letting the server finish cleanly on SIGINT or SIGTERM
+*/
+void stopServing(int sig){
+    (void)sig;
+    stopServer = 1;
+}
+
+/**
+ * @brief   Runs a single request line against the database and prints the response.
+ * @param[in]   db      Open database
+ * @param[in]   line    Null terminated request, without the newline. Modified while parsing
+ * @param[in]   out     Stream the response is printed to
+*/
+int handleRequest(Database* db, char* line, FILE* out){
+    // Split into command, key and the rest of the line, which is the value
+    char* command = line;
+    char* key = NULL;
+    char* value = NULL;
+    char* space = strchr(command, ' ');
+    if (space != NULL){
+        *space = '\0';
+        key = space + 1;
+        space = strchr(key, ' ');
+        if (space != NULL){
+            *space = '\0';
+            value = space + 1;
+        }
+    }
+    // Requests only touch the shard their key belongs to
+    int shard = key != NULL ? shardOf(db, key) : 0;
+    FILE* data = db -> data[shard];
+    FILE* index = db -> index[shard];
+    int result = 0;
+    if (strcmp(command, "set") == 0){
+        Pair entry;
+        if (key == NULL || value == NULL)
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: set key value\n");
+        else if (initPair(&entry, key, value, out) == 0)
+            result = commitWrite(data, index, shard, key, value, &entry, 0);
+    }
+    else if (strcmp(command, "get") == 0 || strcmp(command, "ts") == 0){
+        if (key == NULL || value != NULL)
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: %s key\n", command);
+        else if ((result = beginRead(data, index, shard)) == 0){
+            result = get(data, index, key, strcmp(command, "ts") == 0, out);
+            endRead(shard);
+        }
+    }
+    else if (strcmp(command, "del") == 0){
+        Pair entry;
+        memset(&entry, 0, sizeof(entry));
+        char null[] = "null";
+        if (key == NULL || value != NULL)
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: del key\n");
+        else if ((result = commitWrite(data, index, shard, key, null, &entry, 1)) == 1)
+            fprintf(out, "Key not found\n");
+    }
+    else if (strcmp(command, "scan") == 0){
+        if (key == NULL || value != NULL)
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: scan prefix\n");
+        else
+            result = scan(db, NULL, NULL, key, out) < 0 ? -1 : 0;
+    }
+    else if (strcmp(command, "range") == 0){
+        if (key == NULL || value == NULL || strchr(value, ' ') != NULL)
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: range from to\n");
+        else
+            result = scan(db, key, value, NULL, out) < 0 ? -1 : 0;
+    }
+    else if (strcmp(command, "mget") == 0){
+        if (key == NULL)
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: mget key [key ...]\n");
+        else{
+            // The line has been split into the command, the first key and the rest, which holds the other keys
+            size_t count = 1, capacity = 16;
+            char** keys = malloc(capacity*sizeof(char*));
+            if (keys != NULL) keys[0] = key;
+            for (char* next = value == NULL ? NULL : strtok(value, " "); keys != NULL && next != NULL;
+                next = strtok(NULL, " ")){
+                if (count == capacity){
+                    char** grown = realloc(keys, 2*capacity*sizeof(char*));
+                    if (grown == NULL) free(keys);
+                    keys = grown;
+                    capacity *= 2;
+                    if (keys == NULL) break;
+                }
+                keys[count++] = next;
+            }
+            // Running out of memory fails this request, not the server
+            if (keys == NULL){
+                fprintf(out, "Error allocating memory for keys\n");
+                result = -1;
+            }
+            else result = mget(db, keys, count, out) < 0 ? -1 : 0;
+            free(keys);
+        }
+    }
+    else if (strcmp(command, "stats") == 0){
+        if (value != NULL || (key != NULL && strcmp(key, "reset") != 0))
+            fprintf(out, "Incorrect number of arguments entered.\nUsage: stats [reset]\n");
+        else if (key != NULL)
+            fprintf(out, resetStats() == 0 ? "Stats reset\n" : "Stats are turned off\n");
+        else{
+            printStats(out);
+            printCache(out);
+        }
+    }
+    else{
+        fprintf(out, "Unknown command entered\n");
+    }
+    fprintf(out, ".\n");
+    return result;
+}
+
+/**
+ * @brief   BlobSender used while a connection's requests are run, which queues a value to be sent from its blob file
+ *          after the responses printed to out so far, instead of copying it into the output buffer
+ * @param[in]   out     Memory stream the connection's responses are being printed to, which has been flushed
+ * @param[in]   fd      File descriptor of the blob file
+ * @param[in]   offset  Offset of the value in the file
+ * @param[in]   length  Length of the value
+ * @param[in]   arg     Connection the responses belong to
+ * @return  Returns 0 on success, -1 on failure
+*/
+int deferBlob(FILE* out, int fd, uint64_t offset, size_t length, void* arg){
+    Connection* conn = arg;
+    BlobChunk* chunks = realloc(conn -> chunks, (conn -> chunkCount + 1)*sizeof(BlobChunk));
+    if (chunks == NULL) return -1;
+    conn -> chunks = chunks;
+    int copy = dup(fd);
+    if (copy == -1){
+        perror("Error duplicating blob file descriptor\n");
+        return -1;
+    }
+    BlobChunk* chunk = &conn -> chunks[conn -> chunkCount++];
+    // The stream's contents are added to the output buffer after the ones already there
+    chunk -> at = conn -> outLen + ftell(out);
+    chunk -> fd = copy;
+    chunk -> offset = offset;
+    chunk -> length = length;
+    return 0;
+}
+
+/**
+ * @brief   Runs every complete request line buffered for a connection, appending the responses to its output buffer
+ * @param[in]   db      Open database
+ * @param[in,out]   conn    Connection whose requests are to be run
+ * @return  Returns 0 on success, -1 if the responses couldn't be buffered, in which case the connection must be closed
+*/
+int handleConnection(Database* db, Connection* conn){
+    char* buf;
+    size_t len;
+    FILE* out = open_memstream(&buf, &len);
+    if (out == NULL) return -1;
+    size_t start = 0;
+    char* newline;
+    setBlobSender(deferBlob, conn);
+    while ((newline = memchr(conn -> in + start, '\n', conn -> inLen - start)) != NULL){
+        *newline = '\0';
+        handleRequest(db, conn -> in + start, out);
+        start = newline - conn -> in + 1;
+    }
+    setBlobSender(NULL, NULL);
+    // Keep any partial line for the next read
+    memmove(conn -> in, conn -> in + start, conn -> inLen - start);
+    conn -> inLen -= start;
+    fclose(out);
+    char* grown = realloc(conn -> out, conn -> outLen + len);
+    if (grown == NULL){
+        free(buf);
+        return -1;
+    }
+    conn -> out = grown;
+    memcpy(conn -> out + conn -> outLen, buf, len);
+    conn -> outLen += len;
+    free(buf);
+    return 0;
+}
+
+/**
+ * @brief   Writes as much of a connection's responses as the socket will take without blocking, sending values queued by
+ *          deferBlob from their blob files when their turn comes. Once everything is sent, the buffers are emptied.
+ * @param[in,out]   conn    Connection to write to
+ * @return  Returns 0 on success, including if the socket is full, -1 if the connection failed
+*/
+int writeConnection(Connection* conn){
+    while (conn -> outSent < conn -> outLen || conn -> chunkSent < conn -> chunkCount){
+        BlobChunk* chunk = conn -> chunkSent < conn -> chunkCount ? &conn -> chunks[conn -> chunkSent] : NULL;
+        size_t end = chunk != NULL ? chunk -> at : conn -> outLen;
+        ssize_t n;
+        if (conn -> outSent < end){
+            n = write(conn -> fd, conn -> out + conn -> outSent, end - conn -> outSent);
+            if (n > 0) conn -> outSent += n;
+        }
+        else{
+            off_t offset = chunk -> offset;
+            n = sendfile(conn -> fd, chunk -> fd, &offset, chunk -> length);
+            // The blob file ending before the value does is an error, like a failed write
+            if (n == 0) return -1;
+            if (n > 0){
+                chunk -> offset = offset;
+                chunk -> length -= n;
+            }
+            if (chunk -> length == 0){
+                close(chunk -> fd);
+                conn -> chunkSent++;
+            }
+        }
+        if (n == -1) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    conn -> outSent = conn -> outLen = 0;
+    conn -> chunkSent = conn -> chunkCount = 0;
+    return 0;
+}
+
+/**
+ * @brief Small function to close a connection and free its buffers
+*/
+void closeConnection(Connection* conn){
+    close(conn -> fd);
+    free(conn -> in);
+    free(conn -> out);
+    for (size_t i = conn -> chunkSent; i < conn -> chunkCount; i++) close(conn -> chunks[i].fd);
+    free(conn -> chunks);
+    memset(conn, 0, sizeof(Connection));
+    conn -> fd = -1;
+}
+
+/**
+ * @brief   Creates a Unix domain socket listening at the given path, replacing any stale socket file
+ * @param[in]   path    Path of the socket
+ * @return  Returns the listening file descriptor, or -1 on failure
+*/
+int listenSocket(char* path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1){
+        perror("Error creating socket\n");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, MAX_CONNECTIONS) != 0){
+        perror("Error listening on socket\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief   Syncs the writes committed to every shard that the sync policy has not synced yet
+ * @param[in]   db      Open database
+*/
+void syncDatabase(Database* db){
+    for (int shard = 0; shard < db -> shards; shard++) syncShard(db -> data[shard], db -> index[shard], shard);
+}
+
+/**
+ * @brief Small function to get the time in milliseconds from a monotonic clock
+*/
+static uint64_t monotonicMs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**
+ * @brief   Serves requests over a Unix domain socket until interrupted. A single thread polls every connection, so
+ *          requests from all clients are run one at a time against the open files, and each client's requests run
+ *          in order. Each request takes the same locks as a ./kvdb command, so other processes can use the database
+ *          while the server is running. With a sync policy of every N milliseconds, the server also syncs writes left
+ *          unsynced every N milliseconds, so they are synced even if no more writes arrive. Recently read keys are
+ *          cached, up to KVDB_CACHE bytes or DEFAULT_CACHE_SIZE, see cache.c.
+ * @param[in]   db      Open database
+ * @param[in]   path    Path of the socket to listen on
+*/
+int serve(Database* db, char* path){
+    if (openCache(getenv("KVDB_CACHE"), DEFAULT_CACHE_SIZE) != 0) return -1;
+    int listenFd = listenSocket(path);
+    if (listenFd == -1) return -1;
+    // Don't restart poll after a signal, so the loop can check stopServer
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServing;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    Connection conns[MAX_CONNECTIONS];
+    struct pollfd fds[MAX_CONNECTIONS + 1];
+    for (int i = 0; i < MAX_CONNECTIONS; i++){
+        memset(&conns[i], 0, sizeof(Connection));
+        conns[i].fd = -1;
+    }
+    char buf[4096];
+    uint64_t interval = syncInterval();
+    uint64_t lastSync = monotonicMs();
+    while (stopServer == 0){
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < MAX_CONNECTIONS; i++){
+            fds[i+1].fd = conns[i].fd;
+            fds[i+1].events = (conns[i].closing ? 0 : POLLIN) | (conns[i].outLen > 0 || conns[i].chunkCount > 0 ? POLLOUT : 0);
+            fds[i+1].revents = 0;
+        }
+        int polled = poll(fds, MAX_CONNECTIONS + 1, interval > 0 ? (int)interval : -1);
+        if (interval > 0 && monotonicMs() - lastSync >= interval){
+            syncDatabase(db);
+            lastSync = monotonicMs();
+        }
+        if (polled == -1){
+            if (errno == EINTR) continue;
+            perror("Error polling connections\n");
+            break;
+        }
+        // Accept a new connection if there is room for it
+        if (fds[0].revents & POLLIN){
+            int fd = accept(listenFd, NULL, NULL);
+            int i = 0;
+            while (i < MAX_CONNECTIONS && conns[i].fd != -1) i++;
+            if (i == MAX_CONNECTIONS){
+                if (fd != -1) close(fd);
+            }
+            else if (fd != -1){
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                conns[i].fd = fd;
+            }
+        }
+        for (int i = 0; i < MAX_CONNECTIONS; i++){
+            Connection* conn = &conns[i];
+            short revents = fds[i+1].revents;
+            if (conn -> fd == -1 || revents == 0) continue;
+            if (revents & (POLLIN | POLLHUP | POLLERR)){
+                ssize_t n = read(conn -> fd, buf, sizeof(buf));
+                if (n > 0){
+                    // Only look for whole requests if this read finished one, so a long value isn't scanned every read
+                    int finished = memchr(buf, '\n', n) != NULL;
+                    // A client that never ends its request can't make the server hold more than one request's worth
+                    if (!finished && conn -> inLen + n > MAX_REQUEST_SIZE){
+                        fprintf(stderr, "Request too long, closing connection\n");
+                        closeConnection(conn);
+                        continue;
+                    }
+                    char* grown = realloc(conn -> in, conn -> inLen + n);
+                    if (grown == NULL){
+                        fprintf(stderr, "Error allocating memory for request, closing connection\n");
+                        closeConnection(conn);
+                        continue;
+                    }
+                    conn -> in = grown;
+                    memcpy(conn -> in + conn -> inLen, buf, n);
+                    conn -> inLen += n;
+                    if (finished && handleConnection(db, conn) != 0){
+                        fprintf(stderr, "Error buffering responses, closing connection\n");
+                        closeConnection(conn);
+                        continue;
+                    }
+                    if (conn -> inLen > MAX_REQUEST_SIZE){
+                        fprintf(stderr, "Request too long, closing connection\n");
+                        closeConnection(conn);
+                        continue;
+                    }
+                }
+                else if (n == 0 || (errno != EAGAIN && errno != EINTR)){
+                    conn -> closing = 1;
+                }
+            }
+            if ((conn -> outLen > 0 || conn -> chunkCount > 0) && writeConnection(conn) != 0){
+                closeConnection(conn);
+                continue;
+            }
+            // Once the client has stopped sending and every response is written, the connection is finished
+            if (conn -> closing && conn -> outLen == 0 && conn -> chunkCount == 0) closeConnection(conn);
+        }
+    }
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+        if (conns[i].fd != -1) closeConnection(&conns[i]);
+    syncDatabase(db);
+    closeCache();
+    close(listenFd);
+    unlink(path);
+    return 0;
+}
+
+/**
+ * @brief   Client for a running server. Forwards request lines from stdin to the server without waiting for
+ *          responses, so requests are pipelined over one connection, and prints the responses without the "." lines
+ *          separating them. Returns once stdin is finished and every response has been received.
+ * @param[in]   path    Path of the server's socket
+*/
+int client(char* path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+        perror("Error connecting to server\n");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    char in[4096];
+    size_t inLen = 0, inSent = 0;
+    int inputDone = 0;
+    // Whether the next byte starts a line, and whether a "." starting the line has been held back
+    int lineStart = 1, dot = 0;
+    struct pollfd fds[2];
+    for (;;){
+        fds[0].fd = inputDone || inSent < inLen ? -1 : STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = fd;
+        fds[1].events = POLLIN | (inSent < inLen ? POLLOUT : 0);
+        if (poll(fds, 2, -1) == -1){
+            if (errno == EINTR) continue;
+            perror("Error polling\n");
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)){
+            ssize_t n = read(STDIN_FILENO, in, sizeof(in));
+            if (n <= 0){
+                // No more requests, so let the server know it can close the connection once it has responded
+                inputDone = 1;
+                shutdown(fd, SHUT_WR);
+            }
+            else{
+                inLen = n;
+                inSent = 0;
+            }
+        }
+        if (fds[1].revents & POLLOUT){
+            ssize_t n = write(fd, in + inSent, inLen - inSent);
+            if (n == -1){
+                perror("Error sending request\n");
+                break;
+            }
+            inSent += n;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)){
+            char buf[4096];
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;
+            // Print responses as they arrive, however long their lines, skipping the lines separating them
+            for (ssize_t i = 0; i < n; i++){
+                if (dot){
+                    dot = 0;
+                    if (buf[i] == '\n'){
+                        lineStart = 1;
+                        continue;
+                    }
+                    putchar('.');
+                }
+                else if (lineStart && buf[i] == '.'){
+                    dot = 1;
+                    lineStart = 0;
+                    continue;
+                }
+                putchar(buf[i]);
+                lineStart = buf[i] == '\n';
+            }
+        }
+    }
+    close(fd);
+    return 0;
+}
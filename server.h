@@ -0,0 +1,47 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+#include <stdio.h>
+#include <stdint.h>
+
+#define MAX_CONNECTIONS 64
+// Longest request line accepted: command, key and value separated by spaces
+#define MAX_REQUEST_SIZE (MAX_KEY_SIZE + MAX_VALUE_SIZE + 16)
+
+/**
+ * @brief   A value in a blob file to be sent to a client once the responses buffered before it have been written
+*/
+typedef struct blob_chunk{
+    size_t at;              // Position in the connection's output buffer the value is sent at
+    int fd;                 // Duplicate of the blob file's descriptor, so the value can still be read if it is replaced
+    uint64_t offset;        // Offset of the part of the value still to be sent
+    size_t length;          // Bytes of the value still to be sent
+} BlobChunk;
+
+/**
+ * @brief State of one client connection. Input is buffered until a full line is received, and responses are buffered
+ *        until the socket can take them.
+*/
+typedef struct connection{
+    int fd;
+    char* in;
+    size_t inLen;
+    char* out;
+    size_t outLen;
+    size_t outSent;
+    BlobChunk* chunks;      // Values to be sent from blob files, in the order they appear in the output
+    size_t chunkCount;
+    size_t chunkSent;       // Number of chunks fully sent
+    int closing;    // Set once the client has finished sending requests
+} Connection;
+
+void stopServing(int sig);
+int handleRequest(Database* db, char* line, FILE* out);
+int handleConnection(Database* db, Connection* conn);
+int deferBlob(FILE* out, int fd, uint64_t offset, size_t length, void* arg);
+int writeConnection(Connection* conn);
+void closeConnection(Connection* conn);
+int listenSocket(char* path);
+void syncDatabase(Database* db);
+int serve(Database* db, char* path);
+int client(char* path);
+#endif
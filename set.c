@@ -5,126 +5,213 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "definitions.h"
 #include "index.h"
+#include "get.h"
+#include "compact.h"
+#include "wal.h"
+#include "record.h"
+#include "blob.h"
+#include "stats.h"
+#include "cache.h"
 
 /**
- * @brief   Simple function to write a KV entry to file
+ * @brief   Writes a KV entry to the end of a data file in the format described in record.c
  * @param[in]   data    Pointer to data file
  * @param[in]   key     String containing key
- * @param[in]   value   String containing value
+ * @param[in]   value   String containing value. Ignored for tombstones and values in the blob file
+ * @param[in]   blob    Offset of the value in the shard's blob file, or NO_BLOB to store it inline
  * @param[in]   kv      Pair object containing sizes of key and value as well as time first set and time last set
+ * @param[in]   shared  Bytes at the start of the key shared with the key before it in the file, which are not written
+ * @return  Returns the number of bytes written, or -1 on failure
 */
-int writePair(FILE* data, char* key, char* value, Pair* kv){
-    if(fwrite(&(kv -> keySize), sizeof(size_t), 1, data) != 1) perror("ERROR: Failed writing key size\n");
-    if(fwrite(&(kv -> valueSize), sizeof(size_t), 1, data) != 1) perror("ERROR: Failed writing value size\n");
-    fwrite(key, 1, (kv -> keySize), data);
-    fwrite(value, 1, (kv -> valueSize) , data);
-    if(fwrite(&(kv -> firstSet), sizeof(time_t), 1, data) != 1) perror("ERROR: Failed writing firstSet\n");
-    if(fwrite(&(kv -> lastSet), sizeof(time_t), 1, data) != 1) perror("ERROR: Failed writing lastSet\n");
-    return 0;
+static long int writeRecord(FILE* data, const char* key, const char* value, uint64_t blob, Pair* kv, size_t shared){
+    char buf[MAX_RECORD_SIZE];
+    size_t size = encodeRecord(buf, key, value, blob, kv, shared);
+    if (fwrite(buf, size, 1, data) != 1){
+        perror("ERROR: Failed writing entry\n");
+        return -1;
+    }
+    return size;
 }
 
 /**
- * @brief   Function to write a new entry into the data file in the correct alphabetical position.
+ * @brief   Simple function to write a KV entry to file, with the key and value stored in full
  * @param[in]   data    Pointer to data file
- * @param[in]   key     String containing key to be added
- * @param[in]   value   String containing value to be added
- * @param[in]   entry   Pair object containing sizes of key and value and times key was first set and last set
- * @param[in]   mode    Determines if a key is being added with set or deleted with del
- * @param[out]  difference  Contains, if the key is new, the size of the entry in bytes. If key exists and is being updated, 
- *                          contains the difference in size between the old and new value. If key is being deleted, contains
- *                          the size of the deleted chunk
+ * @param[in]   key     String containing key
+ * @param[in]   value   String containing value, of at most MAX_INLINE_VALUE bytes. Ignored for tombstones
+ * @param[in]   kv      Pair object containing sizes of key and value as well as time first set and time last set
+ * @return  Returns the number of bytes written, or -1 on failure
 */
-int addToData(FILE* data, char* key, char* value, Pair* entry, long int* difference, int mode){
-    // Check if this is first value to be added
-    rewind(data);
-    // Open temp file
-    FILE* tempData = fopen("tempData.bin", "w") ;
-    if(tempData == NULL) printf("Error opening tempData.bin\n");
-    Pair* read = malloc(sizeof(Pair));
-    char* readKey = malloc(MAX_KEY_SIZE);
-    char* readValue = malloc(MAX_VALUE_SIZE); 
-    // Pair struct to hold read in entries
-    if (fread(&(read -> keySize), sizeof(size_t), 1, data) == 0){
-        writePair(tempData, key, value, entry);
-    }
-    else{
-        rewind(data);
-        int updated = 0;
-        while(fread(&(read -> keySize), sizeof(size_t), 1, data) == 1){
-            // Read in current KV entry from data file
-            fread(&(read -> valueSize), sizeof(size_t), 1, data);
-            readKey = realloc(readKey, read -> keySize);
-            readValue = realloc(readValue, read -> valueSize);
-            fread(readKey, 1, (read -> keySize), data);
-            fread(readValue, 1, (read -> valueSize), data);
-            readKey[(read -> keySize)-1] = '\0'; readValue[(read -> valueSize)-1] = '\0';
-            if (fread(&(read -> firstSet), sizeof(time_t), 1, data) == 0) printf("firstSet not read in correctly\n");
-            if (fread(&(read -> lastSet), sizeof(time_t), 1, data) == 0) printf("lastSet not read in correctly\n");
+long int writePair(FILE* data, const char* key, const char* value, Pair* kv){
+    return writeRecord(data, key, value, NO_BLOB, kv, 0);
+}
 
-            // If the key already exists i.e. readKey == key, update and skip writing
-            if (strcmp(key, readKey) == 0){
-                if (mode == 0){
-                    entry -> firstSet = read -> firstSet;   // Update first write
-                    // Difference in size of new key value pair
-                    *difference = ((entry -> keySize) + (entry -> valueSize)) - ((read -> keySize) + (read -> valueSize));  
-                    writePair(tempData, key, value, entry);
-                }
-                else if (mode == 1){
-                    // If deleting key, set difference to be minus the size of the deleted entry
-                    *difference = -((read -> keySize) + (read -> valueSize) + 2*sizeof(size_t) + 2*sizeof(time_t));
-                }
-                updated = 1;
-                continue;   // Replace line - don't write current line
-            }
-            // If the key didn't exist (we've passed where it should be in file), no updates required and don't skip writing
-            else if (compareString(key, readKey) == 1 && updated == 0 && mode == 0){
-                writePair(tempData, key, value, entry); // Don't replace line
-                updated = 1;
-            }
-            // Write read entry to new temp file
-            writePair(tempData, readKey, readValue, read);
-        }
-        // If not updated by the end of the file, add the entry to the end of file
-        if (updated == 0 && mode == 0){
-            writePair(tempData, key, value, entry);
-            
-        }
-        else if (updated == 0 && mode == 1){
-            printf("Key not found\n");
-        }
+/**
+ * @brief   Starts writing a sorted data file, writing its header
+ * @param[out]  writer  Writer to be initialised
+ * @param[in]   data    Pointer to the new, empty data file
+ * @param[in]   generation  Generation of the shard's blob file the entries refer to
+*/
+int beginSorted(SortedWriter* writer, FILE* data, uint32_t generation){
+    memset(writer, 0, sizeof(SortedWriter));
+    writer -> data = data;
+    if (writeDataHeader(data, generation) != 0) return -1;
+    writer -> size = DATA_HEADER_SIZE;
+    return 0;
+}
+
+/**
+ * @brief   Writes the next entry of a sorted data file, sharing the start of its key with the key before it unless it
+ *          is a restart point
+ * @param[in,out]   writer  Writer started by beginSorted
+ * @param[in]   key     String containing key, which must come after the key before it
+ * @param[in]   value   String containing value. Ignored for tombstones and values in the blob file
+ * @param[in]   blob    Offset of the value in the shard's blob file, or NO_BLOB to store it inline
+ * @param[in]   kv      Pair object containing sizes of key and value as well as time first set and time last set
+ * @return  Returns the file offset the entry was written at, or -1 on failure
+*/
+long int writeSorted(SortedWriter* writer, const char* key, const char* value, uint64_t blob, Pair* kv){
+    size_t length = kv -> keySize - 1, shared = 0;
+    if (writer -> count % DATA_RESTART_INTERVAL != 0){
+        while (shared < length && shared < writer -> length && key[shared] == writer -> key[shared]) shared++;
     }
-    // Free dynamically allocated memory
-    free(readValue);
-    free(readKey);
-    free(read);
-    // Now close files, delete old file and rename new file
-    fclose(tempData);
-    remove("data.bin");
-    rename("tempData.bin", "data.bin");
-    data = fopen("data.bin", "r");
+    long int size = writeRecord(writer -> data, key, value, blob, kv, shared);
+    if (size == -1) return -1;
+    memcpy(writer -> key, key, length);
+    writer -> length = length;
+    writer -> count++;
+    writer -> size += size;
+    return writer -> size - size;
+}
+
+/**
+ * @brief   Small function to get the number of bytes an entry takes up in the data file when its key is stored in full,
+ *          as it is when appended, plus the bytes its value takes up in the blob file if it is stored there
+ * @param[in]   kv      Pair object containing sizes and timestamps of the entry
+ * @param[in]   blob    Offset of the value in the blob file, or NO_BLOB if it is stored inline
+*/
+long int pairSize(Pair* kv, uint64_t blob){
+    size_t keyLength = kv -> keySize - 1;
+    size_t valueLength = kv -> valueSize == 0 ? 0 : kv -> valueSize - 1;
+    return 1 + varintSize(0) + varintSize(keyLength) + (kv -> valueSize == 0 ? 0 : varintSize(valueLength)) +
+        varintSize((uint64_t)kv -> lastSet) + varintSize((uint64_t)(kv -> lastSet - kv -> firstSet)) +
+        (blob == NO_BLOB ? 0 : varintSize(blob)) + keyLength + valueLength + sizeof(uint32_t);
+}
 
+/**
+ * @brief   Initialises a Pair object for a new key value pair, checking the key and value are within the maximum sizes
+ * @param[out]  entry   Pair object to be filled with the sizes of key and value, and the current time
+ * @param[in]   key     String containing key
+ * @param[in]   value   String containing value
+ * @param[in]   out     Stream any error is printed to
+ * @return  Returns 0 on success, -1 if the key or value is too long
+*/
+int initPair(Pair* entry, char* key, char* value, FILE* out){
+    entry -> keySize = strlen(key) + 1;
+    if (entry -> keySize > MAX_KEY_SIZE){
+        fprintf(out, "Entered key is too long. To adjust maximum key size, please edit #define in definitions.h\n");
+        return -1;
+    }
+    entry -> valueSize = strlen(value) + 1;
+    if (entry -> valueSize > MAX_VALUE_SIZE){
+        fprintf(out, "Entered value is too long. To adjust maximum value size, please edit #define in definitions.h\n");
+        return -1;
+    }
+    time(&(entry -> firstSet));
+    entry -> lastSet = entry -> firstSet;
     return 0;
 }
 
 /**
- * @brief Function to set a new key, update an old key or delete a key from the database. Handles updates to both index and data files
+ * @brief   Function to append a new entry, or a tombstone for a deleted key, to the end of the data file. Older entries
+ *          for the same key are left in place and are shadowed by the newer one until the file is compacted, so the
+ *          cost of a write does not depend on the size of the database. A value longer than MAX_INLINE_VALUE is
+ *          appended to the shard's blob file first, so the entry never refers to a value that hasn't been written.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file, whose header gives the shard
+ * @param[in]   key     String containing key to be added
+ * @param[in]   value   String containing value to be added. Ignored for tombstones
+ * @param[in]   entry   Pair object containing sizes of key and value and times key was first set and last set.
+ *                      A valueSize of 0 marks the entry as a tombstone
+ * @return  Returns the file offset the entry was written at, or -1 on failure
+*/
+long int appendToData(FILE* data, FILE* index, char* key, char* value, Pair* entry){
+    IndexHeader header;
+    uint64_t blob = NO_BLOB;
+    fseek(data, 0, SEEK_END);
+    // The first write to a new file starts it with its header
+    if (ftell(data) == 0 && (writeDataHeader(data, 0) != 0 || fflush(data) != 0)) return -1;
+    if (entry -> valueSize > MAX_INLINE_VALUE){
+        addStat(STAT_DATA_BYTES, entry -> valueSize - 1);
+        if (readIndexHeader(index, &header) != 0 || updateDataVersion(data, header.shard) != 0) return -1;
+        int fd = openBlob(header.shard, blobGeneration(data), 1);
+        long int blobOffset = fd == -1 ? -1 : appendBlob(fd, value, entry -> valueSize - 1);
+        if (blobOffset == -1) return -1;
+        blob = blobOffset;
+    }
+    long int offset = ftell(data);
+    long int size = writeRecord(data, key, value, blob, entry, 0);
+    if (size == -1 || fflush(data) != 0){
+        perror("ERROR: Failed appending to data.bin\n");
+        return -1;
+    }
+    addStat(STAT_DATA_BYTES, size);
+    return offset;
+}
+
+/**
+ * @brief Function to set a new key, update an old key or delete a key from the database. The entry is appended to the 
+ *        data file and the index is pointed at it. The file is compacted once enough of it is taken up by dead entries.
+ *        The write is passed on to this process's cache, if it keeps one, see cache.c.
  * @param[in]   data    Pointer to file containing data
  * @param[in]   index   Pointer to file containing index
  * @param[in]   key     String containing key to be added/updated/deleted
  * @param[in]   value   If key to be added/updated, contains corresponding value. If key is to be deleted, contains "null"
  * @param[in]   entry   Holds other relevant variables; key size, value size and times key was first and last set
  * @param[in]   mode    Determines if key is to be added/updated (mode = 0) or deleted (mode = 1)
+ * @return  Returns 0 on success, 1 if the key to be deleted does not exist and -1 on failure
 */
 int set(FILE* data, FILE* index, char* key, char* value, Pair* entry, int mode){
-    size_t keySize = entry -> keySize;  // Extract values from struct
-    size_t valueSize = entry -> valueSize;
-    long int difference = 2*sizeof(size_t) + 2*sizeof(time_t) + keySize + valueSize;    // Initialise difference to be size of new KV entry
-    addToData(data, key, value, entry, &difference, mode);  // Insert this line in data file and update difference var
-    addIndexLine(index, key, difference);   // Update index.bin to account for this new/updated/deleted key
-    return 0;
+    PairView old;
+    uint64_t start = statsClock();
+    recordPrefix(key, mode == 1 ? STAT_DEL : STAT_SET);
+    // Only the size of the entry being replaced is needed, so its value is left where it is
+    int exists = viewKey(data, index, key, &old);
+    // Not knowing whether the key exists would leave its first set time and the dead bytes wrong
+    if (exists == -1){
+        recordOp(mode == 1 ? STAT_DEL : STAT_SET, start);
+        return -1;
+    }
+    if (mode == 1){
+        if (exists == 0){
+            recordOp(STAT_DEL, start);
+            return 1;
+        }
+        // Deleting writes a tombstone: an entry with no value
+        entry -> keySize = strlen(key) + 1;
+        entry -> valueSize = 0;
+        time(&(entry -> firstSet));
+        entry -> lastSet = entry -> firstSet;
+    }
+    else if (exists == 1){
+        entry -> firstSet = old.kv.firstSet;    // Update first write
+    }
+    // The entry being replaced is now dead, as is a tombstone once there is nothing left for it to shadow
+    long int deadBytes = exists == 1 ? pairSize(&old.kv, old.blob) : 0;
+    if (mode == 1) deadBytes += pairSize(entry, NO_BLOB);
+    addStat(STAT_USER_BYTES, entry -> keySize - 1 + (entry -> valueSize == 0 ? 0 : entry -> valueSize - 1));
+    int cached = cacheSynced(data);
+    uint64_t phase = statsClock();
+    long int offset = appendToData(data, index, key, value, entry);
+    recordOp(STAT_APPEND, phase);
+    if (offset == -1) return -1;
+    phase = statsClock();
+    int result = addIndexLine(index, key, offset, ftell(data), deadBytes);
+    recordOp(STAT_INDEX_UPDATE, phase);
+    if (result == 0 && needsCompaction(data, index) == 1) result = compact(data, index);
+    if (result == 0) cacheWrite(data, cached, key, value, entry);
+    recordOp(mode == 1 ? STAT_DEL : STAT_SET, start);
+    return result;
 }
-
-
-
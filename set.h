@@ -1,9 +1,13 @@
 #ifndef SET_H_
 #define SET_H_
+#include "record.h"
 
-
-int writePair(FILE* data, char* key, char* value, Pair* kv);
-int addToData(FILE* data, char* key, char* value, Pair* entry, long int* difference, int mode);
+long int writePair(FILE* data, const char* key, const char* value, Pair* kv);
+int beginSorted(SortedWriter* writer, FILE* data, uint32_t generation);
+long int writeSorted(SortedWriter* writer, const char* key, const char* value, uint64_t blob, Pair* kv);
+long int pairSize(Pair* kv, uint64_t blob);
+int initPair(Pair* entry, char* key, char* value, FILE* out);
+long int appendToData(FILE* data, FILE* index, char* key, char* value, Pair* entry);
 int set(FILE* data, FILE* index, char* key, char* value, Pair* entry, int mode);
 
 #endif
@@ -0,0 +1,104 @@
+/**
+ * @brief   Function definitions for splitting the database into shards. Each shard is a data file, e.g. data.0.bin,
+ *          with its own index, e.g. index.0.bin, and its own locks and write queue. Keys are routed to a shard by their
+ *          hash, so a set or del only appends to and locks one shard, and writes to different shards can be committed
+ *          in parallel by different processes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "definitions.h"
+#include "index.h"
+#include "shard.h"
+#include "wal.h"
+#include "stats.h"
+#include "snapshot.h"
+
+/**
+ * @brief Small function to get the path of one of a shard's files
+ * @param[out]  path    Buffer of at least PATH_SIZE bytes to hold the path
+ * @param[in]   format  Format of the path, one of DATA_PATH, INDEX_PATH or QUEUE_PATH
+ * @param[in]   shard   Number of the shard
+*/
+char* shardPath(char* path, const char* format, int shard){
+    snprintf(path, PATH_SIZE, format, shard);
+    return path;
+}
+
+/**
+ * @brief   Decides which shard a key belongs to. The key's hash is mixed again first, as the bits of FNV-1a are poorly
+ *          distributed for short keys that differ only in their last characters.
+ * @param[in]   db      Open database
+ * @param[in]   key     Null terminated key
+ * @return  Returns the number of the key's shard
+*/
+int shardOf(Database* db, char* key){
+    uint64_t hash = hashKey(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash % db -> shards;
+}
+
+/**
+ * @brief   Opens every shard of the database, creating the files if needed. The number of shards is fixed when the
+ *          database is created: it is taken from the KVDB_SHARDS environment variable if set, or DEFAULT_SHARDS
+ *          otherwise. An existing database has as many shards as there are data files. The sync policy is taken from
+ *          KVDB_SYNC, see wal.c, and the stats shared by every process are mapped, see stats.c. If KVDB_SNAPSHOT is
+ *          set, the snapshot with that number is opened read only instead, see snapshot.c.
+ * @param[out]  db      On return, holds the open files of every shard
+ * @return  Returns 0 on success, -1 on failure
+*/
+int openDatabase(Database* db){
+    char path[PATH_SIZE];
+    memset(db, 0, sizeof(Database));
+    if (setSyncPolicy(getenv("KVDB_SYNC")) != 0) return -1;
+    char* snapshot = getenv("KVDB_SNAPSHOT");
+    if (snapshot != NULL) return openSnapshot(db, atoi(snapshot));
+    while (db -> shards < MAX_SHARDS && access(shardPath(path, DATA_PATH, db -> shards), F_OK) == 0) db -> shards++;
+    if (db -> shards == 0){
+        char* env = getenv("KVDB_SHARDS");
+        db -> shards = env != NULL ? atoi(env) : DEFAULT_SHARDS;
+        if (db -> shards < 1 || db -> shards > MAX_SHARDS){
+            fprintf(stderr, "KVDB_SHARDS must be between 1 and %d\n", MAX_SHARDS);
+            return -1;
+        }
+    }
+    for (int i = 0; i < db -> shards; i++){
+        // Writes to the data files are always appended to the end of the file
+        db -> data[i] = fopen(shardPath(path, DATA_PATH, i), "a+");
+        if (db -> data[i] == NULL){
+            perror("Error opening data file\n");
+            closeDatabase(db);
+            return -1;
+        }
+        // Open without truncating, as another process may be creating the same file
+        int fd = open(shardPath(path, INDEX_PATH, i), O_RDWR | O_CREAT, 0644);
+        db -> index[i] = fd == -1 ? NULL : fdopen(fd, "r+");
+        if (db -> index[i] == NULL){
+            perror("Error opening index file\n");
+            if (fd != -1) close(fd);
+            closeDatabase(db);
+            return -1;
+        }
+    }
+    // Stats are not needed to use the database, so failing to open them is not an error
+    openStats();
+    return 0;
+}
+
+/**
+ * @brief Small function to close every file opened by openDatabase, and the snapshot if one was opened
+*/
+void closeDatabase(Database* db){
+    int snapshot = db -> snapshot;
+    for (int i = 0; i < db -> shards; i++){
+        if (db -> data[i] != NULL) fclose(db -> data[i]);
+        if (db -> index[i] != NULL) fclose(db -> index[i]);
+    }
+    memset(db, 0, sizeof(Database));
+    if (snapshot != 0) closeSnapshot(snapshot);
+}
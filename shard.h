@@ -0,0 +1,8 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+#include <stdio.h>
+char* shardPath(char* path, const char* format, int shard);
+int shardOf(Database* db, char* key);
+int openDatabase(Database* db);
+void closeDatabase(Database* db);
+#endif
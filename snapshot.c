@@ -0,0 +1,499 @@
+/**
+ * @brief   Function definitions for point-in-time snapshots of the database, so a long scan or a backup can read one
+ *          consistent state while writers carry on. ./kvdb snapshot takes snapshot N as a directory, snapshot.N, holding:
+ *              -   A hard link to each shard's data file. Data files are only appended to, or replaced whole by renaming
+ *                  a new file over them (see compact.c), so the bytes the snapshot needs never change, and a replaced
+ *                  file lives on for as long as a snapshot links it.
+ *              -   A hard link to the generation of each shard's blob file the data file refers to, for the same reason.
+ *              -   A copy of each shard's index, which unlike the other files is modified in place. Copying it is the
+ *                  only work taking a snapshot does in proportion to the size of the database.
+ *              -   snapshot.info, holding the time the snapshot was taken and the size of each file then, written last.
+ *          Every shard's LOCK_DATA is held shared while the snapshot is taken, so it sees every shard at the same point,
+ *          and writers only wait for the indexes to be copied.
+ *          A process reads snapshot N instead of the live database if KVDB_SNAPSHOT is set to N. It holds a shared fcntl
+ *          lock on the snapshot's snapshot.lock for as long as it has the snapshot open, and takes no other locks. A
+ *          dropped snapshot is removed by the first process to find no one holding that lock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "definitions.h"
+#include "record.h"
+#include "blob.h"
+#include "lock.h"
+#include "shard.h"
+#include "stats.h"
+#include "snapshot.h"
+
+// File descriptor of snapshot.lock of the snapshot this process has open, holding the shared lock on it
+static int snapshotFd = -1;
+
+/**
+ * @brief Small function to format the path of a snapshot's directory into a buffer of PATH_SIZE bytes
+*/
+static char* snapshotDir(char* path, int number){
+    snprintf(path, PATH_SIZE, SNAPSHOT_PATH, number);
+    return path;
+}
+
+/**
+ * @brief   Small function to format the path of a file in a snapshot's directory into a buffer of PATH_SIZE bytes. A
+ *          path too long for the buffer is left empty rather than cut short, so it can't name a different file
+*/
+static char* snapshotFile(char* path, int number, const char* name){
+    if (snprintf(path, PATH_SIZE, SNAPSHOT_PATH "/%s", number, name) >= PATH_SIZE) path[0] = '\0';
+    return path;
+}
+
+/**
+ * @brief Small function to get the number of a snapshot from the name of its directory, or 0 if it isn't one
+*/
+static int snapshotNumber(const char* name){
+    int number, end = 0;
+    if (sscanf(name, SNAPSHOT_PATH "%n", &number, &end) != 1 || name[end] != '\0' || number < 1) return 0;
+    return number;
+}
+
+/**
+ * @brief Small function to check whether a snapshot has been fully taken and not dropped, so it can be read
+*/
+static int snapshotReady(int number){
+    char path[PATH_SIZE];
+    return access(snapshotFile(path, number, SNAPSHOT_INFO_PATH), F_OK) == 0 &&
+        access(snapshotFile(path, number, SNAPSHOT_DROPPED_PATH), F_OK) != 0;
+}
+
+/**
+ * @brief   Takes, or tests, a lock on the whole of a snapshot's snapshot.lock
+ * @param[in]   fd      File descriptor of snapshot.lock
+ * @param[in]   type    F_RDLCK to read the snapshot, F_WRLCK to take or remove it
+ * @param[in]   wait    Whether to wait for the lock. If 0, fails at once if another process holds it
+ * @return  Returns 0 on success, -1 on failure
+*/
+static int lockSnapshot(int fd, short type, int wait){
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == -1){
+        if (errno == EINTR) continue;
+        if (wait) perror("Error locking " SNAPSHOT_LOCK_PATH "\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Opens a snapshot's snapshot.lock and takes the shared lock on it, so the snapshot isn't removed while it is
+ *          read. Fails if the snapshot doesn't exist, is still being taken or has been dropped
+ * @return  Returns the file descriptor holding the lock, or -1 on failure
+*/
+static int holdSnapshot(int number){
+    char path[PATH_SIZE];
+    int fd = number > 0 ? open(snapshotFile(path, number, SNAPSHOT_LOCK_PATH), O_RDWR) : -1;
+    if (fd != -1 && lockSnapshot(fd, F_RDLCK, 1) == 0 && snapshotReady(number)) return fd;
+    fprintf(stderr, "Snapshot %d does not exist\n", number);
+    if (fd != -1) close(fd);
+    return -1;
+}
+
+/**
+ * @brief Small function to read a snapshot's snapshot.info
+*/
+static int readSnapshotInfo(int number, SnapshotInfo* info){
+    char path[PATH_SIZE];
+    long int taken = 0;
+    FILE* file = fopen(snapshotFile(path, number, SNAPSHOT_INFO_PATH), "r");
+    memset(info, 0, sizeof(SnapshotInfo));
+    int result = file != NULL && fscanf(file, "taken %ld shards %d", &taken, &info -> shards) == 2 &&
+        info -> shards > 0 && info -> shards <= MAX_SHARDS ? 0 : -1;
+    for (int i = 0; i < info -> shards && result == 0; i++){
+        SnapshotShard* shard = &info -> shard[i];
+        if (fscanf(file, " %*d data %ld blob %u %ld", &shard -> dataSize, &shard -> generation, &shard -> blobSize) != 3)
+            result = -1;
+    }
+    if (file != NULL) fclose(file);
+    if (result != 0) fprintf(stderr, "Error reading %s\n", path);
+    info -> taken = taken;
+    return result;
+}
+
+/**
+ * @brief   Writes a snapshot's snapshot.info, then syncs the snapshot's directory. The file is written under another
+ *          name and renamed into place, so it only appears once complete
+*/
+static int writeSnapshotInfo(int number, SnapshotInfo* info){
+    char path[PATH_SIZE], tempPath[PATH_SIZE];
+    snapshotFile(tempPath, number, SNAPSHOT_INFO_PATH ".tmp");
+    FILE* file = fopen(tempPath, "w");
+    if (file == NULL){
+        perror("Error creating " SNAPSHOT_INFO_PATH "\n");
+        return -1;
+    }
+    fprintf(file, "taken %ld\nshards %d\n", (long int)info -> taken, info -> shards);
+    for (int i = 0; i < info -> shards; i++){
+        SnapshotShard* shard = &info -> shard[i];
+        fprintf(file, "%d data %ld blob %u %ld\n", i, shard -> dataSize, shard -> generation, shard -> blobSize);
+    }
+    int result = fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+    if (fclose(file) != 0 || result != 0 || rename(tempPath, snapshotFile(path, number, SNAPSHOT_INFO_PATH)) != 0){
+        perror("Error writing " SNAPSHOT_INFO_PATH "\n");
+        return -1;
+    }
+    int dir = open(snapshotDir(path, number), O_RDONLY);
+    if (dir != -1){
+        fsync(dir);
+        close(dir);
+    }
+    return 0;
+}
+
+/**
+ * @brief Small function to remove a snapshot's directory and everything in it. Its lock must be held exclusively
+*/
+static int removeSnapshot(int number){
+    char path[PATH_SIZE];
+    DIR* dir = opendir(snapshotDir(path, number));
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL){
+        if (strcmp(entry -> d_name, ".") != 0 && strcmp(entry -> d_name, "..") != 0)
+            unlink(snapshotFile(path, number, entry -> d_name));
+    }
+    if (dir != NULL) closedir(dir);
+    return rmdir(snapshotDir(path, number));
+}
+
+/**
+ * @brief   Lists the numbers of every snapshot in the database's directory, including ones still being taken or dropped
+ * @param[out]  count   On return, holds the number of snapshots
+ * @return  Returns a malloc'd array of the numbers in ascending order, to be freed by the caller, or NULL on failure
+*/
+static int* findSnapshots(int* count){
+    size_t capacity = 16;
+    int* numbers = malloc(capacity*sizeof(int));
+    DIR* dir = opendir(".");
+    struct dirent* entry;
+    *count = 0;
+    if (numbers == NULL || dir == NULL){
+        perror("Error listing snapshots\n");
+        free(numbers);
+        if (dir != NULL) closedir(dir);
+        return NULL;
+    }
+    while ((entry = readdir(dir)) != NULL){
+        int number = snapshotNumber(entry -> d_name);
+        if (number == 0) continue;
+        if ((size_t)*count == capacity){
+            int* grown = realloc(numbers, 2*capacity*sizeof(int));
+            if (grown == NULL) break;
+            numbers = grown;
+            capacity *= 2;
+        }
+        numbers[(*count)++] = number;
+    }
+    closedir(dir);
+    // Insertion sort, as there are rarely more than a few snapshots
+    for (int i = 1; i < *count; i++){
+        int number = numbers[i], j = i;
+        for (; j > 0 && numbers[j - 1] > number; j--) numbers[j] = numbers[j - 1];
+        numbers[j] = number;
+    }
+    return numbers;
+}
+
+/**
+ * @brief   Removes every snapshot that has been dropped, or was left part way through being taken, e.g. by a crash, and
+ *          that no process is reading or taking. Called whenever a snapshot is taken, dropped or closed after a drop
+ * @return  Returns the number of snapshots removed
+*/
+int collectSnapshots(void){
+    char path[PATH_SIZE];
+    int count, removed = 0;
+    int* numbers = findSnapshots(&count);
+    for (int i = 0; i < count; i++){
+        int number = numbers[i];
+        if (access(snapshotFile(path, number, SNAPSHOT_INFO_PATH), F_OK) == 0 &&
+            access(snapshotFile(path, number, SNAPSHOT_DROPPED_PATH), F_OK) != 0) continue;
+        // Without a lock file the snapshot is either empty or has only just been created, and rmdir leaves it alone
+        int fd = open(snapshotFile(path, number, SNAPSHOT_LOCK_PATH), O_RDWR);
+        if (fd == -1){
+            if (rmdir(snapshotDir(path, number)) == 0) removed++;
+            continue;
+        }
+        if (lockSnapshot(fd, F_WRLCK, 0) == 0 && removeSnapshot(number) == 0) removed++;
+        close(fd);
+    }
+    free(numbers);
+    return removed;
+}
+
+/**
+ * @brief   Adds one shard's files to a snapshot being taken. The shard's LOCK_DATA must be held, so its files don't
+ *          change while they are linked and copied
+ * @param[in]   db      Open database
+ * @param[in]   number  Number of the snapshot
+ * @param[in]   shard   Number of the shard
+ * @param[out]  state   On return, holds the size of each of the shard's files
+ * @return  Returns 0 on success, -1 on failure
+*/
+static int snapshotShard(Database* db, int number, int shard, SnapshotShard* state){
+    char path[PATH_SIZE], name[PATH_SIZE], linked[PATH_SIZE];
+    struct stat st;
+    int data = fileno(db -> data[shard]), index = fileno(db -> index[shard]);
+    state -> generation = blobGeneration(db -> data[shard]);
+    int blob = openBlob(shard, state -> generation, 0);
+    // The snapshot links the same files as the live database, so they are synced now rather than when it next commits
+    if (fstat(data, &st) != 0 || fdatasync(data) != 0 || (blob != -1 && fdatasync(blob) != 0)){
+        perror("Error syncing shard to snapshot\n");
+        return -1;
+    }
+    state -> dataSize = st.st_size;
+    state -> blobSize = blob == -1 || fstat(blob, &st) != 0 ? 0 : st.st_size;
+    if (link(shardPath(path, DATA_PATH, shard), snapshotFile(linked, number, shardPath(name, DATA_PATH, shard))) != 0 ||
+        (blob != -1 && link(blobPath(path, shard, state -> generation),
+            snapshotFile(linked, number, blobPath(name, shard, state -> generation))) != 0)){
+        perror("Error linking shard to snapshot\n");
+        return -1;
+    }
+    int copy = open(snapshotFile(linked, number, shardPath(name, INDEX_PATH, shard)), O_RDWR | O_CREAT | O_EXCL, 0644);
+    int result = copy != -1 && fstat(index, &st) == 0 && copyBlob(index, 0, st.st_size, copy) != -1 &&
+        fsync(copy) == 0 ? 0 : -1;
+    if (result != 0) perror("Error copying index to snapshot\n");
+    if (copy != -1) close(copy);
+    return result;
+}
+
+/**
+ * @brief   Takes a snapshot of the whole database, numbered one past the highest snapshot kept. Readers carry on
+ *          while it is taken, and writers wait only until every shard's index has been copied
+ * @param[in]   db      Open database
+ * @param[in]   out     Stream the snapshot's number is printed to
+ * @return  Returns 0 on success, -1 on failure
+*/
+int createSnapshot(Database* db, FILE* out){
+    char path[PATH_SIZE];
+    SnapshotInfo info;
+    int count, fd = -1, locked = 0, result = 0;
+    collectSnapshots();
+    int* numbers = findSnapshots(&count);
+    if (numbers == NULL) return -1;
+    int number = count > 0 ? numbers[count - 1] + 1 : 1;
+    free(numbers);
+    // Another process may be taking a snapshot with the same number, in which case the next number is tried
+    while (fd == -1){
+        if (mkdir(snapshotDir(path, number), 0755) != 0){
+            if (errno == EEXIST && number++ < INT_MAX) continue;
+            perror("Error creating snapshot directory\n");
+            return -1;
+        }
+        fd = open(snapshotFile(path, number, SNAPSHOT_LOCK_PATH), O_RDWR | O_CREAT, 0644);
+        if (fd == -1 || lockSnapshot(fd, F_WRLCK, 1) != 0){
+            perror("Error creating " SNAPSHOT_LOCK_PATH "\n");
+            if (fd != -1) close(fd);
+            rmdir(snapshotDir(path, number));
+            return -1;
+        }
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.taken = time(NULL);
+    info.shards = db -> shards;
+    // Hold every shard at once, as a scan does, so the snapshot sees one point in time across all of them
+    while (locked < db -> shards && result == 0){
+        result = beginRead(db -> data[locked], db -> index[locked], locked);
+        if (result == 0) locked++;
+    }
+    for (int i = 0; i < db -> shards && result == 0; i++) result = snapshotShard(db, number, i, &info.shard[i]);
+    for (int i = 0; i < locked; i++) endRead(i);
+    if (result == 0) result = writeSnapshotInfo(number, &info);
+    if (result != 0){
+        fprintf(stderr, "Error taking snapshot %d\n", number);
+        removeSnapshot(number);
+    }
+    else fprintf(out, "Snapshot %d taken\n", number);
+    close(fd);
+    return result;
+}
+
+/**
+ * @brief   Opens a snapshot in place of the live database, read only. The process moves into the snapshot's directory,
+ *          so the shards' blob files are found there, and stops taking locks to read, see useSnapshotReads
+ * @param[out]  db      On return, holds the open files of every shard of the snapshot
+ * @param[in]   number  Number of the snapshot
+ * @return  Returns 0 on success, -1 on failure
+*/
+int openSnapshot(Database* db, int number){
+    char path[PATH_SIZE];
+    SnapshotInfo info;
+    memset(db, 0, sizeof(Database));
+    // Stats are those of the live database, so are mapped before leaving its directory
+    openStats();
+    int fd = holdSnapshot(number);
+    if (fd == -1) return -1;
+    if (readSnapshotInfo(number, &info) != 0){
+        close(fd);
+        return -1;
+    }
+    if (chdir(snapshotDir(path, number)) != 0){
+        perror("Error opening snapshot\n");
+        close(fd);
+        return -1;
+    }
+    snapshotFd = fd;
+    db -> snapshot = number;
+    db -> shards = info.shards;
+    for (int i = 0; i < db -> shards; i++){
+        db -> data[i] = fopen(shardPath(path, DATA_PATH, i), "r");
+        db -> index[i] = fopen(shardPath(path, INDEX_PATH, i), "r");
+        if (db -> data[i] == NULL || db -> index[i] == NULL){
+            perror("Error opening snapshot file\n");
+            closeDatabase(db);
+            return -1;
+        }
+    }
+    useSnapshotReads();
+    return 0;
+}
+
+/**
+ * @brief   Closes the snapshot opened by openSnapshot, once its files have been closed, releasing the lock on it. If it
+ *          has been dropped meanwhile, it is removed now unless another process is still reading it
+*/
+void closeSnapshot(int number){
+    char path[PATH_SIZE];
+    if (snapshotFd == -1) return;
+    close(snapshotFd);
+    snapshotFd = -1;
+    if (chdir("..") != 0) return;
+    if (access(snapshotFile(path, number, SNAPSHOT_DROPPED_PATH), F_OK) == 0) collectSnapshots();
+}
+
+/**
+ * @brief   Drops a snapshot, so it can no longer be opened. It is removed now, or by the last process reading it when
+ *          that process closes it
+ * @param[in]   number  Number of the snapshot
+ * @param[in]   out     Stream the outcome is printed to
+ * @return  Returns 0 on success, -1 on failure
+*/
+int dropSnapshot(int number, FILE* out){
+    char path[PATH_SIZE];
+    if (number < 1 || !snapshotReady(number)){
+        fprintf(stderr, "Snapshot %d does not exist\n", number);
+        return -1;
+    }
+    int fd = open(snapshotFile(path, number, SNAPSHOT_DROPPED_PATH), O_WRONLY | O_CREAT, 0644);
+    if (fd == -1){
+        perror("Error dropping snapshot\n");
+        return -1;
+    }
+    close(fd);
+    collectSnapshots();
+    if (access(snapshotDir(path, number), F_OK) == 0)
+        fprintf(out, "Snapshot %d dropped, and will be removed once no process is reading it\n", number);
+    else fprintf(out, "Snapshot %d removed\n", number);
+    return 0;
+}
+
+/**
+ * @brief   Prints every snapshot, with the time it was taken, whether a process is reading it, and the bytes it alone
+ *          keeps on disk, i.e. its copies of the indexes and any files the live database has since replaced
+ * @param[in]   out     Stream to print to
+ * @return  Returns 0 on success, -1 on failure
+*/
+int listSnapshots(FILE* out){
+    char path[PATH_SIZE], taken[32];
+    SnapshotInfo info;
+    int count, listed = 0;
+    int* numbers = findSnapshots(&count);
+    if (numbers == NULL) return -1;
+    for (int i = 0; i < count; i++){
+        int number = numbers[i];
+        if (access(snapshotFile(path, number, SNAPSHOT_INFO_PATH), F_OK) != 0 || readSnapshotInfo(number, &info) != 0)
+            continue;
+        // A process reading the snapshot holds a shared lock, which conflicts with an exclusive one
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        int fd = open(snapshotFile(path, number, SNAPSHOT_LOCK_PATH), O_RDWR);
+        int reading = fd != -1 && fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+        if (fd != -1) close(fd);
+        long long int held = 0;
+        DIR* dir = opendir(snapshotDir(path, number));
+        struct dirent* entry;
+        struct stat st;
+        while (dir != NULL && (entry = readdir(dir)) != NULL){
+            if (stat(snapshotFile(path, number, entry -> d_name), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1)
+                held += st.st_size;
+        }
+        if (dir != NULL) closedir(dir);
+        strftime(taken, sizeof(taken), "%Y-%m-%d %H:%M:%S", localtime(&info.taken));
+        fprintf(out, "Snapshot %d\ttaken %s\t%s\t%lld bytes held\n", number, taken,
+            !snapshotReady(number) ? "dropped" : reading ? "in use" : "idle", held);
+        listed++;
+    }
+    if (listed == 0) fprintf(out, "No snapshots\n");
+    free(numbers);
+    return 0;
+}
+
+/**
+ * @brief   Copies one file of a snapshot to a backup, up to the size it had when the snapshot was taken
+ * @param[in]   from    Path of the file in the snapshot
+ * @param[in]   to      Path of the copy, which must not exist
+ * @param[in]   length  Bytes to copy, or -1 for the whole file
+ * @return  Returns 0 on success, -1 on failure
+*/
+static int backupFile(const char* from, const char* to, long int length){
+    struct stat st;
+    int in = open(from, O_RDONLY);
+    int out = in == -1 ? -1 : open(to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    int result = out != -1 && fstat(in, &st) == 0 ? 0 : -1;
+    if (result == 0 && (length == -1 || length > st.st_size)) length = st.st_size;
+    if (result == 0 && (copyBlob(in, 0, length, out) == -1 || fsync(out) != 0)) result = -1;
+    if (result != 0) fprintf(stderr, "Error copying %s to %s\n", from, to);
+    if (in != -1) close(in);
+    if (out != -1) close(out);
+    return result;
+}
+
+/**
+ * @brief   Copies a snapshot to a new directory, as a database of its own that can be used as it is, e.g. to restore
+ *          from. The database is copied as it was when the snapshot was taken, however much the live one has changed
+ *          since, and writers are never blocked
+ * @param[in]   number  Number of the snapshot
+ * @param[in]   dir     Path of the directory to create the database in, which must not exist
+ * @param[in]   out     Stream the outcome is printed to
+ * @return  Returns 0 on success, -1 on failure
+*/
+int backupSnapshot(int number, const char* dir, FILE* out){
+    char path[PATH_SIZE], name[PATH_SIZE], copy[PATH_MAX];
+    SnapshotInfo info;
+    int fd = holdSnapshot(number);
+    if (fd == -1) return -1;
+    int result = readSnapshotInfo(number, &info);
+    if (result == 0 && mkdir(dir, 0755) != 0){
+        perror("Error creating backup directory\n");
+        result = -1;
+    }
+    for (int i = 0; i < info.shards && result == 0; i++){
+        SnapshotShard* shard = &info.shard[i];
+        snprintf(copy, PATH_MAX, "%s/%s", dir, shardPath(name, DATA_PATH, i));
+        result = backupFile(snapshotFile(path, number, name), copy, shard -> dataSize);
+        snprintf(copy, PATH_MAX, "%s/%s", dir, shardPath(name, INDEX_PATH, i));
+        if (result == 0) result = backupFile(snapshotFile(path, number, name), copy, -1);
+        snprintf(copy, PATH_MAX, "%s/%s", dir, blobPath(name, i, shard -> generation));
+        if (result == 0 && shard -> blobSize > 0)
+            result = backupFile(snapshotFile(path, number, name), copy, shard -> blobSize);
+    }
+    close(fd);
+    if (result == 0) fprintf(out, "Backed up snapshot %d to %s\n", number, dir);
+    return result;
+}
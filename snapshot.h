@@ -0,0 +1,32 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief State of one shard when a snapshot was taken
+*/
+typedef struct snapshot_shard{
+    long int dataSize;      // Size of the data file. Anything appended to it since is not part of the snapshot
+    uint32_t generation;    // Generation of the blob file the data file refers to
+    long int blobSize;      // Size of the blob file, 0 if there is none
+} SnapshotShard;
+
+/**
+ * @brief Contents of a snapshot's snapshot.info, written once every file of the snapshot is in place
+*/
+typedef struct snapshot_info{
+    time_t taken;
+    int shards;
+    SnapshotShard shard[MAX_SHARDS];
+} SnapshotInfo;
+
+int createSnapshot(Database* db, FILE* out);
+int openSnapshot(Database* db, int number);
+void closeSnapshot(int number);
+int dropSnapshot(int number, FILE* out);
+int collectSnapshots(void);
+int listSnapshots(FILE* out);
+int backupSnapshot(int number, const char* dir, FILE* out);
+#endif
@@ -0,0 +1,258 @@
+/**
+ * @brief   Function definitions for the database's built in stats: a count and latency histogram for each operation and
+ *          each phase of one (e.g. the index probe of a get, or the append and index update of a set), bytes read and
+ *          written, from which write amplification is worked out, and the number of requests for each key prefix.
+ *          The stats are kept in kvdb.stats, which every process maps shared and adds to with atomic instructions, so
+ *          they cover every ./kvdb command and server since they were last reset, without any locking. ./kvdb stats
+ *          prints them, as does a "stats" request to a server.
+ *          Setting KVDB_STATS to 0 turns them off, e.g. to measure their cost.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "definitions.h"
+#include "index.h"
+#include "get.h"
+#include "stats.h"
+
+// Mapping of kvdb.stats, or NULL if stats are off or it could not be opened
+static StatsFile* stats = NULL;
+// Number of index builds in progress in this process, which may be nested, e.g. a rebuild started by loading an index
+static int indexBuilds = 0;
+
+static const char* opNames[STAT_OPS] = {"get", "set", "del", "scan", "load", "index probe", "data read", "append",
+    "index update", "group commit", "sync", "compact", "rename", "mget",
+    "reindex"};
+
+/**
+ * @brief   Maps kvdb.stats, creating it if needed. A file holding stats in another layout is started afresh
+ * @return  Returns 0 on success or if stats are turned off, -1 on failure, in which case nothing is recorded
+*/
+int openStats(void){
+    struct stat st;
+    char* env = getenv("KVDB_STATS");
+    if (stats != NULL || (env != NULL && strcmp(env, "0") == 0)) return 0;
+    int fd = open(STATS_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd == -1 || fstat(fd, &st) != 0 || ((size_t)st.st_size != sizeof(StatsFile) &&
+        ftruncate(fd, sizeof(StatsFile)) != 0)){
+        perror("Error opening " STATS_PATH "\n");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    void* base = mmap(NULL, sizeof(StatsFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED){
+        perror("Error mapping " STATS_PATH "\n");
+        return -1;
+    }
+    stats = base;
+    if (__atomic_load_n(&stats -> magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || stats -> version != STATS_VERSION){
+        memset(stats, 0, sizeof(StatsFile));
+        stats -> version = STATS_VERSION;
+        stats -> since = time(NULL);
+        __atomic_store_n(&stats -> magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * @brief   Small function to get the time an operation starts, to be passed to recordOp
+ * @return  Returns a monotonic time in nanoseconds, or 0 if stats are off, which saves reading the clock
+*/
+uint64_t statsClock(void){
+    struct timespec ts;
+    if (stats == NULL) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Small function to get the histogram bucket of a latency: the power of two below it, and which quarter of it
+*/
+static int bucketOf(uint64_t ns){
+    if (ns < 4) return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int bucket = 4*(msb - 1) + ((ns >> (msb - 2)) & 3);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/**
+ * @brief Small function to get the latency, in nanoseconds, at the top of a histogram bucket
+*/
+static uint64_t bucketLimit(int bucket){
+    if (bucket < 4) return bucket + 1;
+    int shift = bucket/4 - 1;
+    return (uint64_t)(4 + bucket%4 + 1) << shift;
+}
+
+/**
+ * @brief   Records that an operation, or a phase of one, has finished
+ * @param[in]   op      Operation, one of the STAT_ ops in stats.h
+ * @param[in]   start   Time the operation started, from statsClock
+*/
+void recordOp(int op, uint64_t start){
+    if (stats == NULL) return;
+    uint64_t ns = statsClock() - start;
+    OpStats* opStats = &stats -> ops[op];
+    __atomic_fetch_add(&opStats -> count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&opStats -> totalNs, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&opStats -> buckets[bucketOf(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Small function to add to one of the STAT_ counters in stats.h
+*/
+void addStat(int counter, uint64_t amount){
+    if (counter == STAT_INDEX_BYTES && indexBuilds > 0) counter = STAT_BUILD_BYTES;
+    if (stats != NULL) __atomic_fetch_add(&stats -> counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief   Starts counting the index pages this process writes as STAT_BUILD_BYTES rather than STAT_INDEX_BYTES, until the
+ *          matching endIndexBuild. Building an index writes every page of it, however few bytes caused the build, so it
+ *          is kept out of write amplification
+*/
+void beginIndexBuild(void){
+    indexBuilds++;
+}
+
+/**
+ * @brief Small function to end an index build started by beginIndexBuild
+*/
+void endIndexBuild(void){
+    indexBuilds--;
+}
+
+/**
+ * @brief   Counts a request for a key against the key's prefix: the letters and digits it starts with, up to the first
+ *          other character, e.g. "user" for "user:42". Keys with no such separator near the start, and prefixes there
+ *          is no room left for in the table, are counted as other.
+ * @param[in]   key     Null terminated key
+ * @param[in]   op      STAT_GET, STAT_SET or STAT_DEL
+*/
+void recordPrefix(const char* key, int op){
+    if (stats == NULL) return;
+    size_t length = 0;
+    while (length < STATS_PREFIX_SIZE - 1 && ((key[length] >= 'a' && key[length] <= 'z') ||
+        (key[length] >= 'A' && key[length] <= 'Z') || (key[length] >= '0' && key[length] <= '9'))) length++;
+    if (length == 0 || length == STATS_PREFIX_SIZE - 1 || key[length] == '\0'){
+        __atomic_fetch_add(&stats -> otherPrefixes[op], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint64_t hash = hashBytes(key, length) | 1;
+    for (int i = 0; i < STATS_PROBES; i++){
+        PrefixStats* slot = &stats -> prefixes[(hash + i) % STATS_PREFIXES];
+        uint64_t taken = __atomic_load_n(&slot -> hash, __ATOMIC_ACQUIRE);
+        if (taken == 0){
+            // Whoever takes the slot fills in the prefix. Losing the race to the same prefix is as good as winning it
+            if (__atomic_compare_exchange_n(&slot -> hash, &taken, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                memcpy(slot -> prefix, key, length);
+                taken = hash;
+            }
+        }
+        if (taken == hash){
+            __atomic_fetch_add(&slot -> requests[op], 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&stats -> otherPrefixes[op], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief   Clears the stats, e.g. before measuring a workload. Anything recorded by another process at the same time may
+ *          be lost
+ * @return  Returns 0 on success, -1 if stats are off
+*/
+int resetStats(void){
+    if (stats == NULL) return -1;
+    memset(stats -> ops, 0, sizeof(stats -> ops));
+    memset(stats -> counters, 0, sizeof(stats -> counters));
+    memset(stats -> otherPrefixes, 0, sizeof(stats -> otherPrefixes));
+    memset(stats -> prefixes, 0, sizeof(stats -> prefixes));
+    stats -> since = time(NULL);
+    return 0;
+}
+
+/**
+ * @brief Small function to get a percentile of a histogram in microseconds, rounded up to the top of its bucket
+*/
+static double percentile(OpStats* opStats, uint64_t count, double fraction){
+    uint64_t rank = count*fraction, seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++){
+        seen += opStats -> buckets[i];
+        if (seen > rank) return bucketLimit(i)/1000.0;
+    }
+    return bucketLimit(STATS_BUCKETS - 1)/1000.0;
+}
+
+/**
+ * @brief Comparison function for qsort. Orders prefixes by total requests, most first
+*/
+static int compareRequests(const void* a, const void* b){
+    const PrefixStats* x = a;
+    const PrefixStats* y = b;
+    uint64_t xTotal = x -> requests[0] + x -> requests[1] + x -> requests[2];
+    uint64_t yTotal = y -> requests[0] + y -> requests[1] + y -> requests[2];
+    return (xTotal < yTotal) - (xTotal > yTotal);
+}
+
+/**
+ * @brief   Prints the stats: latency of each operation and phase, bytes read and written, write amplification and the
+ *          most requested prefixes. Other processes may be adding to them while they are printed
+ * @param[in]   out     Stream to print to
+*/
+void printStats(FILE* out){
+    if (stats == NULL){
+        fprintf(out, "Stats are turned off\n");
+        return;
+    }
+    fprintf(out, "Stats since ");
+    printTime(out, (time_t)stats -> since);
+    fprintf(out, "\n%-14s %12s %10s %10s %10s %10s\n", "Operation", "Count", "Mean us", "p50 us", "p99 us", "p999 us");
+    for (int op = 0; op < STAT_OPS; op++){
+        OpStats copy = stats -> ops[op];
+        // Counts are read before the buckets they add up to, so the percentiles may count later operations
+        uint64_t count = copy.count;
+        if (count == 0) continue;
+        fprintf(out, "%-14s %12lu %10.1f %10.1f %10.1f %10.1f\n", opNames[op], (unsigned long)count,
+            copy.totalNs/1000.0/count, percentile(&copy, count, 0.5), percentile(&copy, count, 0.99),
+            percentile(&copy, count, 0.999));
+    }
+    uint64_t* c = stats -> counters;
+    uint64_t probes = stats -> ops[STAT_INDEX_PROBE].count;
+    uint64_t written = c[STAT_DATA_BYTES] + c[STAT_INDEX_BYTES] + c[STAT_REWRITE_BYTES];
+    fprintf(out, "Value bytes read:\t\t%lu\n", (unsigned long)c[STAT_BYTES_READ]);
+    fprintf(out, "Key and value bytes written:\t%lu\n", (unsigned long)c[STAT_USER_BYTES]);
+    fprintf(out, "Bytes appended by writes:\t%lu\n", (unsigned long)c[STAT_DATA_BYTES]);
+    fprintf(out, "Bytes written to indexes:\t%lu\n", (unsigned long)c[STAT_INDEX_BYTES]);
+    fprintf(out, "Bytes building indexes:\t\t%lu (not in write amplification)\n", (unsigned long)c[STAT_BUILD_BYTES]);
+    fprintf(out, "Bytes rewritten:\t\t%lu\n", (unsigned long)c[STAT_REWRITE_BYTES]);
+    fprintf(out, "Write amplification:\t\t%.2f\n", c[STAT_USER_BYTES] == 0 ? 0.0 : (double)written/c[STAT_USER_BYTES]);
+    fprintf(out, "Index pages per probe:\t\t%.2f\n", probes == 0 ? 0.0 : (double)c[STAT_INDEX_PAGES]/probes);
+    fprintf(out, "Probes ruled out by Bloom:\t%lu\n", (unsigned long)c[STAT_BLOOM_REJECTS]);
+    fprintf(out, "Entries read per scanned key:\t%.2f\n",
+        c[STAT_SCAN_KEYS] == 0 ? 0.0 : (double)c[STAT_SCAN_ENTRIES]/c[STAT_SCAN_KEYS]);
+    fprintf(out, "Entries read by compaction:\t%lu\n", (unsigned long)c[STAT_COMPACT_ENTRIES]);
+    uint64_t lookups = c[STAT_CACHE_HITS] + c[STAT_CACHE_MISSES];
+    fprintf(out, "Cache hits and misses:\t\t%lu, %lu (%.1f%% hit)\n", (unsigned long)c[STAT_CACHE_HITS],
+        (unsigned long)c[STAT_CACHE_MISSES], lookups == 0 ? 0.0 : 100.0*c[STAT_CACHE_HITS]/lookups);
+
+    PrefixStats prefixes[STATS_PREFIXES];
+    memcpy(prefixes, stats -> prefixes, sizeof(prefixes));
+    qsort(prefixes, STATS_PREFIXES, sizeof(PrefixStats), compareRequests);
+    fprintf(out, "%-*s %12s %12s %12s\n", STATS_PREFIX_SIZE, "Prefix", "Gets", "Sets", "Dels");
+    for (int i = 0; i < STATS_TOP_PREFIXES && prefixes[i].hash != 0; i++){
+        PrefixStats* p = &prefixes[i];
+        fprintf(out, "%-*.*s %12lu %12lu %12lu\n", STATS_PREFIX_SIZE, STATS_PREFIX_SIZE - 1, p -> prefix,
+            (unsigned long)p -> requests[0], (unsigned long)p -> requests[1], (unsigned long)p -> requests[2]);
+    }
+    uint64_t* other = stats -> otherPrefixes;
+    if (other[0] + other[1] + other[2] > 0) fprintf(out, "%-*s %12lu %12lu %12lu\n", STATS_PREFIX_SIZE, "(other)",
+        (unsigned long)other[0], (unsigned long)other[1], (unsigned long)other[2]);
+}
@@ -0,0 +1,90 @@
+#ifndef STATS_H_
+#define STATS_H_
+#include <stdio.h>
+#include <stdint.h>
+
+// Operations, and phases of them, whose latency is recorded
+#define STAT_GET 0
+#define STAT_SET 1
+#define STAT_DEL 2
+#define STAT_SCAN 3
+#define STAT_LOAD 4
+#define STAT_INDEX_PROBE 5
+#define STAT_DATA_READ 6
+#define STAT_APPEND 7
+#define STAT_INDEX_UPDATE 8
+#define STAT_COMMIT 9
+#define STAT_SYNC 10
+#define STAT_COMPACT 11
+#define STAT_RENAME 12
+#define STAT_MGET 13
+#define STAT_REINDEX 14
+#define STAT_OPS 15
+// Counters
+#define STAT_BYTES_READ 0       // Value bytes returned by gets and scans
+#define STAT_USER_BYTES 1       // Key and value bytes of sets, dels and loaded lines
+#define STAT_DATA_BYTES 2       // Bytes appended to data and blob files by sets and dels
+#define STAT_INDEX_BYTES 3      // Bytes of pages and Bloom filter blocks written to index files
+#define STAT_REWRITE_BYTES 4    // Bytes written to data and blob files by compaction and load
+#define STAT_INDEX_PAGES 5      // Pages of the tree read by index probes
+#define STAT_BLOOM_REJECTS 6    // Index probes answered by the Bloom filter
+#define STAT_SCAN_ENTRIES 7     // Entries read by scans, including tombstones and keys out of range
+#define STAT_SCAN_KEYS 8        // Keys returned by scans
+#define STAT_COMPACT_ENTRIES 9  // Entries read by compaction
+#define STAT_CACHE_HITS 10      // Gets answered from a process's cache, see cache.c
+#define STAT_CACHE_MISSES 11    // Gets a process's cache couldn't answer
+#define STAT_BUILD_BYTES 12     // Bytes written to index files by creating, rebuilding or replaying an index, see
+                                // beginIndexBuild, rather than by sets and dels
+#define STAT_COUNTERS 13
+// Latency histogram buckets. Each power of two of nanoseconds is split into four buckets, up to 2^40ns
+#define STATS_BUCKETS 160
+// Hot prefix table: slots, slots probed for a prefix before it is counted as other, and longest prefix kept
+#define STATS_PREFIXES 256
+#define STATS_PROBES 16
+#define STATS_PREFIX_SIZE 24
+// Prefixes printed by ./kvdb stats
+#define STATS_TOP_PREFIXES 20
+#define STATS_MAGIC 0x5453564b
+#define STATS_VERSION 5
+
+/**
+ * @brief Latency histogram of an operation
+*/
+typedef struct op_stats{
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t buckets[STATS_BUCKETS];
+} OpStats;
+
+/**
+ * @brief   Requests for keys with one prefix. A slot is taken by setting hash, so two processes can't take the same one
+*/
+typedef struct prefix_stats{
+    uint64_t hash;          // Hash of the prefix, with the low bit set so a taken slot is never 0
+    char prefix[STATS_PREFIX_SIZE];
+    uint64_t requests[3];   // gets, sets and dels
+} PrefixStats;
+
+/**
+ * @brief Layout of kvdb.stats, which is mapped shared by every process using the database
+*/
+typedef struct stats_file{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t since;         // Time the stats were last reset, in seconds since 1/1/1970
+    OpStats ops[STAT_OPS];
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t otherPrefixes[3];  // Requests for prefixes there was no slot for
+    PrefixStats prefixes[STATS_PREFIXES];
+} StatsFile;
+
+int openStats(void);
+uint64_t statsClock(void);
+void recordOp(int op, uint64_t start);
+void addStat(int counter, uint64_t amount);
+void beginIndexBuild(void);
+void endIndexBuild(void);
+void recordPrefix(const char* key, int op);
+int resetStats(void);
+void printStats(FILE* out);
+#endif
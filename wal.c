@@ -0,0 +1,199 @@
+/**
+ * @brief   Function definitions for using data.bin as a write-ahead log. Every entry ends with a CRC32 of the rest of the
+ *          entry, so an entry torn by a crash part way through an append is detected and cut off when the log is
+ *          replayed. index.bin is never synced: it is marked dirty while a batch of writes is applied, and is rebuilt
+ *          from data.bin if a process died with it dirty, or if the machine has rebooted since it was last written,
+ *          as unsynced pages of it may have been lost.
+ *          How often data.bin is synced is set by KVDB_SYNC: "always" (the default) syncs every commit, "Nms" syncs
+ *          once N milliseconds have passed since the last sync, and "Nrecords" syncs once N writes have been committed
+ *          since the last sync. Writes committed since the last sync may be lost if the machine crashes, but never
+ *          partly applied.
+ *          Values in the shard's blob file, see blob.c, are written before the entries referring to them, and the blob
+ *          file is synced whenever data.bin is, before it. An entry that survived a crash without its value, e.g. if the
+ *          kernel wrote back data.bin but not the blob file, is treated as torn.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "definitions.h"
+#include "index.h"
+#include "get.h"
+#include "wal.h"
+#include "record.h"
+#include "blob.h"
+#include "stats.h"
+
+static SyncPolicy policy = {0, 0};
+
+/**
+ * @brief   Updates a CRC32 (IEEE 802.3 polynomial) with more bytes. Start with a crc of 0
+ * @param[in]   crc     CRC of the bytes so far
+ * @param[in]   buf     Bytes to be added
+ * @param[in]   length  Number of bytes
+ * @return  Returns the CRC of all the bytes
+*/
+uint32_t crc32Update(uint32_t crc, const void* buf, size_t length){
+    static uint32_t table[256];
+    if (table[1] == 0){
+        for (uint32_t i = 0; i < 256; i++){
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    const unsigned char* pos = buf;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) crc = table[(crc ^ pos[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/**
+ * @brief   Sets the sync policy from the value of KVDB_SYNC
+ * @param[in]   text    "always", "Nms" or "Nrecords", or NULL for the default of always
+ * @return  Returns 0 on success, -1 if the policy is not valid
+*/
+int setSyncPolicy(const char* text){
+    unsigned long long n;
+    char unit[16];
+    policy.records = policy.ms = 0;
+    if (text == NULL || strcmp(text, "always") == 0) return 0;
+    if (sscanf(text, "%llu%15s", &n, unit) == 2 && n > 0){
+        if (strcmp(unit, "ms") == 0){
+            policy.ms = n;
+            return 0;
+        }
+        if (strcmp(unit, "records") == 0){
+            policy.records = n;
+            return 0;
+        }
+    }
+    fprintf(stderr, "KVDB_SYNC must be always, Nms or Nrecords\n");
+    return -1;
+}
+
+/**
+ * @brief Small function to get how often a server should sync shards with writes still unsynced, in milliseconds
+ * @return  Returns the interval, or 0 if the policy does not sync on a timer
+*/
+uint64_t syncInterval(void){
+    return policy.ms;
+}
+
+/**
+ * @brief Small function to get the time in milliseconds, comparable between processes
+*/
+static uint64_t nowMs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**
+ * @brief   Identifies the current boot of the machine, so an index written before a reboot can be detected
+ * @return  Returns a hash of the kernel's boot id, or 0 if it is not available
+*/
+uint64_t currentBootId(void){
+    static uint64_t id = 0;
+    if (id != 0) return id;
+    char buf[64];
+    FILE* file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (file == NULL) return 0;
+    if (fgets(buf, sizeof(buf), file) != NULL){
+        buf[strcspn(buf, "\n")] = '\0';
+        id = hashKey(buf);
+    }
+    fclose(file);
+    return id;
+}
+
+/**
+ * @brief   Marks the index as being modified. Until the mark is cleared by syncLog, anyone loading the index will
+ *          rebuild it, as a process that dies part way through leaves the table partly updated.
+ * @param[in]   index   Pointer to index file
+*/
+int markIndexDirty(FILE* index){
+    IndexHeader header;
+    if (readIndexHeader(index, &header) != 0) return -1;
+    if (header.dirty) return 0;
+    header.dirty = 1;
+    if (writeIndexHeader(index, &header) != 0) return -1;
+    return fflush(index);
+}
+
+/**
+ * @brief   Cuts off anything after the last whole entry in the data file, e.g. an entry torn by a crash part way
+ *          through an append, so later appends follow on from the last whole entry. An entry whose value runs past
+ *          the end of the blob file is also torn.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   from    File offset of an entry known to be whole and to store its key in full, from which entries
+ *                      are checked, or 0 to check the whole file
+ * @param[in]   shard   Number of the shard the file belongs to
+ * @return  Returns the new size of the file, or -1 on failure
+*/
+long int truncateTorn(FILE* data, long int from, int shard){
+    Pair read;
+    char* readKey = NULL;
+    char* readValue = NULL;
+    uint64_t blob;
+    long int start = dataStart(data);
+    if (start == -1){
+        fprintf(stderr, "Data file is not in a known format\n");
+        return -1;
+    }
+    uint64_t blobEnd = blobSize(shard, blobGeneration(data));
+    // A file holding only part of its header is cut off entirely
+    long int end = from > start ? from : start;
+    fseek(data, end, SEEK_SET);
+    while (readPair(data, &read, &readKey, &readValue, &blob) == 1){
+        if (blob != NO_BLOB && blob + read.valueSize - 1 > blobEnd) break;
+        end = ftell(data);
+    }
+    free(readKey);
+    free(readValue);
+    fseek(data, 0, SEEK_END);
+    if (ftell(data) == end) return end;
+    fprintf(stderr, "Dropping %ld bytes torn from the end of the data file\n", ftell(data) - end);
+    if (fflush(data) != 0 || ftruncate(fileno(data), end) != 0){
+        perror("Error truncating data file\n");
+        return -1;
+    }
+    fseek(data, 0, SEEK_END);
+    return end;
+}
+
+/**
+ * @brief   Finishes applying a batch of writes. data.bin is synced if the policy says it is due, then the dirty mark is
+ *          cleared from the index. The index itself is not synced, see above.
+ * @param[in]   data    Pointer to data file
+ * @param[in]   index   Pointer to index file
+ * @param[in]   records Number of writes in the batch
+ * @param[in]   force   Sync any unsynced writes whatever the policy
+ * @return  Returns 0 on success, -1 on failure
+*/
+int syncLog(FILE* data, FILE* index, uint64_t records, int force){
+    IndexHeader header;
+    if (fflush(data) != 0 || readIndexHeader(index, &header) != 0) return -1;
+    header.unsyncedRecords += records;
+    uint64_t now = nowMs();
+    int due = policy.records == 0 && policy.ms == 0;
+    if (policy.records != 0 && header.unsyncedRecords >= policy.records) due = 1;
+    if (policy.ms != 0 && now - header.lastSync >= policy.ms) due = 1;
+    if (header.unsyncedRecords > 0 && (due || force)){
+        // Values in the blob file are synced first, so no entry synced to data.bin can refer to a lost value
+        int blob = openBlob(header.shard, blobGeneration(data), 0);
+        uint64_t start = statsClock();
+        if ((blob != -1 && fdatasync(blob) != 0) || fdatasync(fileno(data)) != 0){
+            perror("Error syncing data file\n");
+            return -1;
+        }
+        recordOp(STAT_SYNC, start);
+        header.unsyncedRecords = 0;
+        header.lastSync = now;
+    }
+    header.dirty = 0;
+    if (writeIndexHeader(index, &header) != 0) return -1;
+    return fflush(index);
+}
@@ -0,0 +1,22 @@
+#ifndef WAL_H_
+#define WAL_H_
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * @brief   When appends to data.bin are synced to storage. With both fields 0, every commit is synced. Otherwise the
+ *          data is synced once records writes have been committed since the last sync, or ms milliseconds have passed
+*/
+typedef struct sync_policy{
+    uint64_t records;
+    uint64_t ms;
+} SyncPolicy;
+
+uint32_t crc32Update(uint32_t crc, const void* buf, size_t length);
+int setSyncPolicy(const char* text);
+uint64_t syncInterval(void);
+uint64_t currentBootId(void);
+int markIndexDirty(FILE* index);
+long int truncateTorn(FILE* data, long int from, int shard);
+int syncLog(FILE* data, FILE* index, uint64_t records, int force);
+#endif